@@ -0,0 +1,36 @@
+/**
+ * @file		atomics.h
+ * @version		0.6
+ * @brief		sequentially consistent atomic operations for GCC and MSVC
+ * @date		Feb 25, 2020
+ * @author		Siwon Kang (kkangshawn@gmail.com)
+ */
+
+#ifndef ATOMICS_H_
+#define ATOMICS_H_
+
+/* int and long operands only, pointers go through the _PTR variants */
+#if defined (_MSC_VER)
+#include <windows.h>
+#define ATOMIC_LOAD(p)			InterlockedOr((volatile LONG *)(p), 0)
+#define ATOMIC_STORE(p, v)		InterlockedExchange((volatile LONG *)(p), (LONG)(v))
+#define ATOMIC_ADD(p, v)		InterlockedExchangeAdd((volatile LONG *)(p), (LONG)(v))
+#define ATOMIC_CAS(p, old, v)	(InterlockedCompareExchange((volatile LONG *)(p), (LONG)(v), (LONG)(old)) == (LONG)(old))
+#define ATOMIC_LOAD_PTR(p)		InterlockedCompareExchangePointer((PVOID volatile *)(p), NULL, NULL)
+#define ATOMIC_STORE_PTR(p, v)	InterlockedExchangePointer((PVOID volatile *)(p), (PVOID)(v))
+#define CPU_RELAX()				YieldProcessor()
+#else
+#define ATOMIC_LOAD(p)			__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE(p, v)		__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_ADD(p, v)		__atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_CAS(p, old, v)	__sync_bool_compare_and_swap((p), (old), (v))
+#define ATOMIC_LOAD_PTR(p)		__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE_PTR(p, v)	__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#if defined (__x86_64__) || defined (__i386__)
+#define CPU_RELAX()				__builtin_ia32_pause()
+#else
+#define CPU_RELAX()				__asm__ __volatile__("" ::: "memory")
+#endif
+#endif
+
+#endif /* ATOMICS_H_ */
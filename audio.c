@@ -7,9 +7,34 @@
  */
 
 #include "audio.h"
+#include "ring.h"
+#include "output.h"
+#include "cache.h"
+#include "unpack.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#if !defined (_WIN32)
+#include <unistd.h>
+#include <sys/mman.h>
+#else
+#include <io.h>
+#define open        _open
+#define read        _read
+#define close       _close
+#define lseek       _lseeki64
+#define dup         _dup
+#define STDIN_FILENO 0
+#endif
+#ifndef O_BINARY
+#define O_BINARY    0
+#endif
+
+/* the first fill of the read-ahead block, enough for any header */
+#define HEADER_READ_SIZE (64 * 1024)
 
 
-/* global data for get_audio.c. */
+/* per-job data for get_audio.c, gathered in enc_ctx_t below. */
 
 typedef enum ByteOrder { ByteOrderLittleEndian, ByteOrderBigEndian } ByteOrder;
 typedef enum sound_file_format_e {
@@ -25,6 +50,22 @@ typedef enum sound_file_format_e {
 } sound_file_format;
 
 
+/* Raw descriptor input with a large read-ahead block. Headers and samples are
+   parsed straight from the block, and the page cache behind the block is
+   released as the file is consumed. */
+typedef struct InFile {
+    int     fd;                 /* -1 if closed */
+    int     seekable;           /* regular file */
+    int     eof;
+    int     error;
+    unsigned char *buf;         /* read-ahead block, kept over jobs */
+    size_t  buf_size;           /* capacity of buf */
+    size_t  pos;                /* next byte in buf */
+    size_t  len;                /* bytes filled in buf */
+    long long offset;           /* file offset of buf[0] */
+    long long dropped;          /* file offset up to which the page cache is released */
+} InFile;
+
 struct PcmBuffer {
     void   *ch[2];           /* buffer for each channel */
     int     w;               /* sample width */
@@ -53,15 +94,21 @@ typedef struct get_audio_global_data_struct {
     int     pcmswapbytes;
     int     pcm_is_unsigned_8bit;
     int     pcm_is_ieee_float;
-    unsigned int num_samples_read;
-    FILE   *music_in;
+    unsigned long num_samples_read;
+    InFile  music_in;
+    size_t  readahead;          /* size of the read-ahead block */
+    int     no_map;             /* read regular files through the block as well */
+    unsigned char *map;         /* music_in mapped in memory, NULL to read from the block */
+    size_t  map_size;
+    size_t  map_pos;            /* offset of the next sample in map */
+    size_t  map_ahead;          /* offset up to which the mapping is prefetched */
+    hash64_t *hash;             /* fed every sample read, NULL if none */
     hip_t   hip;
     PcmBuffer pcm32;
     PcmBuffer pcm16;
     size_t  in_id3v2_size;
     unsigned char* in_id3v2_tag;
 } get_audio_global_data;
-static get_audio_global_data audio_data[NAME_MAX];
 
 typedef struct ReaderConfig
 {
@@ -70,13 +117,11 @@ typedef struct ReaderConfig
     int   swap_channel;             /* 0: no-op, 1: swaps input channels */
     int   input_samplerate;
 } ReaderConfig;
-ReaderConfig reader_config[NAME_MAX];
 
 typedef struct WriterConfig
 {
     int   flush_write;
 } WriterConfig;
-WriterConfig writer_config[NAME_MAX];
 
 typedef struct UiConfig
 {
@@ -85,8 +130,81 @@ typedef struct UiConfig
     int   print_clipping_info;      /* print info whether waveform clips */
     float update_interval;          /* to use Frank's time status display */
 } UiConfig;
-UiConfig ui_config[NAME_MAX];
 
+/**
+ * @brief   Per-job encoder context. Everything the encode path used to keep in
+ *          process-global arrays lives here, so the path is reentrant and a
+ *          worker can recycle one context for any number of jobs.
+ *          Aligned to a cache line so that contexts of different workers never
+ *          share one.
+ */
+struct CACHE_ALIGNED enc_ctx {
+    get_audio_global_data audio_data;
+    ReaderConfig reader_config;
+    WriterConfig writer_config;
+    UiConfig ui_config;
+};
+
+
+enc_ctx_t *
+enc_ctx_new(void)
+{
+    enc_ctx_t *ctx;
+    size_t const size = (sizeof(enc_ctx_t) + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+
+#if defined (_WIN32)
+    ctx = (enc_ctx_t *) _aligned_malloc(size, CACHE_LINE_SIZE);
+#else
+    if (posix_memalign((void **) &ctx, CACHE_LINE_SIZE, size) != 0)
+        ctx = NULL;
+#endif
+    if (ctx != NULL) {
+        memset(ctx, 0, size);
+        ctx->audio_data.music_in.fd = -1;
+        ctx->audio_data.readahead = READAHEAD_DEFAULT;
+    }
+
+    return ctx;
+}
+
+/* Set the size of the read-ahead block used for the next input files */
+void
+enc_ctx_set_readahead(enc_ctx_t * ctx, size_t size)
+{
+    if (size < HEADER_READ_SIZE)
+        size = HEADER_READ_SIZE;
+    ctx->audio_data.readahead = size;
+}
+
+/* Let the next input files be mapped in memory, which is the default. A file
+   truncated while it is mapped raises SIGBUS, so a file which may still be
+   rewritten is better read. */
+void
+enc_ctx_set_map(enc_ctx_t * ctx, int map)
+{
+    ctx->audio_data.no_map = !map;
+}
+
+/* Feed the samples of the opened input to a hash as they are read, NULL to stop */
+void
+enc_ctx_set_hash(enc_ctx_t * ctx, hash64_t * hash)
+{
+    ctx->audio_data.hash = hash;
+}
+
+void
+enc_ctx_free(enc_ctx_t * ctx)
+{
+    if (ctx == NULL)
+        return;
+    close_infile(ctx);
+    free(ctx->audio_data.music_in.buf);
+#if defined (_WIN32)
+    _aligned_free(ctx);
+#else
+    free(ctx);
+#endif
+}
 
 static void
 initPcmBuffer(PcmBuffer * b, int w)
@@ -188,85 +306,62 @@ takePcmBuffer(PcmBuffer * b, void *a0, void *a1, int a_n, int mm)
 }
 
 static int
-get_audio_common(lame_t gfp, int buffer[2][1152], short buffer16[2][1152], int num_file);
+get_audio_common(lame_t gfp, int *left, int *right, enc_ctx_t *ctx);
+static size_t
+min_size_t(size_t a, size_t b);
+static size_t
+infile_fill(InFile * in, size_t need);
+static void
+map_advance(enc_ctx_t *ctx);
 
 /************************************************************************
 unpack_read_samples - read and unpack signed low-to-high byte or unsigned
                       single byte input. (used for read_samples function)
                       Output integers are stored in the native byte order
                       (little or big endian).  -jd
+                      The kernel for the format is picked by the CPU, see
+                      unpack.c. Stereo samples are split into the two
+                      channels by the same kernel. IEEE float samples keep
+                      their bits, see encode_buffer().
   in: samples_to_read
       bytes_per_sample
       swap_order    - set for high-to-low byte order input stream
+      num_channels
  i/o: pcm_in
- out: sample_buffer  (must be allocated up to samples_to_read upon call)
+ out: left, right   (must be allocated up to samples_to_read / num_channels
+                     upon call, right is not touched for mono)
 returns: number of samples read
 */
 static int
 unpack_read_samples(const int samples_to_read, const int bytes_per_sample,
-                    const int swap_order, int *sample_buffer, FILE * pcm_in, int num_file)
+                    const int swap_order, const int num_channels,
+                    int *left, int *right, enc_ctx_t *ctx)
 {
     size_t  samples_read;
-    int     i;
-    int    *op;              /* output pointer */
-    unsigned char *ip = (unsigned char *) sample_buffer; /* input pointer */
-    const int b = sizeof(int) * 8;
-
-#define GA_URS_IFLOOP( ga_urs_bps ) \
-    if( bytes_per_sample == ga_urs_bps ) \
-      for( i = samples_read * bytes_per_sample; (i -= bytes_per_sample) >=0;)
-
-    samples_read = fread(sample_buffer, bytes_per_sample, samples_to_read, pcm_in);
-    op = sample_buffer + samples_read;
-
-    if (swap_order == 0) {
-        GA_URS_IFLOOP(1)
-            * --op = ip[i] << (b - 8);
-        GA_URS_IFLOOP(2)
-            * --op = ip[i] << (b - 16) | ip[i + 1] << (b - 8);
-        GA_URS_IFLOOP(3)
-            * --op = ip[i] << (b - 24) | ip[i + 1] << (b - 16) | ip[i + 2] << (b - 8);
-        GA_URS_IFLOOP(4)
-            * --op =
-            ip[i] << (b - 32) | ip[i + 1] << (b - 24) | ip[i + 2] << (b - 16) | ip[i + 3] << (b -
-                                                                                              8);
+    unsigned char *ip;       /* input pointer */
+
+    if (ctx->audio_data.map != NULL) {
+        /* unpack straight from the mapping, no copy into a buffer first */
+        size_t const left = (ctx->audio_data.map_size - ctx->audio_data.map_pos) / bytes_per_sample;
+        samples_read = min_size_t(samples_to_read, left);
+        ip = ctx->audio_data.map + ctx->audio_data.map_pos;
+        ctx->audio_data.map_pos += samples_read * bytes_per_sample;
+        map_advance(ctx);
     }
     else {
-        GA_URS_IFLOOP(1)
-            * --op = (ip[i] ^ 0x80) << (b - 8) | 0x7f << (b - 16); /* convert from unsigned */
-        GA_URS_IFLOOP(2)
-            * --op = ip[i] << (b - 8) | ip[i + 1] << (b - 16);
-        GA_URS_IFLOOP(3)
-            * --op = ip[i] << (b - 8) | ip[i + 1] << (b - 16) | ip[i + 2] << (b - 24);
-        GA_URS_IFLOOP(4)
-            * --op =
-            ip[i] << (b - 8) | ip[i + 1] << (b - 16) | ip[i + 2] << (b - 24) | ip[i + 3] << (b -
-                                                                                             32);
-    }
-#undef GA_URS_IFLOOP
-    if (audio_data[num_file].pcm_is_ieee_float) {
-        float const m_max = INT_MAX;
-        float const m_min = -(float) INT_MIN;
-        float *x = (float *) sample_buffer;
-        assert(sizeof(float) == sizeof(int));
-        for (i = 0; i < samples_to_read; ++i) {
-            float const u = x[i];
-            int     v;
-            if (u >= 1) {
-                v = INT_MAX;
-            }
-            else if (u <= -1) {
-                v = INT_MIN;
-            }
-            else if (u >= 0) {
-                v = (int) (u * m_max + 0.5f);
-            }
-            else {
-                v = (int) (u * m_min - 0.5f);
-            }
-            sample_buffer[i] = v;
-        }
+        /* unpack straight from the read-ahead block */
+        InFile *in = &ctx->audio_data.music_in;
+        size_t const avail = infile_fill(in, (size_t) samples_to_read * bytes_per_sample);
+        samples_read = min_size_t(samples_to_read, avail / bytes_per_sample);
+        ip = in->buf + in->pos;
+        in->pos += samples_read * bytes_per_sample;
     }
+    if (ctx->audio_data.hash != NULL)
+        hash64_update(ctx->audio_data.hash, ip, samples_read * bytes_per_sample);
+    if (num_channels == 2)
+        unpack_select_planar(bytes_per_sample, swap_order)(left, right, ip, samples_read / 2);
+    else
+        unpack_select(bytes_per_sample, swap_order)(left, ip, samples_read);
 
     return (samples_read);
 }
@@ -278,18 +373,18 @@ unpack_read_samples(const int samples_to_read, const int bytes_per_sample,
 * PURPOSE:  reads the PCM samples from a file to the buffer
 *
 *  SEMANTICS:
-* Reads #samples_read# number of shorts from #musicin# filepointer
-* into #sample_buffer[]#.  Returns the number of samples read.
+* Reads #samples_read# number of samples from #musicin# filepointer
+* into #left[]# and #right[]#.  Returns the number of samples read.
 *
 ************************************************************************/
 static int
-read_samples_pcm(FILE * musicin, int sample_buffer[2304], int samples_to_read, int num_file)
+read_samples_pcm(int *left, int *right, int num_channels, int samples_to_read, enc_ctx_t *ctx)
 {
     int samples_read;
-    int bytes_per_sample = audio_data[num_file].pcmbitwidth / 8;
+    int bytes_per_sample = ctx->audio_data.pcmbitwidth / 8;
     int swap_byte_order; /* byte order of input stream */
 
-    switch (audio_data[num_file].pcmbitwidth) {
+    switch (ctx->audio_data.pcmbitwidth) {
     case 32:
     case 24:
     case 16:
@@ -298,13 +393,13 @@ read_samples_pcm(FILE * musicin, int sample_buffer[2304], int samples_to_read, i
             return -1;
         }
         swap_byte_order = (global_raw_pcm.in_endian != ByteOrderLittleEndian) ? 1 : 0;
-        if (audio_data[num_file].pcmswapbytes) {
+        if (ctx->audio_data.pcmswapbytes) {
             swap_byte_order = !swap_byte_order;
         }
         break;
 
     case 8:
-        swap_byte_order = audio_data[num_file].pcm_is_unsigned_8bit;
+        swap_byte_order = ctx->audio_data.pcm_is_unsigned_8bit;
         break;
 
     default:
@@ -312,8 +407,8 @@ read_samples_pcm(FILE * musicin, int sample_buffer[2304], int samples_to_read, i
         return -1;
     }
     samples_read = unpack_read_samples(samples_to_read, bytes_per_sample, swap_byte_order,
-                                       sample_buffer, musicin, num_file);
-    if (ferror(musicin)) {
+                                       num_channels, left, right, ctx);
+    if (ctx->audio_data.music_in.error) {
         printf("Error reading input file\n");
         return -1;
     }
@@ -331,42 +426,46 @@ read_samples_pcm(FILE * musicin, int sample_buffer[2304], int samples_to_read, i
 *
 ************************************************************************/
 int
-get_audio(lame_t gfp, int buffer[2][1152], int num_file)
+get_audio(lame_t gfp, int buffer[2][1152], enc_ctx_t *ctx)
 {
+    PcmBuffer *b = &ctx->audio_data.pcm32;
     int used = 0, read = 0;
+
+    if (b->skip_start == 0 && b->skip_end == 0 && b->u == 0) {
+        /* nothing to trim, so the samples go straight where they are asked for */
+        if (ctx->reader_config.swap_channel == 0)
+            return get_audio_common(gfp, buffer[0], buffer[1], ctx);
+        else
+            return get_audio_common(gfp, buffer[1], buffer[0], ctx);
+    }
     do {
-        read = get_audio_common(gfp, buffer, NULL, num_file);
-        used = addPcmBuffer(&audio_data[num_file].pcm32, buffer[0], buffer[1], read);
+        read = get_audio_common(gfp, buffer[0], buffer[1], ctx);
+        used = addPcmBuffer(&ctx->audio_data.pcm32, buffer[0], buffer[1], read);
     } while (used <= 0 && read > 0);
     if (read < 0) {
         return read;
     }
-    if (reader_config[num_file].swap_channel == 0)
-        return takePcmBuffer(&audio_data[num_file].pcm32, buffer[0], buffer[1], used, 1152);
+    if (ctx->reader_config.swap_channel == 0)
+        return takePcmBuffer(&ctx->audio_data.pcm32, buffer[0], buffer[1], used, 1152);
     else
-        return takePcmBuffer(&audio_data[num_file].pcm32, buffer[1], buffer[0], used, 1152);
+        return takePcmBuffer(&ctx->audio_data.pcm32, buffer[1], buffer[0], used, 1152);
 }
 
 /************************************************************************
   get_audio_common - central functionality of get_audio*
     in: gfp
-        buffer    output to the int buffer or 16-bit buffer
-   out: buffer    int output    (if buffer != NULL)
-        buffer16  16-bit output (if buffer == NULL)
+   out: left, right  int output of each channel, right is zero for mono
 returns: samples read
-note: either buffer or buffer16 must be allocated upon call
+note: left and right must be allocated up to 1152 samples upon call
 */
 static int
-get_audio_common(lame_t gfp, int buffer[2][1152], short buffer16[2][1152], int num_file)
+get_audio_common(lame_t gfp, int *left, int *right, enc_ctx_t *ctx)
 {
     int num_channels = lame_get_num_channels(gfp);
-    int insamp[2 * 1152];
     int samples_read;
     int framesize;
     int samples_to_read;
-    unsigned int remaining, tmp_num_samples;
-    int i;
-    int *p;
+    unsigned long remaining, tmp_num_samples;
 
     /*
      * NOTE: LAME can now handle arbritray size input data packets,
@@ -386,14 +485,14 @@ get_audio_common(lame_t gfp, int buffer[2][1152], short buffer16[2][1152], int n
      * files which have id3 or other tags at the end.  Note that if you
      * are using LIBSNDFILE, this is not necessary
      */
-    if (audio_data[num_file].count_samples_carefully) {
-        if (audio_data[num_file].num_samples_read < tmp_num_samples) {
-            remaining = tmp_num_samples - audio_data[num_file].num_samples_read;
+    if (ctx->audio_data.count_samples_carefully) {
+        if (ctx->audio_data.num_samples_read < tmp_num_samples) {
+            remaining = tmp_num_samples - ctx->audio_data.num_samples_read;
         }
         else {
             remaining = 0;
         }
-        if (remaining < (unsigned int) framesize && 0 != tmp_num_samples)
+        if (remaining < (unsigned long) framesize && 0 != tmp_num_samples)
             /* in case the input is a FIFO (at least it's reproducible with
                a FIFO) tmp_num_samples may be 0 and therefore remaining
                would be 0, but we need to read some samples, so don't
@@ -401,61 +500,31 @@ get_audio_common(lame_t gfp, int buffer[2][1152], short buffer16[2][1152], int n
             samples_to_read = remaining;
     }
 
+    assert(num_channels == 1 || num_channels == 2);
     samples_read =
-        read_samples_pcm(audio_data[num_file].music_in, insamp, num_channels * samples_to_read, num_file);
+        read_samples_pcm(left, right, num_channels, num_channels * samples_to_read, ctx);
     if (samples_read < 0) {
         return samples_read;
     }
-    p = insamp + samples_read;
     samples_read /= num_channels;
-    if (buffer != NULL) { /* output to int buffer */
-        if (num_channels == 2) {
-            for (i = samples_read; --i >= 0;) {
-                buffer[1][i] = *--p;
-                buffer[0][i] = *--p;
-            }
-        }
-        else if (num_channels == 1) {
-            memset(buffer[1], 0, samples_read * sizeof(int));
-            for (i = samples_read; --i >= 0;) {
-                buffer[0][i] = *--p;
-            }
-        }
-        else
-            assert(0);
-    }
-    else {          /* convert from int; output to 16-bit buffer */
-        if (num_channels == 2) {
-            for (i = samples_read; --i >= 0;) {
-                buffer16[1][i] = *--p >> (8 * sizeof(int) - 16);
-                buffer16[0][i] = *--p >> (8 * sizeof(int) - 16);
-            }
-        }
-        else if (num_channels == 1) {
-            memset(buffer16[1], 0, samples_read * sizeof(short));
-            for (i = samples_read; --i >= 0;) {
-                buffer16[0][i] = *--p >> (8 * sizeof(int) - 16);
-            }
-        }
-        else
-            assert(0);
-    }
+    if (num_channels == 1)
+        memset(right, 0, samples_read * sizeof(int));
 
     /* if num_samples = MAX_U_32_NUM, then it is considered infinitely long.
        Don't count the samples */
     if (tmp_num_samples != MAX_U_32_NUM)
-        audio_data[num_file]. num_samples_read += samples_read;
+        ctx->audio_data.num_samples_read += samples_read;
 
     return samples_read;
 }
 
 
 static void
-setSkipStartAndEnd(lame_t gfp, int enc_delay, int enc_padding, int num_file)
+setSkipStartAndEnd(lame_t gfp, int enc_delay, int enc_padding, enc_ctx_t *ctx)
 {
     int skip_start = 0, skip_end = 0;
 
-    switch (reader_config[num_file].input_format) {
+    switch (ctx->reader_config.input_format) {
     case sf_mp123:
         break;
 
@@ -496,297 +565,523 @@ setSkipStartAndEnd(lame_t gfp, int enc_delay, int enc_padding, int num_file)
     }
     skip_start = skip_start < 0 ? 0 : skip_start;
     skip_end = skip_end < 0 ? 0 : skip_end;
-    audio_data[num_file]. pcm16.skip_start = audio_data[num_file].pcm32.skip_start = skip_start;
-    audio_data[num_file]. pcm16.skip_end = audio_data[num_file].pcm32.skip_end = skip_end;
+    ctx->audio_data.pcm16.skip_start = ctx->audio_data.pcm32.skip_start = skip_start;
+    ctx->audio_data.pcm16.skip_end = ctx->audio_data.pcm32.skip_end = skip_end;
 }
 
-static int
-read_16_bits_low_high(FILE * fp)
+/* Release the page cache of the consumed part of a regular file, so that a batch
+   does not push out the cache of other processes. Done once a block is consumed. */
+static void
+infile_release(InFile * in, long long upto, size_t block)
 {
-    unsigned char bytes[2] = { 0, 0 };
-    fread(bytes, 1, 2, fp);
-    {
-        int32_t const low = bytes[0];
-        int32_t const high = (signed char) (bytes[1]);
-        return (high << 8) | low;
+#if defined (POSIX_FADV_DONTNEED)
+    if (in->seekable && upto > in->dropped && upto - in->dropped >= (long long) block) {
+        (void) posix_fadvise(in->fd, (off_t) in->dropped, (off_t) (upto - in->dropped),
+                             POSIX_FADV_DONTNEED);
+        in->dropped = upto;
     }
+#else
+    (void) in;
+    (void) upto;
+    (void) block;
+#endif
 }
 
 static int
-read_32_bits_low_high(FILE * fp)
+infile_open(InFile * in, char const *path, size_t block)
 {
-    unsigned char bytes[4] = { 0, 0, 0, 0 };
-    fread(bytes, 1, 4, fp);
-    {
-        int32_t const low = bytes[0];
-        int32_t const medl = bytes[1];
-        int32_t const medh = bytes[2];
-        int32_t const high = (signed char) (bytes[3]);
-        return (high << 24) | (medh << 16) | (medl << 8) | low;
-    }
-}
+    struct stat sb;
 
-/*
-static int
-read_16_bits_high_low(FILE * fp)
-{
-    unsigned char bytes[2] = { 0, 0 };
-    fread(bytes, 1, 2, fp);
-    {
-        int32_t const low = bytes[1];
-        int32_t const high = (signed char) (bytes[0]);
-        return (high << 8) | low;
+    if (in->buf == NULL || in->buf_size != block) {
+        free(in->buf);
+        in->buf = (unsigned char *) malloc(block);
+        in->buf_size = in->buf ? block : 0;
+        if (in->buf == NULL)
+            return -1;
+    }
+    if (IS_STDIO(path)) {
+#if defined (_WIN32)
+        _setmode(STDIN_FILENO, _O_BINARY);
+#endif
+        /* a duplicate, so that closing the input leaves stdin open. its offset is unknown */
+        in->fd = dup(STDIN_FILENO);
+        if (in->fd < 0)
+            return -1;
+        in->seekable = 0;
     }
+    else {
+        in->fd = open(path, O_RDONLY | O_BINARY);
+        if (in->fd < 0)
+            return -1;
+        in->seekable = (fstat(in->fd, &sb) == 0 && S_ISREG(sb.st_mode));
+    }
+    in->eof = 0;
+    in->error = 0;
+    in->pos = 0;
+    in->len = 0;
+    in->offset = 0;
+    in->dropped = 0;
+#if defined (POSIX_FADV_SEQUENTIAL)
+    if (in->seekable)
+        (void) posix_fadvise(in->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    return 0;
 }
-*/
 
-static int
-read_32_bits_high_low(FILE * fp)
+static void
+infile_close(InFile * in)
 {
-    unsigned char bytes[4] = { 0, 0, 0, 0 };
-    fread(bytes, 1, 4, fp);
-    {
-        int32_t const low = bytes[3];
-        int32_t const medl = bytes[2];
-        int32_t const medh = bytes[1];
-        int32_t const high = (signed char) (bytes[0]);
-        return (high << 24) | (medh << 16) | (medl << 8) | low;
-    }
+    if (in->fd < 0)
+        return;
+    infile_release(in, in->offset + in->pos, 0);
+    if (close(in->fd) != 0)
+        fprintf(stderr, "Could not close audio input file\n");
+    in->fd = -1;
 }
 
+/* Make at least 'need' bytes available at buf + pos, unless the file ends first.
+   Returns the number of bytes available. */
 static size_t
-min_size_t(size_t a, size_t b)
+infile_fill(InFile * in, size_t need)
 {
-    if (a < b) {
-        return a;
+    if (need > in->buf_size)
+        need = in->buf_size;
+    if (in->len - in->pos >= need || in->eof || in->error)
+        return in->len - in->pos;
+
+    /* move the rest to the front and read a whole block after it */
+    memmove(in->buf, in->buf + in->pos, in->len - in->pos);
+    in->offset += in->pos;
+    in->len -= in->pos;
+    in->pos = 0;
+    infile_release(in, in->offset, in->buf_size);
+    while (in->len < need) {
+        size_t  want = in->buf_size - in->len;
+        long    n;
+
+        if (in->offset == 0 && want > HEADER_READ_SIZE && need <= HEADER_READ_SIZE)
+            want = HEADER_READ_SIZE;
+        n = (long) read(in->fd, in->buf + in->len, (unsigned int) want);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            in->error = 1;
+            break;
+        }
+        if (n == 0) {
+            in->eof = 1;
+            break;
+        }
+        in->len += n;
     }
-    return b;
-}
-
-/* Replacement for forward fseek(,,SEEK_CUR), because fseek() fails on pipes */
 
+    return in->len - in->pos;
+}
 
+/* Replacement for forward fseek(,,SEEK_CUR), pipes are skipped by reading */
 static int
-fskip(FILE * fp, long offset, int whence)
+infile_skip(InFile * in, long long n)
 {
-#ifndef PIPE_BUF
-    char buffer[4096];
-#else
-    char buffer[PIPE_BUF];
-#endif
-
-/* S_ISFIFO macro is defined on newer Linuxes */
-#ifndef S_ISFIFO
-# ifdef _S_IFIFO
-    /* _S_IFIFO is defined on Win32 and Cygwin */
-#  define S_ISFIFO(m) (((m)&_S_IFIFO) == _S_IFIFO)
-# endif
-#endif
-
-#ifdef S_ISFIFO
-    /* fseek is known to fail on pipes with several C-Library implementations
-       workaround: 1) test for pipe
-       2) for pipes, only relatvie seeking is possible
-       3)            and only in forward direction!
-       else fallback to old code
-     */
-    {
-        int const fd = fileno(fp);
-        struct stat file_stat;
-
-        if (fstat(fd, &file_stat) == 0) {
-            if (S_ISFIFO(file_stat.st_mode)) {
-                if (whence != SEEK_CUR || offset < 0) {
-                    return -1;
-                }
-                while (offset > 0) {
-                    size_t const bytes_to_skip = min_size_t(sizeof(buffer), offset);
-                    size_t const read = fread(buffer, 1, bytes_to_skip, fp);
-                    if (read < 1) {
-                        return -1;
-                    }
-                    offset -= read;
-                }
-                return 0;
-            }
-        }
-    }
-#endif
-    if (0 == fseek(fp, offset, whence)) {
+    if (n < 0)
+        return -1;
+    if ((unsigned long long) n <= in->len - in->pos) {
+        in->pos += (size_t) n;
         return 0;
     }
-
-    if (whence != SEEK_CUR || offset < 0) {
-        fprintf(stderr,
-                "fskip problem: "
-                "Mostly the return status of functions is not evaluate so it is more secure to polute <stderr>.\n");
-        return -1;
+    if (in->seekable) {
+        long long const target = in->offset + in->pos + n;
+        if (lseek(in->fd, target, SEEK_SET) < 0)
+            return -1;
+        in->offset = target;
+        in->pos = 0;
+        in->len = 0;
+        in->dropped = target;
+        return 0;
     }
-
-    while (offset > 0) {
-        size_t const bytes_to_skip = min_size_t(sizeof(buffer), offset);
-        size_t const read = fread(buffer, 1, bytes_to_skip, fp);
-        if (read < 1) {
+    while (n > 0) {
+        size_t const chunk = (n < (long long) in->buf_size) ? (size_t) n : in->buf_size;
+        size_t const avail = min_size_t(infile_fill(in, chunk), chunk);
+        if (avail == 0)
             return -1;
-        }
-        offset -= read;
+        in->pos += avail;
+        n -= avail;
     }
 
     return 0;
 }
 
+static long long
+infile_tell(InFile * in)
+{
+    return in->offset + in->pos;
+}
 
-static off_t
-lame_get_file_size(FILE * fp)
+static long long
+lame_get_file_size(InFile * in)
 {
     struct stat sb;
-    int fd = fileno(fp);
 
-    if (0 == fstat(fd, &sb))
+    if (0 == fstat(in->fd, &sb))
         return sb.st_size;
 
-    return (off_t) - 1;
+    return -1;
+}
+
+/* Little and big endian fields of a header parsed in memory */
+static unsigned int
+get_le16(unsigned char const *p)
+{
+    return p[0] | (unsigned int) p[1] << 8;
+}
+
+static unsigned long
+get_le32(unsigned char const *p)
+{
+    return p[0] | (unsigned long) p[1] << 8 | (unsigned long) p[2] << 16 | (unsigned long) p[3] << 24;
+}
+
+static unsigned long long
+get_le64(unsigned char const *p)
+{
+    return get_le32(p) | (unsigned long long) get_le32(p + 4) << 32;
+}
+
+static int
+get_be32(unsigned char const *p)
+{
+    return (int) ((unsigned long) p[0] << 24 | (unsigned long) p[1] << 16 | p[2] << 8 | p[3]);
+}
+
+static size_t
+min_size_t(size_t a, size_t b)
+{
+    if (a < b) {
+        return a;
+    }
+    return b;
+}
+
+/* Map a regular input file in memory, so that samples are unpacked without
+   read() calls and without the copy into the read-ahead block. The mapping is
+   prefetched and released one read-ahead block at a time, see map_advance().
+   Pipes and other files which cannot be mapped keep using the block. */
+static void
+map_infile(enc_ctx_t *ctx)
+{
+#if !defined (_WIN32)
+    InFile *in = &ctx->audio_data.music_in;
+    long long size = lame_get_file_size(in);
+    long long pos = infile_tell(in);
+    void   *map;
+    int     flags = MAP_PRIVATE;
+
+    if (ctx->audio_data.no_map)
+        return;
+    if (!in->seekable || size <= 0 || (unsigned long long) size > (size_t) -1)
+        return;
+    if (pos < 0 || pos >= size)
+        return;
+#ifdef MAP_POPULATE
+    /* small files are faulted in at once, larger ones block by block */
+    if ((unsigned long long) size <= ctx->audio_data.readahead)
+        flags |= MAP_POPULATE;
+#endif
+    map = mmap(NULL, (size_t) size, PROT_READ, flags, in->fd, 0);
+    if (map == MAP_FAILED)
+        return;
+#ifdef MADV_SEQUENTIAL
+    (void) madvise(map, (size_t) size, MADV_SEQUENTIAL);
+#endif
+    ctx->audio_data.map = (unsigned char *) map;
+    ctx->audio_data.map_size = (size_t) size;
+    ctx->audio_data.map_pos = (size_t) pos;
+    ctx->audio_data.map_ahead = (size_t) pos;
+    map_advance(ctx);
+#else
+    (void) ctx;
+#endif
 }
 
-static long
-make_even_number_of_bytes_in_length(long x)
+/* Prefetch the block ahead of map_pos and release the blocks behind it */
+static void
+map_advance(enc_ctx_t *ctx)
 {
-    if ((x & 0x01) != 0)
-        return x + 1;
+#if !defined (_WIN32)
+    get_audio_global_data *ad = &ctx->audio_data;
+    size_t const block = ad->readahead;
+
+    if (ad->map_pos + block / 2 >= ad->map_ahead && ad->map_ahead < ad->map_size) {
+        size_t const page = (size_t) sysconf(_SC_PAGESIZE);
+        size_t const from = ad->map_ahead & ~(page - 1);
+        size_t const len = min_size_t(block, ad->map_size - from);
+#ifdef MADV_WILLNEED
+        (void) madvise(ad->map + from, len, MADV_WILLNEED);
+#endif
+        ad->map_ahead = from + len;
+    }
+    if (ad->map_pos - (size_t) ad->music_in.dropped >= block) {
+        size_t const page = (size_t) sysconf(_SC_PAGESIZE);
+        size_t const from = (size_t) ad->music_in.dropped & ~(page - 1);
+        size_t const done = ad->map_pos & ~(page - 1);
+#ifdef MADV_DONTNEED
+        (void) madvise(ad->map + from, done - from, MADV_DONTNEED);
+#endif
+        infile_release(&ad->music_in, (long long) done, 0);
+    }
+#else
+    (void) ctx;
+#endif
+}
 
-    return x;
+static void
+unmap_infile(enc_ctx_t *ctx)
+{
+#if !defined (_WIN32)
+    if (ctx->audio_data.map != NULL) {
+        munmap(ctx->audio_data.map, ctx->audio_data.map_size);
+        /* the pages are no longer mapped, release the rest of the cache */
+        infile_release(&ctx->audio_data.music_in, (long long) ctx->audio_data.map_pos, 0);
+    }
+#endif
+    ctx->audio_data.map = NULL;
+    ctx->audio_data.map_size = 0;
+    ctx->audio_data.map_pos = 0;
+    ctx->audio_data.map_ahead = 0;
 }
 
 /*****************************************************************************
  *
- *  Read Microsoft Wave headers
+ *  Read Microsoft Wave headers: RIFF, RF64/BW64 and Sony Wave64
  *
  *  By the time we get here the first 32-bits of the file have already been
  *  read, and we're pretty sure that we're looking at a WAV file.
+ *  The header region is in the read-ahead block after a single read, and
+ *  every chunk up to 'data' is indexed from there. Only a chunk larger than
+ *  the block, like a big LIST, is skipped with a seek.
  *
  *****************************************************************************/
 
+/* the 12 bytes following the FOURCC in the GUID of every Wave64 chunk but 'riff' */
+static unsigned char const w64_guid_tail[12] = {
+    0xF3, 0xAC, 0xD3, 0x11, 0x8C, 0xD1, 0x00, 0xC0, 0x4F, 0x8E, 0xDB, 0x8A
+};
+static unsigned char const w64_riff_tail[12] = {
+    0x2E, 0x91, 0xCF, 0x11, 0xA5, 0xD6, 0x28, 0xDB, 0x04, 0xC1, 0x00, 0x00
+};
+
+#define WAV_MAX_CHUNKS      64
+#define WAV_MAX_FMT_SIZE    4096
+
+typedef enum wav_form_e { wav_riff, wav_rf64, wav_w64 } wav_form;
+
+typedef struct WavChunk {
+    int     id;                 /* FOURCC, the first 4 bytes of the GUID for Wave64 */
+    long long offset;           /* file offset of the chunk body */
+    unsigned long long size;    /* size of the body, ~0 if unknown */
+} WavChunk;
+
+typedef struct WavIndex {
+    WavChunk chunk[WAV_MAX_CHUNKS];
+    int     count;
+    int     format_tag;
+    int     channels;
+    int     bits_per_sample;
+    int     samples_per_sec;
+    int     block_align;
+    unsigned long long ds64_data_size; /* RF64 size of 'data', 0 if none */
+} WavIndex;
+
 static int
-parse_wave_header(lame_global_flags * gfp, FILE * sf, int num_file)
+parse_fmt_chunk(WavIndex * idx, unsigned char const *p, unsigned long long size)
 {
-    int     format_tag = 0;
-    int     channels = 0;
-    int     bits_per_sample = 0;
-    int     samples_per_sec = 0;
-    int     is_wav = 0;
-    long    data_length = 0, subSize = 0;
-    int     loop_sanity = 0;
-
-    /* Below variables are not used but declared for buffer read operation */
-    /* int     block_align = 0; */
-    /* int     avg_bytes_per_sec = 0; */
-    /* long    file_length; */
-
-    /*file_length = */read_32_bits_high_low(sf);
-    if (read_32_bits_high_low(sf) != WAV_ID_WAVE)
+    if (size < 16) {
+        /* DEBUGF("'fmt' chunk too short (only %ld bytes)!", size); */
         return -1;
+    }
+    idx->format_tag = get_le16(p);
+    idx->channels = get_le16(p + 2);
+    idx->samples_per_sec = (int) get_le32(p + 4);
+    /* avg_bytes_per_sec = get_le32(p + 8); */
+    idx->block_align = get_le16(p + 12);
+    idx->bits_per_sample = get_le16(p + 14);
+
+    /* WAVE_FORMAT_EXTENSIBLE support: cbSize, ValidBitsPerSample, ChannelMask,
+       then the SubType coincident with format_tag for PCM int or float */
+    if (size >= 26 && idx->format_tag == (WAVE_FORMAT_EXTENSIBLE & 0xFFFF)) {
+        idx->format_tag = get_le16(p + 24);
+    }
 
-    for (loop_sanity = 0; loop_sanity < 20; ++loop_sanity) {
-        int     type = read_32_bits_high_low(sf);
-
-        if (type == WAV_ID_FMT) {
-            subSize = read_32_bits_low_high(sf);
-            subSize = make_even_number_of_bytes_in_length(subSize);
-            if (subSize < 16) {
-                /* DEBUGF(
-                   "'fmt' chunk too short (only %ld bytes)!", subSize);  */
-                return -1;
-            }
-
-            format_tag = read_16_bits_low_high(sf);
-            subSize -= 2;
-            channels = read_16_bits_low_high(sf);
-            subSize -= 2;
-            samples_per_sec = read_32_bits_low_high(sf);
-            subSize -= 4;
-            /* avg_bytes_per_sec = */read_32_bits_low_high(sf);
-            subSize -= 4;
-            /* block_align = */read_16_bits_low_high(sf);
-            subSize -= 2;
-            bits_per_sample = read_16_bits_low_high(sf);
-            subSize -= 2;
-
-            /* WAVE_FORMAT_EXTENSIBLE support */
-            if ((subSize > 9) && (format_tag == WAVE_FORMAT_EXTENSIBLE)) {
-                read_16_bits_low_high(sf); /* cbSize */
-                read_16_bits_low_high(sf); /* ValidBitsPerSample */
-                read_32_bits_low_high(sf); /* ChannelMask */
-                /* SubType coincident with format_tag for PCM int or float */
-                format_tag = read_16_bits_low_high(sf);
-                subSize -= 10;
-            }
+    return 0;
+}
 
-            /* DEBUGF("   skipping %d bytes\n", subSize); */
+static int
+parse_wave_header(lame_global_flags * gfp, InFile * sf, wav_form form, enc_ctx_t *ctx)
+{
+    WavIndex idx;
+    WavChunk *data = NULL;
+    size_t const head_size = (form == wav_w64) ? 24 : 8;
+    size_t const align = (form == wav_w64) ? 8 : 2;
+    unsigned char const *p;
+    unsigned long long data_length;
+    unsigned long long num_samples;
+    long long file_size;
+    int     bytes_per_frame;
+
+    memset(&idx, 0, sizeof(idx));
+
+    /* rest of the form header. the first fill of the block has read the whole
+       header region of a regular file with it */
+    if (form == wav_w64) {
+        if (infile_fill(sf, 36) < 36)
+            return -1;
+        p = sf->buf + sf->pos;
+        if (memcmp(p, w64_riff_tail, 12) != 0 || get_be32(p + 20) != WAV_ID_W64_WAVE
+            || memcmp(p + 24, w64_guid_tail, 12) != 0)
+            return -1;
+        sf->pos += 36;
+    }
+    else {
+        if (infile_fill(sf, 8) < 8)
+            return -1;
+        p = sf->buf + sf->pos;
+        /* the RIFF size is not used, it is often wrong for streamed files */
+        if (get_be32(p + 4) != WAV_ID_WAVE)
+            return -1;
+        sf->pos += 8;
+    }
 
-            if (subSize > 0) {
-                if (fskip(sf, (long) subSize, SEEK_CUR) != 0)
-                    return -1;
-            };
+    while (data == NULL) {
+        WavChunk *chunk;
+        unsigned long long padded;
 
+        if (idx.count == WAV_MAX_CHUNKS)
+            return -1;
+        if (infile_fill(sf, head_size) < head_size)
+            return -1;
+        p = sf->buf + sf->pos;
+        chunk = &idx.chunk[idx.count++];
+        chunk->id = get_be32(p);
+        if (form == wav_w64) {
+            if (memcmp(p + 4, w64_guid_tail, 12) != 0)
+                chunk->id = 0;
+            chunk->size = get_le64(p + 16);
+            if (chunk->size < head_size)
+                return -1;
+            chunk->size -= head_size;
         }
-        else if (type == WAV_ID_DATA) {
-            subSize = read_32_bits_low_high(sf);
-            data_length = subSize;
-            is_wav = 1;
+        else {
+            chunk->size = get_le32(p + 4);
+        }
+        sf->pos += head_size;
+        chunk->offset = infile_tell(sf);
+
+        if (chunk->id == WAV_ID_DATA) {
             /* We've found the audio data. Read no further! */
+            data = chunk;
             break;
-
         }
-        else {
-            subSize = read_32_bits_low_high(sf);
-            subSize = make_even_number_of_bytes_in_length(subSize);
-            if (fskip(sf, (long) subSize, SEEK_CUR) != 0) {
+
+        padded = (chunk->size + align - 1) & ~(unsigned long long) (align - 1);
+        if (chunk->id == WAV_ID_FMT || (chunk->id == WAV_ID_DS64 && form == wav_rf64)) {
+            if (chunk->size > WAV_MAX_FMT_SIZE)
                 return -1;
+            if (infile_fill(sf, (size_t) chunk->size) < chunk->size)
+                return -1;
+            p = sf->buf + sf->pos;
+            if (chunk->id == WAV_ID_FMT) {
+                if (parse_fmt_chunk(&idx, p, chunk->size) != 0)
+                    return -1;
             }
-        }
-    }
-    if (is_wav) {
-        if (format_tag != WAVE_FORMAT_PCM && format_tag != WAVE_FORMAT_IEEE_FLOAT) {
-            if (ui_config[num_file].silent < 10) {
-                printf("Unsupported data format: 0x%04X\n", format_tag);
+            else if (chunk->size >= 16) {
+                /* riffSize, dataSize, sampleCount, table of other sizes */
+                idx.ds64_data_size = get_le64(p + 8);
             }
-            return 0;   /* oh no! non-supported format  */
         }
+        if (infile_skip(sf, (long long) padded) != 0)
+            return -1;
+    }
 
-        /* make sure the header is sane */
-        if (-1 == lame_set_num_channels(gfp, channels)) {
-            if (ui_config[num_file].silent < 10) {
-                printf("Unsupported number of channels: %u\n", channels);
-            }
-            return 0;
+    if (idx.channels == 0) {
+        /* no 'fmt ' before 'data' */
+        return -1;
+    }
+    if (idx.format_tag != WAVE_FORMAT_PCM && idx.format_tag != WAVE_FORMAT_IEEE_FLOAT) {
+        if (ctx->ui_config.silent < 10) {
+            printf("Unsupported data format: 0x%04X\n", idx.format_tag);
         }
-        if (reader_config[num_file].input_samplerate == 0) {
-            (void) lame_set_in_samplerate(gfp, samples_per_sec);
+        return 0;   /* oh no! non-supported format  */
+    }
+    if (idx.format_tag == WAVE_FORMAT_IEEE_FLOAT && idx.bits_per_sample != 32) {
+        if (ctx->ui_config.silent < 10) {
+            printf("Unsupported float width: %u bits\n", idx.bits_per_sample);
         }
-        else {
-            (void) lame_set_in_samplerate(gfp, reader_config[num_file].input_samplerate);
+        return 0;
+    }
+
+    /* make sure the header is sane */
+    if (-1 == lame_set_num_channels(gfp, idx.channels)) {
+        if (ctx->ui_config.silent < 10) {
+            printf("Unsupported number of channels: %u\n", idx.channels);
         }
-        audio_data[num_file]. pcmbitwidth = bits_per_sample;
-        audio_data[num_file]. pcm_is_unsigned_8bit = 1;
-        audio_data[num_file]. pcm_is_ieee_float = (format_tag == WAVE_FORMAT_IEEE_FLOAT ? 1 : 0);
-        (void) lame_set_num_samples(gfp, data_length / (channels * ((bits_per_sample + 7) / 8)));
+        return 0;
+    }
+    if (ctx->reader_config.input_samplerate == 0) {
+        (void) lame_set_in_samplerate(gfp, idx.samples_per_sec);
+    }
+    else {
+        (void) lame_set_in_samplerate(gfp, ctx->reader_config.input_samplerate);
+    }
+    ctx->audio_data.pcmbitwidth = idx.bits_per_sample;
+    ctx->audio_data.pcm_is_unsigned_8bit = 1;
+    ctx->audio_data.pcm_is_ieee_float = (idx.format_tag == WAVE_FORMAT_IEEE_FLOAT ? 1 : 0);
+
+    /* resolve the length of the samples */
+    data_length = data->size;
+    file_size = sf->seekable ? lame_get_file_size(sf) : -1;
+    if (form == wav_rf64 && data_length == MAX_U_32_NUM) {
+        data_length = idx.ds64_data_size;
+    }
+    else if (form == wav_riff && file_size > data->offset) {
+        unsigned long long const rest = (unsigned long long) (file_size - data->offset);
+        /* a writer which does not know RF64 leaves the size 0 or ~0, or wraps it at 4 GB */
+        if (data_length == 0 || data_length == MAX_U_32_NUM
+            || (rest > MAX_U_32_NUM && (rest & MAX_U_32_NUM) == data_length))
+            data_length = rest;
+    }
+    if (file_size < 0 && (data_length == 0 || data_length == MAX_U_32_NUM)) {
+        /* a stream of unknown length, read up to the end */
+        data_length = ~0ULL;
+    }
 
-        return 1;
+    bytes_per_frame = idx.channels * ((idx.bits_per_sample + 7) / 8);
+    num_samples = (data_length == ~0ULL) ? MAX_U_32_NUM : data_length / bytes_per_frame;
+    if (num_samples > (unsigned long) -1 || (data_length != ~0ULL && num_samples == MAX_U_32_NUM
+                                             && sizeof(unsigned long) == 4)) {
+        /* too many for lame on this platform, encode up to the end of the file */
+        num_samples = MAX_U_32_NUM;
     }
+    (void) lame_set_num_samples(gfp, (unsigned long) num_samples);
 
-    return -1;
+    return 1;
 }
 
 static int
-parse_file_header(lame_global_flags * gfp, FILE * sf, int num_file)
+parse_file_header(lame_global_flags * gfp, InFile * sf, enc_ctx_t *ctx)
 {
-    int type = read_32_bits_high_low(sf);
+    int     type = 0;
+    int     ret = -1;
+
+    if (infile_fill(sf, 4) >= 4) {
+        type = get_be32(sf->buf + sf->pos);
+        sf->pos += 4;
+    }
     /*
        DEBUGF(
        "First word of input stream: %08x '%4.4s'\n", type, (char*) &type);
      */
-    audio_data[num_file]. count_samples_carefully = 0;
-    audio_data[num_file]. pcm_is_unsigned_8bit = global_raw_pcm.in_signed == 1 ? 0 : 1;
+    ctx->audio_data.count_samples_carefully = 0;
+    ctx->audio_data.pcm_is_unsigned_8bit = global_raw_pcm.in_signed == 1 ? 0 : 1;
     /*global_reader.input_format = sf_raw; commented out, because it is better to fail
        here as to encode some hundreds of input files not supported by LAME
        If you know you have RAW PCM data, use the -r switch
@@ -794,56 +1089,64 @@ parse_file_header(lame_global_flags * gfp, FILE * sf, int num_file)
 
     if (type == WAV_ID_RIFF) {
         /* It's probably a WAV file */
-        int const ret = parse_wave_header(gfp, sf, num_file);
-        if (ret > 0) {
-            audio_data[num_file]. count_samples_carefully = 1;
-            return sf_wave;
-        }
-        if (ret < 0) {
-            printf("Warning: corrupt or unsupported WAVE format\n");
-        }
+        ret = parse_wave_header(gfp, sf, wav_riff, ctx);
+    }
+    else if (type == WAV_ID_RF64 || type == WAV_ID_BW64) {
+        ret = parse_wave_header(gfp, sf, wav_rf64, ctx);
+    }
+    else if (type == WAV_ID_W64_RIFF) {
+        ret = parse_wave_header(gfp, sf, wav_w64, ctx);
     }
     else {
         printf("Warning: unsupported audio format\n");
+        return sf_unknown;
+    }
+    if (ret > 0) {
+        ctx->audio_data.count_samples_carefully = 1;
+        return sf_wave;
+    }
+    if (ret < 0) {
+        printf("Warning: corrupt or unsupported WAVE format\n");
     }
 
     return sf_unknown;
 }
 
-static FILE *
-open_wave_file(lame_t gfp, char const *in_path, int num_file)
+static int
+open_wave_file(lame_t gfp, char const *in_path, enc_ctx_t *ctx)
 {
-    FILE *musicin;
+    InFile *musicin = &ctx->audio_data.music_in;
 
     /* set the defaults from info incase we cannot determine them from file */
     lame_set_num_samples(gfp, MAX_U_32_NUM);
 
-    if ((musicin = fopen(in_path, "rb")) == NULL) {
-        if (ui_config[num_file].silent < 10) {
+    if (infile_open(musicin, in_path, ctx->audio_data.readahead) != 0) {
+        if (ctx->ui_config.silent < 10) {
             printf("Could not find \"%s\".\n", in_path);
         }
-        exit(1);
+        return -1;
     }
 
-    if (reader_config[num_file].input_format == sf_raw) {
+    if (ctx->reader_config.input_format == sf_raw) {
         /* assume raw PCM */
-        if (ui_config[num_file].silent < 9) {
+        if (ctx->ui_config.silent < 9) {
             printf("Assuming raw pcm input file");
-            if (reader_config[num_file].swapbytes)
+            if (ctx->reader_config.swapbytes)
                 printf(" : Forcing byte-swapping\n");
             else
                 printf("\n");
         }
-        audio_data[num_file]. pcmswapbytes = reader_config[num_file].swapbytes;
+        ctx->audio_data.pcmswapbytes = ctx->reader_config.swapbytes;
     }
     else {
-        reader_config[num_file].input_format = parse_file_header(gfp, musicin, num_file);
+        ctx->reader_config.input_format = parse_file_header(gfp, musicin, ctx);
     }
-    if (reader_config[num_file].input_format == sf_unknown) {
-        return NULL;
+    if (ctx->reader_config.input_format == sf_unknown) {
+        infile_close(musicin);
+        return -1;
     }
 
-    if (lame_get_num_samples(gfp) == MAX_U_32_NUM && musicin != stdin) {
+    if (lame_get_num_samples(gfp) == MAX_U_32_NUM) {
         double const flen = lame_get_file_size(musicin); /* try to figure out num_samples */
         if (flen >= 0) {
             /* try file size, assume 2 bytes per sample */
@@ -852,75 +1155,134 @@ open_wave_file(lame_t gfp, char const *in_path, int num_file)
         }
     }
 
-    return musicin;
+    return 0;
 }
 
 int
-init_infile(lame_t gfp, char const *in_path, const int num_file)
+init_infile(lame_t gfp, char const *in_path, enc_ctx_t *ctx)
 {
     int enc_delay = 0, enc_padding = 0;
 
-    audio_data[num_file]. count_samples_carefully = 0;
-    audio_data[num_file]. num_samples_read = 0;
-    audio_data[num_file]. pcmbitwidth = global_raw_pcm.in_bitwidth;
-    audio_data[num_file]. pcmswapbytes = reader_config[num_file].swapbytes;
-    audio_data[num_file]. pcm_is_unsigned_8bit = global_raw_pcm.in_signed == 1 ? 0 : 1;
-    audio_data[num_file]. pcm_is_ieee_float = 0;
-    audio_data[num_file]. hip = 0;
-    audio_data[num_file]. music_in = 0;
-    audio_data[num_file]. in_id3v2_size = 0;
-    audio_data[num_file]. in_id3v2_tag = 0;
-
-    audio_data[num_file]. music_in = open_wave_file(gfp, in_path, num_file);
-
-    initPcmBuffer(&audio_data[num_file].pcm32, sizeof(int));
-    initPcmBuffer(&audio_data[num_file].pcm16, sizeof(short));
-    setSkipStartAndEnd(gfp, enc_delay, enc_padding, num_file);
+    ctx->audio_data.count_samples_carefully = 0;
+    ctx->audio_data.num_samples_read = 0;
+    ctx->audio_data.pcmbitwidth = global_raw_pcm.in_bitwidth;
+    ctx->audio_data.pcmswapbytes = ctx->reader_config.swapbytes;
+    ctx->audio_data.pcm_is_unsigned_8bit = global_raw_pcm.in_signed == 1 ? 0 : 1;
+    ctx->audio_data.pcm_is_ieee_float = 0;
+    ctx->audio_data.hip = 0;
+    ctx->audio_data.map = NULL;
+    ctx->audio_data.map_size = 0;
+    ctx->audio_data.map_pos = 0;
+    ctx->audio_data.in_id3v2_size = 0;
+    ctx->audio_data.in_id3v2_tag = 0;
+
+    if (open_wave_file(gfp, in_path, ctx) == 0)
+        map_infile(ctx);
+
+    initPcmBuffer(&ctx->audio_data.pcm32, sizeof(int));
+    initPcmBuffer(&ctx->audio_data.pcm16, sizeof(short));
+    setSkipStartAndEnd(gfp, enc_delay, enc_padding, ctx);
     {
         unsigned long n = lame_get_num_samples(gfp);
         if (n != MAX_U_32_NUM) {
-            unsigned long const discard = audio_data[num_file].pcm32.skip_start + audio_data[num_file].pcm32.skip_end;
+            unsigned long const discard = ctx->audio_data.pcm32.skip_start + ctx->audio_data.pcm32.skip_end;
             lame_set_num_samples(gfp, n > discard ? n - discard : 0);
         }
     }
 
-    return (audio_data[num_file].music_in != NULL) ? 1 : -1;
+    return (ctx->audio_data.music_in.fd >= 0) ? 1 : -1;
 }
 
-FILE *
-init_outfile(const char *out_path)
+/************************************************************************
+  seek_infile - restrict an opened input to one segment of its samples.
+    Must be called after init_infile() and before lame_init_params(),
+    since lame uses num_samples to size the LAME tag.
+    in: start_sample   first sample (per channel) of the segment
+        num_samples    number of samples (per channel) in the segment
+returns: 0 on success, -1 if the input cannot be skipped
+*/
+int
+seek_infile(lame_t gfp, enc_ctx_t *ctx, unsigned long start_sample, unsigned long num_samples)
 {
-    FILE *outf;
-    outf = fopen(out_path, "w+b");
+    long const bytes_per_frame =
+        lame_get_num_channels(gfp) * ((ctx->audio_data.pcmbitwidth + 7) / 8);
+
+    if (ctx->audio_data.music_in.fd < 0) {
+        return -1;
+    }
+    if (ctx->audio_data.map != NULL) {
+        size_t const skip = (size_t) start_sample * bytes_per_frame;
+        if (skip > ctx->audio_data.map_size - ctx->audio_data.map_pos)
+            return -1;
+        ctx->audio_data.map_pos += skip;
+        /* the part skipped belongs to other segments, keep its cache */
+        ctx->audio_data.music_in.dropped = (long long) ctx->audio_data.map_pos;
+        ctx->audio_data.map_ahead = ctx->audio_data.map_pos;
+        map_advance(ctx);
+    }
+    else if (start_sample > 0 &&
+        infile_skip(&ctx->audio_data.music_in, (long long) start_sample * bytes_per_frame) != 0) {
+        return -1;
+    }
+    ctx->audio_data.num_samples_read = 0;
+    (void) lame_set_num_samples(gfp, num_samples);
 
-    return outf;
+    return 0;
 }
 
-void
-close_infile(int num_file)
+/************************************************************************
+  get_pcm_view - the samples of an opened input as they are in the file, for
+    the encode cache. Only a mapped input of known length is described, so
+    that the samples can be hashed without reading them again.
+    flags: bit 0 IEEE float, bit 1 byte swapped, bit 2 unsigned 8 bit
+returns: 0 on success, -1 if the input cannot be described
+*/
+int
+get_pcm_view(lame_t gfp, enc_ctx_t *ctx, pcm_view_t *view)
 {
-    if ((audio_data[num_file].music_in != 0)
-            && (audio_data[num_file].music_in != stdin)
-            && (fclose(audio_data[num_file].music_in) != 0)
-            )
-        fprintf(stderr, "Could not close audio input file\n");
+    get_audio_global_data const *ad = &ctx->audio_data;
+    unsigned long const num_samples = lame_get_num_samples(gfp);
+    unsigned long long size;
 
-    audio_data[num_file].music_in = 0;
-    freePcmBuffer(&audio_data[num_file].pcm16);
-    freePcmBuffer(&audio_data[num_file].pcm32);
+    if (ad->map == NULL || num_samples == MAX_U_32_NUM || !ad->count_samples_carefully)
+        return -1;
+    /* what get_audio_common() reads, up to the end of the file */
+    size = (unsigned long long) num_samples * lame_get_num_channels(gfp) * (ad->pcmbitwidth / 8);
+    if (size > ad->map_size - ad->map_pos)
+        size = ad->map_size - ad->map_pos;
+
+    view->data = ad->map + ad->map_pos;
+    view->size = size;
+    view->samplerate = lame_get_in_samplerate(gfp);
+    view->channels = lame_get_num_channels(gfp);
+    view->bitwidth = ad->pcmbitwidth;
+    view->flags = (ad->pcm_is_ieee_float ? 1 : 0) | (ad->pcmswapbytes ? 2 : 0)
+        | (ad->pcm_is_unsigned_8bit ? 4 : 0);
 
-    if (audio_data[num_file].in_id3v2_tag) {
-        free(audio_data[num_file].in_id3v2_tag);
-        audio_data[num_file].in_id3v2_tag = 0;
-        audio_data[num_file].in_id3v2_size = 0;
+    return 0;
+}
+
+void
+close_infile(enc_ctx_t *ctx)
+{
+    ctx->audio_data.hash = NULL;
+    unmap_infile(ctx);
+    infile_close(&ctx->audio_data.music_in);
+    freePcmBuffer(&ctx->audio_data.pcm16);
+    freePcmBuffer(&ctx->audio_data.pcm32);
+
+    if (ctx->audio_data.in_id3v2_tag) {
+        free(ctx->audio_data.in_id3v2_tag);
+        ctx->audio_data.in_id3v2_tag = 0;
+        ctx->audio_data.in_id3v2_size = 0;
     }
 }
 
 static int
-write_xing_frame(lame_global_flags * gf, FILE * outf, size_t offset)
+write_xing_frame(lame_global_flags * gf, out_file_t * outf, size_t offset)
 {
     unsigned char mp3buffer[LAME_MAXMP3BUFFER];
-    size_t imp3, owrite;
+    size_t imp3;
 
     imp3 = lame_get_lametag_frame(gf, mp3buffer, sizeof(mp3buffer));
     if (imp3 <= 0) {
@@ -932,24 +1294,19 @@ write_xing_frame(lame_global_flags * gf, FILE * outf, size_t offset)
              (unsigned long)sizeof(mp3buffer), (unsigned long)imp3);
         return -1;
     }
-    if (fseek(outf, offset, SEEK_SET) != 0) {
+    if (out_pwrite(outf, mp3buffer, imp3, (long long) offset) != 0) {
         printf("fatal error: can't update LAME-tag frame!\n");
         return -1;
     }
-    owrite = (int) fwrite(mp3buffer, 1, imp3, outf);
-    if (owrite != imp3) {
-        printf("Error writing LAME-tag \n");
-        return -1;
-    }
 
     return imp3;
 }
 
 static int
-write_id3v1_tag(lame_t gf, FILE * outf)
+write_id3v1_tag(lame_t gf, out_file_t * outf)
 {
     unsigned char mp3buffer[128];
-    int imp3, owrite;
+    int imp3;
 
     imp3 = lame_get_id3v1_tag(gf, mp3buffer, sizeof(mp3buffer));
     if (imp3 <= 0) {
@@ -960,26 +1317,414 @@ write_id3v1_tag(lame_t gf, FILE * outf)
                      (unsigned long)sizeof(mp3buffer), imp3);
         return 0;       /* not critical */
     }
-    owrite = (int) fwrite(mp3buffer, 1, imp3, outf);
-    if (owrite != imp3) {
+    if (out_write(outf, mp3buffer, imp3) != 0) {
         printf("Error writing ID3v1 tag \n");
         return 1;
     }
     return 0;
 }
 
+/*
+ * Layer III frame length from the 4-byte frame header.
+ * returns 0 if the header is not a valid layer III header.
+ */
+static int
+mp3_frame_length(unsigned char const *h)
+{
+    static int const bitrate_table[2][16] = {
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, -1}, /* MPEG-2, 2.5 */
+        {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, -1} /* MPEG-1 */
+    };
+    static int const samplerate_table[4][3] = {
+        {11025, 12000, 8000},   /* MPEG-2.5 */
+        {0, 0, 0},
+        {22050, 24000, 16000},  /* MPEG-2 */
+        {44100, 48000, 32000}   /* MPEG-1 */
+    };
+    int const version = (h[1] >> 3) & 0x03;
+    int const bitrate_index = (h[2] >> 4) & 0x0f;
+    int const samplerate_index = (h[2] >> 2) & 0x03;
+    int const padding = (h[2] >> 1) & 0x01;
+    int const mpeg1 = (version == 3) ? 1 : 0;
+    int     bitrate, samplerate;
+
+    if (h[0] != 0xff || (h[1] & 0xe0) != 0xe0 || version == 1 || ((h[1] >> 1) & 0x03) != 1)
+        return 0;
+    if (bitrate_index == 0 || bitrate_index == 15 || samplerate_index == 3)
+        return 0;
+    bitrate = bitrate_table[mpeg1][bitrate_index] * 1000;
+    samplerate = samplerate_table[version][samplerate_index];
+
+    return (mpeg1 ? 144 : 72) * bitrate / samplerate + padding;
+}
+
+/* CRC-16 (polynomial 0x8005, reflected) as used by the LAME tag */
+static unsigned int
+lametag_crc_update(unsigned int crc, unsigned char const *buf, size_t len)
+{
+    size_t  i;
+    int     k;
+
+    for (i = 0; i < len; ++i) {
+        crc ^= buf[i];
+        for (k = 0; k < 8; ++k)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : (crc >> 1);
+    }
+    return crc & 0xffff;
+}
+
+static void
+put_u32_be(unsigned char *p, unsigned long v)
+{
+    p[0] = (unsigned char) (v >> 24);
+    p[1] = (unsigned char) (v >> 16);
+    p[2] = (unsigned char) (v >> 8);
+    p[3] = (unsigned char) v;
+}
+
+/************************************************************************
+  stitch_segments - join independently encoded segments of one file.
+    Every segment was encoded without bit reservoir, so frames can be cut
+    at any boundary. The priming frames of each segment are dropped, and
+    the LAME tag frame written by the first segment is updated for the
+    whole stream: frame and byte counts, TOC, padding and both CRCs.
+    in: segs         segments in order. The first frame of segs[0] is the tag.
+        framesize    samples per frame
+        num_samples  samples (per channel) of the whole input
+returns: 0 on success, -1 on failure
+*/
+int
+stitch_segments(out_file_t * outf, mp3_segment const *segs, int num_segs, int framesize,
+                unsigned long num_samples)
+{
+    unsigned char tag[4096];
+    size_t  tag_size = 0;
+    size_t  audio_bytes = 0;
+    unsigned long *offsets = NULL;
+    unsigned long num_frames = 0, cap_frames = 0;
+    unsigned int music_crc = 0;
+    long long total = 0;
+    int     len = 0;
+    int     i;
+
+    /* the output is never larger than the segments put together */
+    for (i = 0; i < num_segs; ++i)
+        total += segs[i].data->len;
+    out_reserve(outf, total);
+
+    for (i = 0; i < num_segs; ++i) {
+        unsigned char const *buf = segs[i].data->buf;
+        unsigned char const *end = buf + segs[i].data->len;
+        unsigned long frame = 0;
+
+        for (; end - buf >= 4; buf += len) {
+            int     keep;
+
+            len = mp3_frame_length(buf);
+            if (len < 4 || (size_t) len > sizeof(tag)) {
+                printf("Error stitching segment %d: lost frame sync\n", i + 1);
+                free(offsets);
+                return -1;
+            }
+            if (end - buf < len) {
+                break;
+            }
+            if (i == 0 && tag_size == 0) {
+                /* the LAME tag frame, written back after all the frames are known */
+                memcpy(tag, buf, len);
+                tag_size = len;
+                if (out_write(outf, tag, tag_size) != 0) {
+                    free(offsets);
+                    return -1;
+                }
+                continue;
+            }
+            keep = frame >= segs[i].skip_frames
+                && (segs[i].keep_frames == 0 || frame < segs[i].skip_frames + segs[i].keep_frames);
+            frame++;
+            if (!keep)
+                continue;
+
+            if (num_frames == cap_frames) {
+                unsigned long *p;
+                cap_frames = cap_frames ? cap_frames * 2 : 4096;
+                p = realloc(offsets, cap_frames * sizeof(*offsets));
+                if (p == NULL) {
+                    free(offsets);
+                    return -1;
+                }
+                offsets = p;
+            }
+            offsets[num_frames++] = (unsigned long) audio_bytes;
+            music_crc = lametag_crc_update(music_crc, buf, len);
+            if (out_write(outf, buf, len) != 0) {
+                printf("Error writing mp3 output \n");
+                free(offsets);
+                return -1;
+            }
+            audio_bytes += len;
+        }
+    }
+
+    if (tag_size > 0 && num_frames > 0) {
+        unsigned char *xing = NULL;
+        size_t  k;
+
+        for (k = 4; k + 120 + 36 <= tag_size; ++k) {
+            if (!memcmp(tag + k, "Xing", 4) || !memcmp(tag + k, "Info", 4)) {
+                xing = tag + k;
+                break;
+            }
+        }
+        /* patch only the layout lame writes: frames, bytes, TOC and quality present */
+        if (xing != NULL && (xing[7] & 0x0f) == 0x0f) {
+            unsigned char *lame = xing + 120;
+            unsigned long const total_bytes = (unsigned long) (tag_size + audio_bytes);
+            int const delay = (lame[21] << 4) | (lame[22] >> 4);
+            long    padding = (long) (num_frames * framesize) - delay - (long) num_samples;
+
+            put_u32_be(xing + 8, num_frames);
+            put_u32_be(xing + 12, total_bytes);
+            for (k = 0; k < 100; ++k) {
+                unsigned long const pos = offsets[k * num_frames / 100];
+                unsigned long seek_point = (unsigned long) (256.0 * pos / audio_bytes);
+                xing[16 + k] = (unsigned char) (seek_point > 255 ? 255 : seek_point);
+            }
+            if (padding < 0)
+                padding = 0;
+            if (padding > 0xfff)
+                padding = 0xfff;
+            lame[22] = (unsigned char) ((lame[22] & 0xf0) | ((padding >> 8) & 0x0f));
+            lame[23] = (unsigned char) (padding & 0xff);
+            put_u32_be(lame + 28, total_bytes);
+            lame[32] = (unsigned char) (music_crc >> 8);
+            lame[33] = (unsigned char) music_crc;
+            {
+                unsigned int const tag_crc =
+                    lametag_crc_update(0, tag, (size_t) (lame + 34 - tag));
+                lame[34] = (unsigned char) (tag_crc >> 8);
+                lame[35] = (unsigned char) tag_crc;
+            }
+        }
+        if (out_pwrite(outf, tag, tag_size, 0) != 0) {
+            printf("fatal error: can't update LAME-tag frame!\n");
+            free(offsets);
+            return -1;
+        }
+    }
+    free(offsets);
+
+    return 0;
+}
+
 size_t
-sizeOfOldTag(lame_t gf, int num_file)
+sizeOfOldTag(lame_t gf, enc_ctx_t *ctx)
 {
     (void) gf;
-    return audio_data[num_file].in_id3v2_size;
+    return ctx->audio_data.in_id3v2_size;
 }
 
 unsigned char*
-getOldTag(lame_t gf, int num_file)
+getOldTag(lame_t gf, enc_ctx_t *ctx)
 {
     (void) gf;
-    return audio_data[num_file].in_id3v2_tag;
+    return ctx->audio_data.in_id3v2_tag;
+}
+
+/* pipelined encoding: reader -> pcm ring -> encoder -> mp3 ring -> writer */
+
+#define PCM_RING_SLOTS  32
+#define MP3_RING_SLOTS  32
+#define MP3_BLOCK_SIZE  8192
+
+typedef struct pcm_block {
+    int     n;                  /* samples per channel, 0 at eof, negative on error */
+    int     buf[2][1152];
+} pcm_block;
+
+typedef struct mp3_block {
+    int     n;                  /* bytes used in data */
+    unsigned char data[MP3_BLOCK_SIZE];
+} mp3_block;
+
+typedef struct pipeline {
+    th_param_t *param;
+    spsc_ring_t pcm;
+    spsc_ring_t mp3;
+    int     write_error;        /* set by the writer, read after it is joined */
+} pipeline;
+
+/************************************************************************
+  encode_buffer - encode samples read by get_audio()
+    Samples of IEEE float input are still the floats of the file, which
+    go to the encoder as they are. Nothing is clipped on the way, and the
+    encoder does not convert them back from int.
+*/
+static int
+encode_buffer(lame_t gfp, int buffer[2][1152], int nsamples,
+              unsigned char *mp3buf, int mp3buf_size, enc_ctx_t *ctx)
+{
+    if (ctx->audio_data.pcm_is_ieee_float)
+        return lame_encode_buffer_ieee_float(gfp, (const float *) buffer[0],
+                                             (const float *) buffer[1], nsamples,
+                                             mp3buf, mp3buf_size);
+    return lame_encode_buffer_int(gfp, buffer[0], buffer[1], nsamples, mp3buf, mp3buf_size);
+}
+
+/* get_audio() only reads the settings of gf fixed by lame_init_params(),
+   so it can run beside encode_buffer() on the same gf. */
+static void *
+pipeline_reader(void *data)
+{
+    pipeline *pl = (pipeline *) data;
+    pcm_block *blk;
+    int     iread;
+
+    do {
+        blk = (pcm_block *) ring_write_slot(&pl->pcm);
+        if (blk == NULL)        /* encoder gave up */
+            break;
+        iread = blk->n = get_audio(pl->param->gf, blk->buf, pl->param->ctx);
+        ring_write_commit(&pl->pcm);
+    } while (iread > 0);
+    ring_close(&pl->pcm);
+
+    return NULL;
+}
+
+static void *
+pipeline_writer(void *data)
+{
+    pipeline *pl = (pipeline *) data;
+    out_file_t *outf = pl->param->outf;
+    mp3_block *blk;
+
+    while ((blk = (mp3_block *) ring_read_slot(&pl->mp3)) != NULL) {
+        if (out_write(outf, blk->data, blk->n) != 0) {
+            printf("Error writing mp3 output \n");
+            pl->write_error = 1;
+            ring_close(&pl->mp3);
+            break;
+        }
+        if (pl->param->ctx->writer_config.flush_write == 1) {
+            out_flush(outf);
+        }
+        ring_read_release(&pl->mp3);
+    }
+
+    return NULL;
+}
+
+static int
+pipeline_push(pipeline * pl, unsigned char const *buf, int len)
+{
+    mp3_block *blk;
+
+    while (len > 0) {
+        blk = (mp3_block *) ring_write_slot(&pl->mp3);
+        if (blk == NULL)        /* writer gave up */
+            return -1;
+        blk->n = len < MP3_BLOCK_SIZE ? len : MP3_BLOCK_SIZE;
+        memcpy(blk->data, buf, blk->n);
+        buf += blk->n;
+        len -= blk->n;
+        ring_write_commit(&pl->mp3);
+    }
+
+    return 0;
+}
+
+/* Encode the whole input with the read and the write in their own threads, so
+   the encoder does not wait on I/O. Returns once every frame is written, the
+   caller then appends the tags to outf as usual. */
+static int
+encode_pipelined(th_param_t * param, unsigned char *mp3buffer, int mp3buffer_size)
+{
+    pipeline pl;
+    pthread_t reader, writer;
+    pcm_block *blk;
+    int     iread, imp3 = 0;
+    int     ret = 0;
+
+    pl.param = param;
+    pl.write_error = 0;
+    if (ring_init(&pl.pcm, sizeof(pcm_block), PCM_RING_SLOTS) < 0)
+        return 1;
+    if (ring_init(&pl.mp3, sizeof(mp3_block), MP3_RING_SLOTS) < 0) {
+        ring_destroy(&pl.pcm);
+        return 1;
+    }
+    if (pthread_create(&reader, NULL, pipeline_reader, &pl) != 0) {
+        printf("Error creating reader thread \n");
+        ring_destroy(&pl.mp3);
+        ring_destroy(&pl.pcm);
+        return 1;
+    }
+    if (pthread_create(&writer, NULL, pipeline_writer, &pl) != 0) {
+        printf("Error creating writer thread \n");
+        ring_close(&pl.pcm);
+        pthread_join(reader, NULL);
+        ring_destroy(&pl.mp3);
+        ring_destroy(&pl.pcm);
+        return 1;
+    }
+
+    /* encode until we hit eof */
+    do {
+        blk = (pcm_block *) ring_read_slot(&pl.pcm);
+        if (blk == NULL)
+            break;
+        iread = blk->n;
+        if (iread >= 0)
+            imp3 = encode_buffer(param->gf, blk->buf, iread, mp3buffer, mp3buffer_size,
+                                 param->ctx);
+        ring_read_release(&pl.pcm);
+
+        /* a read error is not the end of the input, the output would be cut short */
+        if (iread < 0) {
+            ret = 1;
+            break;
+        }
+        if (imp3 < 0) {
+            if (imp3 == -1)
+                printf("mp3 buffer is not big enough... \n");
+            else
+                printf("mp3 internal error:  error code=%i\n", imp3);
+            ret = 1;
+            break;
+        }
+        if (pipeline_push(&pl, mp3buffer, imp3) < 0) {
+            ret = 1;
+            break;
+        }
+    } while (iread > 0);
+
+    if (ret == 0) {
+        imp3 = lame_encode_flush(param->gf, mp3buffer, mp3buffer_size); /* may return one more mp3 frame */
+        if (imp3 < 0) {
+            if (imp3 == -1)
+                printf("mp3 buffer is not big enough... \n");
+            else
+                printf("mp3 internal error:  error code=%i\n", imp3);
+            ret = 1;
+        }
+        else if (pipeline_push(&pl, mp3buffer, imp3) < 0) {
+            ret = 1;
+        }
+    }
+
+    /* closing the pcm ring also stops the reader if the encoder gave up early */
+    ring_close(&pl.pcm);
+    ring_close(&pl.mp3);
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    ring_destroy(&pl.mp3);
+    ring_destroy(&pl.pcm);
+
+    if (pl.write_error)
+        ret = 1;
+
+    return ret;
 }
 
 void *
@@ -992,41 +1737,54 @@ lame_encoder_loop(void *data)
 
     th_param_t *param = (th_param_t *)data;
     lame_global_flags *gf = param->gf;
-    FILE *outf = param->outf;
+    out_file_t *outf = param->outf;
     char *inPath = param->in_path;
     char *outPath = param->out_path;
-    int num_file = param->idx_file;
+    enc_ctx_t *ctx = param->ctx;
 
     id3v2_size = lame_get_id3v2_tag(gf, 0, 0);
     if (id3v2_size > 0) {
         unsigned char *id3v2tag = malloc(id3v2_size);
         if (id3v2tag != 0) {
             imp3 = lame_get_id3v2_tag(gf, id3v2tag, id3v2_size);
-            owrite = (int) fwrite(id3v2tag, 1, imp3, outf);
+            owrite = out_write(outf, id3v2tag, imp3);
             free(id3v2tag);
-            if (owrite != imp3) {
+            if (owrite != 0) {
                 printf("Error writing ID3v2 tag \n");
                 return (void *)1;
             }
         }
     }
     else {
-        unsigned char* id3v2tag = getOldTag(gf, num_file);
-        id3v2_size = sizeOfOldTag(gf, num_file);
+        unsigned char* id3v2tag = getOldTag(gf, ctx);
+        id3v2_size = sizeOfOldTag(gf, ctx);
         if ( id3v2_size > 0 ) {
-            size_t owrite = fwrite(id3v2tag, 1, id3v2_size, outf);
-            if (owrite != id3v2_size) {
+            if (out_write(outf, id3v2tag, id3v2_size) != 0) {
                 printf("Error writing ID3v2 tag \n");
                 return (void *)1;
             }
         }
     }
-    if (writer_config[num_file].flush_write == 1) {
-        fflush(outf);
+    if (ctx->writer_config.flush_write == 1) {
+        out_flush(outf);
+    }
+
+    /* preallocate the estimated size, with some room for VBR peaks */
+    if (param->num_segs <= 1 && lame_get_num_samples(gf) != MAX_U_32_NUM
+        && lame_get_compression_ratio(gf) > 0) {
+        double pcm_bytes = (double) lame_get_num_samples(gf) * lame_get_num_channels(gf) * 2
+            * lame_get_out_samplerate(gf) / lame_get_in_samplerate(gf);
+
+        out_reserve(outf, (long long) (pcm_bytes / lame_get_compression_ratio(gf) * 1.1)
+                    + id3v2_size + 4096);
     }
 
     /* print encoding information */
-    printf(" %2d: %-25s -> %-25s\n", num_file + 1, inPath, outPath);
+    if (param->num_segs > 1)
+        printf(" %2d: %-25s -> %-25s (segment %d/%d)\n", param->idx_file + 1, inPath, outPath,
+               param->seg_index + 1, param->num_segs);
+    else
+        printf(" %2d: %-25s -> %-25s\n", param->idx_file + 1, inPath, outPath);
     if (param->verbose)
     {
         printf("    Encoding as %g kHz ", 1.e-3 * lame_get_out_samplerate(gf));
@@ -1072,16 +1830,23 @@ lame_encoder_loop(void *data)
         }
     }
 
-    /* encode until we hit eof */
-    do {
-        /* read in 'iread' samples */
-        iread = get_audio(gf, buf, num_file);
+    if (param->pipeline) {
+        if (encode_pipelined(param, mp3buffer, sizeof(mp3buffer)) != 0)
+            return (void *)1;
+    }
+    else {
+        /* encode until we hit eof */
+        do {
+            /* read in 'iread' samples */
+            iread = get_audio(gf, buf, ctx);
 
-        if (iread >= 0) {
+            /* a read error is not the end of the input, the output would be cut short */
+            if (iread < 0) {
+                return (void *)1;
+            }
 
             /* encode */
-            imp3 = lame_encode_buffer_int(gf, buf[0], buf[1], iread,
-                                          mp3buffer, sizeof(mp3buffer));
+            imp3 = encode_buffer(gf, buf, iread, mp3buffer, sizeof(mp3buffer), ctx);
 
             /* was our output buffer big enough? */
             if (imp3 < 0) {
@@ -1091,50 +1856,53 @@ lame_encoder_loop(void *data)
                     printf("mp3 internal error:  error code=%i\n", imp3);
                 return (void *)1;
             }
-            owrite = (int) fwrite(mp3buffer, 1, imp3, outf);
-            if (owrite != imp3) {
+            if (out_write(outf, mp3buffer, imp3) != 0) {
                 printf("Error writing mp3 output \n");
                 return (void *)1;
             }
-        }
-        if (writer_config[num_file].flush_write == 1) {
-            fflush(outf);
-        }
-    } while (iread > 0);
+            if (ctx->writer_config.flush_write == 1) {
+                out_flush(outf);
+            }
+        } while (iread > 0);
 
-    imp3 = lame_encode_flush(gf, mp3buffer, sizeof(mp3buffer)); /* may return one more mp3 frame */
+        imp3 = lame_encode_flush(gf, mp3buffer, sizeof(mp3buffer)); /* may return one more mp3 frame */
 
-    if (imp3 < 0) {
-        if (imp3 == -1)
-            printf("mp3 buffer is not big enough... \n");
-        else
-            printf("mp3 internal error:  error code=%i\n", imp3);
-        return (void *)1;
+        if (imp3 < 0) {
+            if (imp3 == -1)
+                printf("mp3 buffer is not big enough... \n");
+            else
+                printf("mp3 internal error:  error code=%i\n", imp3);
+            return (void *)1;
 
-    }
+        }
 
-    owrite = (int) fwrite(mp3buffer, 1, imp3, outf);
-    if (owrite != imp3) {
-        printf("Error writing mp3 output \n");
-        return (void *)1;
-    }
-    if (writer_config[num_file].flush_write == 1) {
-        fflush(outf);
+        if (out_write(outf, mp3buffer, imp3) != 0) {
+            printf("Error writing mp3 output \n");
+            return (void *)1;
+        }
+        if (ctx->writer_config.flush_write == 1) {
+            out_flush(outf);
+        }
     }
+
     imp3 = write_id3v1_tag(gf, outf);
-    if (writer_config[num_file].flush_write == 1) {
-        fflush(outf);
+    if (ctx->writer_config.flush_write == 1) {
+        out_flush(outf);
     }
     if (imp3) {
         return (void *)1;
     }
 
-    write_xing_frame(gf, outf, id3v2_size);
-    if (writer_config[num_file].flush_write == 1) {
-        fflush(outf);
+    /* the output is moved into place only if the tag made it */
+    if (write_xing_frame(gf, outf, id3v2_size) < 0) {
+        return (void *)1;
+    }
+    if (ctx->writer_config.flush_write == 1) {
+        out_flush(outf);
     }
 
-    printf(" %2d: Done\n", num_file + 1);
+    if (param->num_segs <= 1)
+        printf(" %2d: Done\n", param->idx_file + 1);
 
     return (void *)0;
 }
@@ -16,6 +16,15 @@
 #endif
 
 #define MAX_U_32_NUM    0xFFFFFFFF
+#define CACHE_LINE_SIZE 64
+#define READAHEAD_DEFAULT (1024 * 1024)    /* input read-ahead block in bytes */
+#define AUDIO_READER_VERSION 2             /* bumped when the samples given to lame change */
+
+#if defined (_MSC_VER)
+#define CACHE_ALIGNED   __declspec(align(CACHE_LINE_SIZE))
+#else
+#define CACHE_ALIGNED   __attribute__((aligned(CACHE_LINE_SIZE)))
+#endif
 
 /**
  * @brief	Constant values for parsing wave header
@@ -25,6 +34,11 @@ static int const WAV_ID_RIFF = 0x52494646;  /* "RIFF" */
 static int const WAV_ID_WAVE = 0x57415645;  /* "WAVE" */
 static int const WAV_ID_FMT = 0x666d7420;   /* "fmt " */
 static int const WAV_ID_DATA = 0x64617461;  /* "data" */
+static int const WAV_ID_RF64 = 0x52463634;  /* "RF64" */
+static int const WAV_ID_BW64 = 0x42573634;  /* "BW64" */
+static int const WAV_ID_DS64 = 0x64733634;  /* "ds64" */
+static int const WAV_ID_W64_RIFF = 0x72696666; /* "riff", head of the Wave64 GUID */
+static int const WAV_ID_W64_WAVE = 0x77617665; /* "wave", head of the Wave64 GUID */
 #ifndef WAVE_FORMAT_PCM
 static short const WAVE_FORMAT_PCM = 0x0001;
 #endif
@@ -35,9 +49,27 @@ static short const WAVE_FORMAT_IEEE_FLOAT = 0x0003;
 static short const WAVE_FORMAT_EXTENSIBLE = 0xFFFE;
 #endif
 
-int   init_infile(lame_t gfp, char const *inPath, const int num_file);
-FILE *init_outfile(const char *outFile);
-void  close_infile(int num_file);
+/**
+ * @brief	One segment of a file encoded on its own
+ * @see		stitch_segments()
+ */
+typedef struct mp3_segment {
+    out_file_t *data;               /* encoded frames of the segment, kept in memory */
+    unsigned long skip_frames;      /* priming frames to drop */
+    unsigned long keep_frames;      /* frames to keep after them, 0 for all the rest */
+} mp3_segment;
+
+enc_ctx_t *enc_ctx_new(void);
+void  enc_ctx_free(enc_ctx_t *ctx);
+void  enc_ctx_set_readahead(enc_ctx_t *ctx, size_t size);
+void  enc_ctx_set_hash(enc_ctx_t *ctx, hash64_t *hash);
+void  enc_ctx_set_map(enc_ctx_t *ctx, int map);
+int   init_infile(lame_t gfp, char const *inPath, enc_ctx_t *ctx);
+int   seek_infile(lame_t gfp, enc_ctx_t *ctx, unsigned long start_sample, unsigned long num_samples);
+void  close_infile(enc_ctx_t *ctx);
+int   get_pcm_view(lame_t gfp, enc_ctx_t *ctx, pcm_view_t *view);
 void *lame_encoder_loop(void *data);
+int   stitch_segments(out_file_t *outf, mp3_segment const *segs, int num_segs, int framesize,
+                      unsigned long num_samples);
 
 #endif /* AUDIO_H_ */
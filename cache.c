@@ -0,0 +1,255 @@
+/**
+ * @file		cache.c
+ * @version		0.6
+ * @brief		content-addressed cache of encoded files
+ * @date		Feb 25, 2020
+ * @author		Siwon Kang (kkangshawn@gmail.com)
+ */
+
+#include "cache.h"
+#include "output.h"
+
+/* multiplier of a step, the golden ratio */
+#define HASH_PRIME				0x9e3779b97f4a7c15ULL
+/* multipliers of a step of the second lane, those of xxHash64 */
+#define HASH2_PRIME1			0x9e3779b185ebca87ULL
+#define HASH2_PRIME2			0xc2b2ae3d27d4eb4fULL
+
+/**
+ * @brief	Mix one word into the hash. The shift carries the high bits of the
+ *		product back down, so every bit of the word reaches every bit of the hash.
+ */
+static unsigned long long hash64_mix(unsigned long long h, unsigned long long w)
+{
+	h = (h ^ w) * HASH_PRIME;
+	return h ^ (h >> 32);
+}
+
+/**
+ * @brief	Mix one word into the second lane, a round of xxHash64. It adds and
+ *		rotates where the first lane xors and shifts, so that words colliding
+ *		in one lane do not collide in the other.
+ */
+static unsigned long long hash64_mix2(unsigned long long h, unsigned long long w)
+{
+	h += w * HASH2_PRIME2;
+	h = (h << 31) | (h >> 33);
+	return h * HASH2_PRIME1;
+}
+
+void hash64_init(hash64_t *hash)
+{
+	hash->h = 0xcbf29ce484222325ULL;
+	hash->h2 = 0x27d4eb2f165667c5ULL;
+	hash->len = 0;
+	hash->num_tail = 0;
+}
+
+/**
+ * @brief	Feed bytes to the hash. The result does not depend on how the bytes
+ *		are cut into pieces.
+ */
+void hash64_update(hash64_t *hash, const void *data, size_t n)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	unsigned long long h = hash->h;
+	unsigned long long h2 = hash->h2;
+	unsigned long long w;
+
+	hash->len += n;
+	if (hash->num_tail > 0) {
+		size_t fill = 8 - hash->num_tail;
+
+		if (fill > n) {
+			fill = n;
+		}
+		memcpy(hash->tail + hash->num_tail, p, fill);
+		hash->num_tail += fill;
+		p += fill;
+		n -= fill;
+		if (hash->num_tail < 8) {
+			return;
+		}
+		memcpy(&w, hash->tail, 8);
+		h = hash64_mix(h, w);
+		h2 = hash64_mix2(h2, w);
+		hash->num_tail = 0;
+	}
+	for (; n >= 8; p += 8, n -= 8) {
+		memcpy(&w, p, 8);
+		h = hash64_mix(h, w);
+		h2 = hash64_mix2(h2, w);
+	}
+	memcpy(hash->tail, p, n);
+	hash->num_tail = n;
+	hash->h = h;
+	hash->h2 = h2;
+}
+
+/**
+ * @brief	Finish the hash, the state is left as it is
+ */
+unsigned long long hash64_final(const hash64_t *hash)
+{
+	unsigned long long h = hash->h;
+	unsigned long long w = 0;
+
+	memcpy(&w, hash->tail, hash->num_tail);
+	h = hash64_mix(h, w);
+	h = hash64_mix(h, hash->len);
+	/* final avalanche of MurmurHash3 */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb93fe53cc53bULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+/**
+ * @brief	Finish the 128-bit hash, the first lane and the second one.
+ *		The state is left as it is.
+ */
+void hash64_final128(const hash64_t *hash, unsigned long long key[2])
+{
+	unsigned long long h = hash->h2;
+	unsigned long long w = 0;
+
+	memcpy(&w, hash->tail, hash->num_tail);
+	h = hash64_mix2(h, w);
+	h = hash64_mix2(h, hash->len);
+	/* final avalanche of xxHash64 */
+	h ^= h >> 33;
+	h *= HASH2_PRIME2;
+	h ^= h >> 29;
+	h *= 0x165667b19e3779f9ULL;
+	h ^= h >> 32;
+
+	key[0] = hash64_final(hash);
+	key[1] = h;
+}
+
+/**
+ * @brief	Path of the directory of a probe, or of an entry in it if key is given
+ */
+static void cache_path(char path[PATH_MAX + 1], const char *dir,
+					   unsigned long long probe, const unsigned long long *key)
+{
+	if (key) {
+		snprintf(path, PATH_MAX + 1, "%s/%016llx/%016llx%016llx.mp3", dir, probe, key[0], key[1]);
+	}
+	else {
+		snprintf(path, PATH_MAX + 1, "%s/%016llx", dir, probe);
+	}
+}
+
+/**
+ * @brief	Look up the encoded file of a job in the cache.
+ *		Entries live in dir/<probe>/<key>.mp3. The probe hashes the settings,
+ *		the sample format and the head of the samples, which the read-ahead
+ *		already brought in. Only if a directory exists for the probe are all
+ *		the samples hashed before encoding. Otherwise the job is a miss for
+ *		sure, and its key is hashed by the reader while it is encoded, so a
+ *		miss costs no extra pass over the input. The key is 128 bits of two
+ *		independent hashes and the probe covers the size of the samples, so
+ *		different samples are not served each other's entry.
+ * @param [in]	fingerprint	Fingerprint of the encoder settings
+ * @param [in]	view		Samples of the input
+ * @param [out]	entry		Key of the job, to be given to cache_store() on a miss
+ * @param [in,out]	out		Output of the job, filled from the entry on a hit
+ * @param [out]	saved		Seconds the entry took to encode on a hit, 0 if unknown
+ * @return	1 on a hit, 0 on a miss
+ */
+int cache_lookup(const char *dir, unsigned long long fingerprint, const pcm_view_t *view,
+				 cache_entry_t *entry, out_file_t *out, double *saved)
+{
+	char path[PATH_MAX + 1];
+	char time[32];
+	hash64_t hash;
+	struct stat st;
+	int format[4];
+	int len;
+
+	*saved = 0;
+	format[0] = view->samplerate;
+	format[1] = view->channels;
+	format[2] = view->bitwidth;
+	format[3] = view->flags;
+	hash64_init(&hash);
+	hash64_update(&hash, &fingerprint, sizeof(fingerprint));
+	hash64_update(&hash, format, sizeof(format));
+	hash64_update(&hash, &view->size, sizeof(view->size));
+	hash64_update(&hash, view->data,
+				  (size_t)(view->size < CACHE_PROBE_SIZE ? view->size : CACHE_PROBE_SIZE));
+	entry->probe = hash64_final(&hash);
+	entry->size = view->size;
+	entry->known = 0;
+	hash64_init(&entry->hash);
+
+	cache_path(path, dir, entry->probe, NULL);
+	if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		return 0;
+	}
+
+	/* something with the same head was encoded, the whole samples decide */
+	hash64_update(&entry->hash, view->data, (size_t)view->size);
+	hash64_final128(&entry->hash, entry->key);
+	entry->known = 1;
+	cache_path(path, dir, entry->probe, entry->key);
+	if (stat(path, &st) != 0 || out_copy_file(out, path) < 0) {
+		return 0;
+	}
+
+	len = out_get_attr(path, CACHE_TIME_ATTR, time, sizeof(time) - 1);
+	if (len > 0) {
+		time[len] = '\0';
+		*saved = atof(time);
+	}
+
+	return 1;
+}
+
+/**
+ * @brief	Add the output of a job which missed to the cache.
+ *		The entry is written under a temporary name and renamed, so workers
+ *		storing the same entry at once, or another process, never see a
+ *		partial one. It is a copy rather than a hard link, since the output
+ *		may carry a stamp of its own.
+ * @param [in]	entry		Key found by cache_lookup(), with the hash fed by the reader
+ * @param [in]	mp3_path	Output of the job, in place
+ * @param [in]	seconds		Time the encoding took
+ * @return	0 on success, -1 if the entry cannot be written
+ */
+int cache_store(const char *dir, cache_entry_t *entry, const char *mp3_path, double seconds)
+{
+	char path[PATH_MAX + 1];
+	char time[32];
+	out_file_t *out;
+
+	if (!entry->known) {
+		/* the reader stopped short, the hash does not cover what the key means */
+		if (entry->hash.len != entry->size) {
+			return -1;
+		}
+		hash64_final128(&entry->hash, entry->key);
+		entry->known = 1;
+	}
+
+	cache_path(path, dir, entry->probe, entry->key);
+	if (out_make_dirs(path) < 0) {
+		return -1;
+	}
+	out = out_open(path, SYNC_NONE);
+	if (out == NULL) {
+		return -1;
+	}
+	if (out_copy_file(out, mp3_path) < 0) {
+		out_discard(out);
+		return -1;
+	}
+	snprintf(time, sizeof(time), "%.3f", seconds);
+	out_set_attr(out, CACHE_TIME_ATTR, time);
+
+	return out_close(out);
+}
@@ -0,0 +1,85 @@
+/**
+ * @file		cache.h
+ * @version		0.6
+ * @brief		header for cache.c
+ * @date		Feb 25, 2020
+ * @author		Siwon Kang (kkangshawn@gmail.com)
+ */
+
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include "main.h"
+
+/* bytes at the head of the samples hashed to tell whether an entry may exist */
+#define CACHE_PROBE_SIZE		(64 * 1024)
+
+/* extended attribute of an entry holding the seconds its encoding took */
+#define CACHE_TIME_ATTR			"user.mp3enc.time"
+
+/**
+ * @typedef	hash64_t
+ * @brief	state of a 64-bit hash fed a piece at a time. Eight bytes are mixed
+ *		per step, so it keeps up with reading the samples. A second lane mixed
+ *		in another way makes a 128-bit hash of the same bytes.
+ * @param	h					Hash of the words so far
+ * @param	h2					Hash of the words so far, second lane
+ * @param	len					The number of bytes fed
+ * @param	tail				Bytes not making a whole word yet
+ * @param	num_tail			The number of bytes in tail
+ * @see		hash64_init()
+ */
+struct hash64 {
+	unsigned long long h;
+	unsigned long long h2;
+	unsigned long long len;
+	unsigned char tail[8];
+	size_t num_tail;
+};
+
+/**
+ * @typedef	pcm_view_t
+ * @brief	samples of an opened input as they are stored in the file
+ * @param	data				The samples in the mapping of the input
+ * @param	size				Bytes of the samples the encoder reads
+ * @param	samplerate			Sample rate of the input
+ * @param	channels			The number of channels
+ * @param	bitwidth			Bits per sample
+ * @param	flags				How the samples are decoded, see get_pcm_view()
+ */
+struct pcm_view {
+	const unsigned char *data;
+	unsigned long long size;
+	int samplerate;
+	int channels;
+	int bitwidth;
+	int flags;
+};
+
+/**
+ * @typedef	cache_entry_t
+ * @brief	cache key of one job, found by cache_lookup() and used by cache_store()
+ * @param	probe				Hash of the settings, the format and the head of the samples
+ * @param	key					128-bit hash of all the samples, valid if known is set
+ * @param	known				Set once key is computed
+ * @param	size				Bytes of the samples
+ * @param	hash				Hash fed by the reader while the job is encoded, if known is not set
+ */
+typedef struct cache_entry {
+	unsigned long long probe;
+	unsigned long long key[2];
+	int known;
+	unsigned long long size;
+	hash64_t hash;
+} cache_entry_t;
+
+void  hash64_init(hash64_t *hash);
+void  hash64_update(hash64_t *hash, const void *data, size_t n);
+unsigned long long hash64_final(const hash64_t *hash);
+void  hash64_final128(const hash64_t *hash, unsigned long long key[2]);
+
+int   cache_lookup(const char *dir, unsigned long long fingerprint, const pcm_view_t *view,
+				   cache_entry_t *entry, out_file_t *out, double *saved);
+int   cache_store(const char *dir, cache_entry_t *entry, const char *mp3_path, double seconds);
+
+#endif /* CACHE_H_ */
@@ -0,0 +1,176 @@
+/**
+ * @file		deque.c
+ * @version		0.6
+ * @brief		Chase-Lev work-stealing deque distributing jobs among the workers
+ * @date		Feb 25, 2020
+ * @author		Siwon Kang (kkangshawn@gmail.com)
+ */
+
+#include "deque.h"
+
+
+/**
+ * @brief	Allocate an array of size items
+ */
+static ws_array_t *ws_array_new(long size)
+{
+	ws_array_t *array;
+
+	array = (ws_array_t *)malloc(sizeof(ws_array_t) + sizeof(void *) * (size - 1));
+	if (array == NULL) {
+		fprintf(stderr, "ERROR: Cannot allocate memory.\n");
+		return NULL;
+	}
+	array->size = size;
+	array->prev = NULL;
+
+	return array;
+}
+
+/**
+ * @brief	Initialize an empty deque
+ * @param [in]	capacity	Initial number of items, rounded up to a power of two.
+ *							The deque grows when it is full.
+ * @return	0 on success, -1 if out of memory
+ */
+int ws_deque_init(ws_deque_t *deque, long capacity)
+{
+	long size = 16;
+
+	while (size < capacity)
+		size <<= 1;
+
+	deque->top = 0;
+	deque->bottom = 0;
+	deque->array = ws_array_new(size);
+
+	return deque->array ? 0 : -1;
+}
+
+/**
+ * @brief	Release a deque and every array it has used
+ */
+void ws_deque_destroy(ws_deque_t *deque)
+{
+	ws_array_t *array = deque->array;
+
+	while (array) {
+		ws_array_t *prev = array->prev;
+		free(array);
+		array = prev;
+	}
+	deque->array = NULL;
+}
+
+/**
+ * @brief	Make room for n more items. Only the owner may call it.
+ * @return	0 on success, -1 if out of memory
+ */
+int ws_deque_reserve(ws_deque_t *deque, long n)
+{
+	long b = ATOMIC_LOAD(&deque->bottom);
+	long t = ATOMIC_LOAD(&deque->top);
+	ws_array_t *array = deque->array;
+	ws_array_t *grown;
+	long size = array->size;
+	long i;
+
+	while (b - t + n > size)
+		size <<= 1;
+	if (size == array->size)
+		return 0;
+
+	grown = ws_array_new(size);
+	if (grown == NULL)
+		return -1;
+	for (i = t; i < b; i++) {
+		grown->items[i & (grown->size - 1)] = array->items[i & (array->size - 1)];
+	}
+	grown->prev = array;
+	ATOMIC_STORE_PTR(&deque->array, grown);
+
+	return 0;
+}
+
+/**
+ * @brief	Push an item at the bottom. Only the owner may call it.
+ * @return	0 on success, -1 if out of memory
+ */
+int ws_deque_push(ws_deque_t *deque, void *item)
+{
+	ws_array_t *array;
+	long b;
+
+	if (ws_deque_reserve(deque, 1) < 0)
+		return -1;
+
+	b = ATOMIC_LOAD(&deque->bottom);
+	array = deque->array;
+	array->items[b & (array->size - 1)] = item;
+	ATOMIC_STORE(&deque->bottom, b + 1);
+
+	return 0;
+}
+
+/**
+ * @brief	Take the newest item from the bottom. Only the owner may call it.
+ * @return	The item, or NULL if the deque is empty
+ */
+void *ws_deque_take(ws_deque_t *deque)
+{
+	long b = ATOMIC_LOAD(&deque->bottom) - 1;
+	ws_array_t *array = deque->array;
+	void *item = NULL;
+	long t;
+
+	ATOMIC_STORE(&deque->bottom, b);
+	t = ATOMIC_LOAD(&deque->top);
+	if (t <= b) {
+		item = array->items[b & (array->size - 1)];
+		if (t == b) {
+			/* the last item, race the thieves for it */
+			if (!ATOMIC_CAS(&deque->top, t, t + 1))
+				item = NULL;
+			ATOMIC_STORE(&deque->bottom, b + 1);
+		}
+	}
+	else {
+		ATOMIC_STORE(&deque->bottom, b + 1);
+	}
+
+	return item;
+}
+
+/**
+ * @brief	Steal the oldest item from the top. Any thread may call it.
+ * @param [out]	item		The item stolen
+ * @return	1 if an item is stolen, 0 if the deque is empty,
+ *			-1 if another thread took the item first
+ */
+int ws_deque_steal(ws_deque_t *deque, void **item)
+{
+	long t = ATOMIC_LOAD(&deque->top);
+	long b = ATOMIC_LOAD(&deque->bottom);
+	ws_array_t *array;
+
+	if (t >= b)
+		return 0;
+
+	array = (ws_array_t *)ATOMIC_LOAD_PTR(&deque->array);
+	*item = array->items[t & (array->size - 1)];
+	if (!ATOMIC_CAS(&deque->top, t, t + 1))
+		return -1;
+
+	return 1;
+}
+
+/**
+ * @brief	Get the number of items. Only a hint while other threads use the deque.
+ */
+long ws_deque_size(ws_deque_t *deque)
+{
+	long b = ATOMIC_LOAD(&deque->bottom);
+	long t = ATOMIC_LOAD(&deque->top);
+
+	return (b > t) ? b - t : 0;
+}
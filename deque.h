@@ -0,0 +1,54 @@
+/**
+ * @file		deque.h
+ * @version		0.6
+ * @brief		header for deque.c
+ * @date		Feb 25, 2020
+ * @author		Siwon Kang (kkangshawn@gmail.com)
+ */
+
+#ifndef DEQUE_H_
+#define DEQUE_H_
+
+#include "main.h"
+#include "audio.h"
+#include "atomics.h"
+
+/**
+ * @typedef	ws_array_t
+ * @brief	circular array of a work-stealing deque.
+ *		An array outgrown by the owner is kept until the deque is destroyed,
+ *		since a thief may still be reading it.
+ * @param	size				The number of items. The number is a power of two.
+ * @param	prev				Array replaced by this one
+ * @param	items				Storage
+ */
+typedef struct ws_array {
+	long size;
+	struct ws_array *prev;
+	void * volatile items[1];
+} ws_array_t;
+
+/**
+ * @typedef	ws_deque_t
+ * @brief	Chase-Lev work-stealing deque. The owner pushes and takes at the bottom
+ *		without a lock, other threads steal from the top with one CAS.
+ * @param	top					Index of the oldest item, advanced by steals and the last take
+ * @param	bottom				Index past the newest item, moved by the owner only
+ * @param	array				Current storage
+ * @see		ws_deque_init()
+ */
+typedef struct ws_deque {
+	CACHE_ALIGNED volatile long top;
+	CACHE_ALIGNED volatile long bottom;
+	ws_array_t * volatile array;
+} ws_deque_t;
+
+int   ws_deque_init(ws_deque_t *deque, long capacity);
+void  ws_deque_destroy(ws_deque_t *deque);
+int   ws_deque_reserve(ws_deque_t *deque, long n);
+int   ws_deque_push(ws_deque_t *deque, void *item);
+void *ws_deque_take(ws_deque_t *deque);
+int   ws_deque_steal(ws_deque_t *deque, void **item);
+long  ws_deque_size(ws_deque_t *deque);
+
+#endif /* DEQUE_H_ */
@@ -0,0 +1,248 @@
+/**
+ * @file		joblist.c
+ * @version		0.6
+ * @brief		growable job list backed by an append-only path arena
+ * @date		Feb 25, 2020
+ * @author		Siwon Kang (kkangshawn@gmail.com)
+ */
+
+#include "joblist.h"
+
+#define ARENA_ALIGN				(sizeof(void *))
+
+
+/**
+ * @brief	Allocate memory from the arena. The memory stays valid until arena_free().
+ * @return	Pointer aligned to the size of a pointer, or NULL if out of memory
+ */
+void *arena_alloc(path_arena_t *arena, size_t size)
+{
+	arena_block_t *block = arena->head;
+	size_t offset;
+	void *ptr;
+
+	if (block) {
+		offset = (block->used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+		if (offset + size <= block->size) {
+			ptr = block->data + offset;
+			block->used = offset + size;
+			return ptr;
+		}
+	}
+
+	/* current block is full. a path longer than a block gets a block of its own */
+	{
+		size_t block_size = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+
+		block = (arena_block_t *)malloc(sizeof(arena_block_t) + block_size);
+		if (block == NULL) {
+			fprintf(stderr, "ERROR: Cannot allocate memory.\n");
+			return NULL;
+		}
+		block->size = block_size;
+		block->used = size;
+		block->next = arena->head;
+		arena->head = block;
+	}
+
+	return block->data;
+}
+
+/**
+ * @brief	Copy a string into the arena
+ */
+char *arena_strdup(path_arena_t *arena, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *dup = (char *)arena_alloc(arena, len);
+
+	if (dup) {
+		memcpy(dup, str, len);
+	}
+
+	return dup;
+}
+
+/**
+ * @brief	Release every block of the arena
+ */
+void arena_free(path_arena_t *arena)
+{
+	arena_block_t *block = arena->head;
+
+	while (block) {
+		arena_block_t *next = block->next;
+		free(block);
+		block = next;
+	}
+	arena->head = NULL;
+}
+
+/**
+ * @brief	Initialize an empty job list
+ */
+void job_list_init(job_list_t *list)
+{
+	list->jobs = NULL;
+	list->num_jobs = 0;
+	list->capacity = 0;
+	list->arena.head = NULL;
+}
+
+/**
+ * @brief	Append a job to the list. Paths are copied into the arena.
+ * @param [in]	in_path		Input file path
+ * @param [in]	out_path	Output file path, NULL to derive it from in_path when encoding
+ * @return	Pointer of the new job, or NULL if out of memory
+ */
+job_t *job_list_add(job_list_t *list, const char *in_path, const char *out_path)
+{
+	job_t *job;
+
+	if (list->num_jobs == list->capacity) {
+		size_t capacity = list->capacity ? list->capacity * 2 : 256;
+		job_t **jobs = (job_t **)realloc(list->jobs, sizeof(job_t *) * capacity);
+
+		if (jobs == NULL) {
+			fprintf(stderr, "ERROR: Cannot allocate memory.\n");
+			return NULL;
+		}
+		list->jobs = jobs;
+		list->capacity = capacity;
+	}
+
+	job = (job_t *)arena_alloc(&list->arena, sizeof(job_t));
+	if (job == NULL) {
+		return NULL;
+	}
+	job->in_path = arena_strdup(&list->arena, in_path);
+	job->out_path = out_path ? arena_strdup(&list->arena, out_path) : NULL;
+	if (job->in_path == NULL || (out_path && job->out_path == NULL)) {
+		return NULL;
+	}
+	job->idx_file = (int)list->num_jobs;
+	job->size = 0;
+	job->group = NULL;
+	job->release = NULL;
+
+	list->jobs[list->num_jobs++] = job;
+
+	return job;
+}
+
+/**
+ * @brief	Move every job of src to the end of dst. The arena blocks of src are
+ *		handed over as well, so the paths of the jobs stay where they are.
+ *		The jobs keep their numbers, they may already be in the hands of a worker.
+ *		src is left empty.
+ * @return	0 on success, -1 if out of memory. src is unchanged then.
+ */
+int job_list_merge(job_list_t *dst, job_list_t *src)
+{
+	arena_block_t *tail;
+	size_t i;
+
+	if (dst->num_jobs + src->num_jobs > dst->capacity) {
+		size_t capacity = dst->capacity ? dst->capacity : 256;
+		job_t **jobs;
+
+		while (capacity < dst->num_jobs + src->num_jobs)
+			capacity *= 2;
+		jobs = (job_t **)realloc(dst->jobs, sizeof(job_t *) * capacity);
+		if (jobs == NULL) {
+			fprintf(stderr, "ERROR: Cannot allocate memory.\n");
+			return -1;
+		}
+		dst->jobs = jobs;
+		dst->capacity = capacity;
+	}
+	for (i = 0; i < src->num_jobs; i++) {
+		dst->jobs[dst->num_jobs++] = src->jobs[i];
+	}
+
+	/* chain the blocks of src behind the block dst is filling */
+	if (src->arena.head) {
+		for (tail = src->arena.head; tail->next; tail = tail->next)
+			;
+		if (dst->arena.head) {
+			tail->next = dst->arena.head->next;
+			dst->arena.head->next = src->arena.head;
+		}
+		else {
+			dst->arena.head = src->arena.head;
+		}
+	}
+
+	free(src->jobs);
+	job_list_init(src);
+
+	return 0;
+}
+
+/**
+ * @brief	Compare jobs by input size, largest first. Ties keep the order of discovery.
+ */
+static int compare_job_lpt(const void *a, const void *b)
+{
+	const job_t *ja = *(const job_t * const *)a;
+	const job_t *jb = *(const job_t * const *)b;
+
+	if (ja->size != jb->size)
+		return (ja->size < jb->size) ? 1 : -1;
+
+	return ja->idx_file - jb->idx_file;
+}
+
+/**
+ * @brief	Compare jobs by input size, smallest first. Ties keep the order of discovery.
+ */
+static int compare_job_spt(const void *a, const void *b)
+{
+	const job_t *ja = *(const job_t * const *)a;
+	const job_t *jb = *(const job_t * const *)b;
+
+	if (ja->size != jb->size)
+		return (ja->size > jb->size) ? 1 : -1;
+
+	return ja->idx_file - jb->idx_file;
+}
+
+/**
+ * @brief	Sort the jobs by the size of their input files.
+ *		The size of a WAV file is proportional to its encoding time, so taking the
+ *		largest first keeps a big file from starting last and delaying the whole batch.
+ *		Jobs are renumbered in the new order.
+ * @param [in]	order		ORDER_LPT for largest first, ORDER_SPT for smallest first,
+ *							ORDER_NONE to keep the order of discovery
+ */
+void job_list_sort(job_list_t *list, int order)
+{
+	struct stat st;
+	size_t i;
+
+	if (order == ORDER_NONE || list->num_jobs < 2)
+		return;
+
+	for (i = 0; i < list->num_jobs; i++) {
+		job_t *job = list->jobs[i];
+
+		job->size = (stat(job->in_path, &st) == 0) ? (unsigned long long)st.st_size : 0;
+	}
+
+	qsort(list->jobs, list->num_jobs, sizeof(job_t *),
+		  (order == ORDER_SPT) ? compare_job_spt : compare_job_lpt);
+
+	for (i = 0; i < list->num_jobs; i++) {
+		list->jobs[i]->idx_file = (int)i;
+	}
+}
+
+/**
+ * @brief	Release the job list and every path in it
+ */
+void job_list_free(job_list_t *list)
+{
+	free(list->jobs);
+	arena_free(&list->arena);
+	job_list_init(list);
+}
@@ -0,0 +1,67 @@
+/**
+ * @file		joblist.h
+ * @version		0.6
+ * @brief		header for joblist.c
+ * @date		Feb 25, 2020
+ * @author		Siwon Kang (kkangshawn@gmail.com)
+ */
+
+#ifndef JOBLIST_H_
+#define JOBLIST_H_
+
+#include "main.h"
+
+#define ARENA_BLOCK_SIZE		(64 * 1024)
+
+/**
+ * @typedef	arena_block_t
+ * @brief	a block of the path arena. Blocks are chained and never moved.
+ * @param	next				Previously filled block
+ * @param	size				Capacity of data
+ * @param	used				Bytes used in data
+ * @param	data				Storage
+ */
+typedef struct arena_block {
+	struct arena_block *next;
+	size_t size;
+	size_t used;
+	char data[1];
+} arena_block_t;
+
+/**
+ * @typedef	path_arena_t
+ * @brief	append-only allocator for path strings and jobs.
+ *		Everything is released at once by arena_free().
+ * @param	head				Block currently being filled
+ */
+typedef struct path_arena {
+	arena_block_t *head;
+} path_arena_t;
+
+/**
+ * @typedef	job_list_t
+ * @brief	growable list of jobs whose paths live in one arena
+ * @param	jobs				Array of job pointers
+ * @param	num_jobs			The number of jobs in the list
+ * @param	capacity			The number of job pointers allocated
+ * @param	arena				Storage for the jobs and their path strings
+ * @see		get_filelist()
+ */
+typedef struct job_list {
+	job_t **jobs;
+	size_t num_jobs;
+	size_t capacity;
+	path_arena_t arena;
+} job_list_t;
+
+void *arena_alloc(path_arena_t *arena, size_t size);
+char *arena_strdup(path_arena_t *arena, const char *str);
+void  arena_free(path_arena_t *arena);
+
+void  job_list_init(job_list_t *list);
+job_t *job_list_add(job_list_t *list, const char *in_path, const char *out_path);
+int   job_list_merge(job_list_t *dst, job_list_t *src);
+void  job_list_sort(job_list_t *list, int order);
+void  job_list_free(job_list_t *list);
+
+#endif /* JOBLIST_H_ */
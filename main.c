@@ -7,6 +7,12 @@
  */
 
 #include "main.h"
+#include "joblist.h"
+#include "worker.h"
+#include "walker.h"
+#include "watch.h"
+#include "output.h"
+#include "unpack.h"
 
 
 /**
@@ -27,13 +33,97 @@ int isWAV(const char *filename)
 }
 
 /**
- * @brief	Set output file list with given '.wav' filename then change its extension to 'mp3'
- * @param [out]	outlist		An output filename with mp3 extension
+ * @brief	Check whether a relative path has a '..' component, which would lead out
+ *		of the directory it is put under
+ */
+static int has_parent_dir(const char *path)
+{
+	const char *p = path;
+
+	while (*p) {
+		if (p[0] == '.' && p[1] == '.' && (p[2] == '\0' || PATH_SEP(p[2]))) {
+			return 1;
+		}
+		while (*p && !PATH_SEP(*p)) {
+			p++;
+		}
+		while (PATH_SEP(*p)) {
+			p++;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief	Set output file list with given '.wav' filename then change its extension to 'mp3'.
+ *		Input from stdin goes to stdout.
+ *		With '-d' the output goes under the output directory instead, at the
+ *		same path relative to it as the input has relative to the input
+ *		directory, or right in it if the input is a file. An input outside of
+ *		the input directory, such as one of a manifest, keeps its whole path
+ *		under the output directory, so inputs of the same name in different
+ *		directories do not overwrite each other.
+ * @param [out]	outlist		An output filename with mp3 extension, left empty if the
+ *							output would be too long or outside the output directory
  * @param [in]	filename	A name of input wav file
+ * @param [in]	param		Option set containing the input directory and '-d'
  */
-void set_outlist(char outlist[PATH_MAX + 1], const char *filename)
+void set_outlist(char outlist[PATH_MAX + 1], const char *filename, const opt_set_t *param)
 {
-	if (isWAV(filename)) {
+	if (IS_STDIO(filename)) {
+		strcpy(outlist, STDIO_PATH);
+	}
+	else if (isWAV(filename) && param->outdir) {
+		const char *rel = NULL;
+		size_t len;
+
+		if (param->srcfile) {
+			len = strlen(param->srcfile);
+			while (len > 0 && PATH_SEP(param->srcfile[len - 1])) {
+				len--;
+			}
+			if (strncmp(filename, param->srcfile, len) == 0 && PATH_SEP(filename[len])) {
+				rel = filename + len;
+			}
+			else if (strcmp(filename, param->srcfile) == 0) {
+				/* the input file itself, by its base name */
+				rel = filename + strlen(filename);
+				while (rel > filename && !PATH_SEP(rel[-1])) {
+					rel--;
+				}
+			}
+		}
+		if (rel == NULL) {
+			rel = filename;
+#if defined (_WIN32)
+			/* the drive */
+			if (rel[0] != '\0' && rel[1] == ':') {
+				rel += 2;
+			}
+#endif
+		}
+		for (;;) {
+			while (PATH_SEP(*rel)) {
+				rel++;
+			}
+			if (rel[0] != '.' || !PATH_SEP(rel[1])) {
+				break;
+			}
+			rel++;
+		}
+
+		len = strlen(param->outdir);
+		if (has_parent_dir(rel)
+			|| snprintf(outlist, PATH_MAX + 1, "%s%s%s", param->outdir,
+						(len > 0 && PATH_SEP(param->outdir[len - 1])) ? "" : "/", rel) > PATH_MAX) {
+			fprintf(stderr, "ERROR: Cannot place the output of %s under %s\n", filename, param->outdir);
+			outlist[0] = '\0';
+			return;
+		}
+		strcpy(outlist + strlen(outlist) - 3, "mp3");
+	}
+	else if (isWAV(filename)) {
 		size_t len = strlen(filename);
 		strcpy(outlist, filename);
 		strcpy(outlist + len - 3, "mp3");
@@ -56,8 +146,20 @@ opt_set_t *init_optset()
 
 	optset->srcfile = NULL;
 	optset->dstfile = NULL;
+	optset->cache_dir = NULL;
+	optset->manifest = NULL;
+	optset->outdir = NULL;
 	optset->recursion = 0;
 	optset->quality = 0;
+	optset->num_workers = 0;
+	optset->order = 0;
+	optset->readahead = 0;
+	optset->scan_threads = 0;
+	optset->sync = 0;
+	optset->split = 0;
+	optset->pipeline = 0;
+	optset->incremental = 0;
+	optset->watch = 0;
 	optset->verbose = 0;
 
 	return optset;
@@ -77,8 +179,29 @@ void deinit_optset(opt_set_t *param)
 			free(param->dstfile);
 			param->dstfile = NULL;
 		}
+		if (param->cache_dir) {
+			free(param->cache_dir);
+			param->cache_dir = NULL;
+		}
+		if (param->manifest) {
+			free(param->manifest);
+			param->manifest = NULL;
+		}
+		if (param->outdir) {
+			free(param->outdir);
+			param->outdir = NULL;
+		}
 		param->recursion = 0;
 		param->quality = 0;
+		param->num_workers = 0;
+		param->order = 0;
+		param->readahead = 0;
+		param->scan_threads = 0;
+		param->sync = 0;
+		param->split = 0;
+		param->pipeline = 0;
+		param->incremental = 0;
+		param->watch = 0;
 		param->verbose = 0;
 
 		free(param);
@@ -86,88 +209,13 @@ void deinit_optset(opt_set_t *param)
 	}
 }
 
+#if defined (_WIN32)
 /**
- * @brief	Get file list from argument.
- *		Set input file list and output file list.
- *		If the argument is directory, search all the files in it.
- *		Ignore files if the filename extension is not 'wav'
- *		A sub-directory can be searched recursively with option '-r'.
- *		Linux uses dirent, Windows uses WIN32_FIND_DATA.
- * @param [out]	inlist		Input filename list
- * @param [out]	outlist		Output filename list
- * @param [out]	num_files	Total number of wav files to be encoded
- * @param [in]	param		Option set containing name of input and output and option parameters
+ * @brief	Search the input for wav files with WIN32_FIND_DATA, see get_filelist()
+ * @param [out]	list		Job list
+ * @param [in]	param		Option set containing the input and '-r'
  */
-#if defined (__linux)
-void get_filelist_linux(char inlist[][PATH_MAX + 1], char outlist[][PATH_MAX + 1], int *num_file, const opt_set_t *param)
-{
-	DIR *dir;
-	struct dirent *dir_entry;
-	int path_len = strlen(param->srcfile);
-	char str[PATH_MAX];
-
-	if ((dir = opendir(param->srcfile)) != NULL) {
-		/* if param->srcfile is directory */
-		while ((dir_entry = readdir(dir)) != NULL) {
-			memset(str, 0x0, PATH_MAX);
-			strcpy(str, param->srcfile);
-			if (param->srcfile[path_len - 1] != '/') {
-				strcat(str, "/");
-            }
-			strcat(str, dir_entry->d_name);
-
-			if (dir_entry->d_type == DIRENT_TYPE_FILE && isWAV(dir_entry->d_name)) {
-				if (strlen(str) > PATH_MAX) {
-					printf("%s is too long. Maximum length is %d\n",
-							str, PATH_MAX);
-
-					continue;
-				}
-				strcpy(inlist[*num_file], str);
-
-				set_outlist(outlist[*num_file], inlist[*num_file]);
-				(*num_file)++;
-			}
-			/* for recursive(-r) option */
-			else if ((dir_entry->d_type == DIRENT_TYPE_DIRECTORY)
-					&& param->recursion) {
-				/* ignore directory name './' and '../' to prevent infinite loop */
-				if (strcmp(dir_entry->d_name, ".") && strcmp(dir_entry->d_name, "..")) {
-					opt_set_t *subdir_param;
-
-                    if (subdir_param == NULL) {
-                        continue;
-                    }
-					subdir_param = init_optset();
-					subdir_param->srcfile = strdup(str);
-					subdir_param->recursion = 1;
-
-					//printf("[DEBUG] Get into %s\n", subdir_param->srcfile);
-					get_filelist_linux(inlist, outlist, num_file, subdir_param);
-
-					deinit_optset(subdir_param);
-				}
-			}
-		}
-
-		closedir(dir);
-	} else {
-		/* if param->srcfile is file */
-		if (path_len > PATH_MAX) {
-			fprintf(stderr, "ERROR: %s is too long. Maximum length is %d\n",
-					param->srcfile, PATH_MAX);
-        } else {
-			strcpy(inlist[*num_file], param->srcfile);
-			if (param->dstfile)
-				strcpy(outlist[*num_file], param->dstfile);
-			else
-				set_outlist(outlist[*num_file], param->srcfile);
-			(*num_file)++;
-		}
-	}
-}
-#elif defined (_WIN32)
-void get_filelist_windows(char inlist[][PATH_MAX + 1], char outlist[][PATH_MAX + 1], int *nFiles, const opt_set_t *param)
+void get_filelist_windows(job_list_t *list, const opt_set_t *param)
 {
 	WIN32_FIND_DATA ffd;
 	HANDLE hFind = INVALID_HANDLE_VALUE;
@@ -203,12 +251,7 @@ void get_filelist_windows(char inlist[][PATH_MAX + 1], char outlist[][PATH_MAX +
 		if (ffd.dwFileAttributes & FILE_ATTRIBUTE_ARCHIVE) {
 			/* if param->szSrcfile is a file */
 
-			strcpy(inlist[*nFiles], param->srcfile);
-			if (param->dstfile)
-				strcpy(outlist[*nFiles], param->dstfile);
-			else
-				set_outlist(outlist[*nFiles], param->srcfile);
-			(*nFiles)++;
+			job_list_add(list, param->srcfile, param->dstfile);
 		}
 		else if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
 			/* if param->szSrcfile is a directory */
@@ -226,9 +269,7 @@ void get_filelist_windows(char inlist[][PATH_MAX + 1], char outlist[][PATH_MAX +
 				strcpy(szTemp, szDir);
 #endif
 				if (isWAV(szTemp)) {
-					strcpy(inlist[*nFiles], szTemp);
-					set_outlist(outlist[*nFiles], szTemp);
-					(*nFiles)++;
+					job_list_add(list, szTemp, NULL);
 				}
 
 				/* for recursive(-r) option */
@@ -242,7 +283,7 @@ void get_filelist_windows(char inlist[][PATH_MAX + 1], char outlist[][PATH_MAX +
 						subdir_param->recursion = 1;
 
 						//printf("[DEBUG] Get into %s\n", subdir_param->szSrcfile);
-						get_filelist_windows(inlist, outlist, nFiles, subdir_param);
+						get_filelist_windows(list, subdir_param);
 
 						deinit_optset(subdir_param);
 					}
@@ -263,77 +304,160 @@ void get_filelist_windows(char inlist[][PATH_MAX + 1], char outlist[][PATH_MAX +
 }
 #endif
 
-void get_filelist(char inlist[][PATH_MAX + 1], char outlist[][PATH_MAX + 1], int *num_file, const opt_set_t *param)
-{
-#if defined (__linux)
-	get_filelist_linux(inlist, outlist, num_file, param);
-#elif defined (_WIN32)
-	get_filelist_windows(inlist, outlist, num_file, param);
-#endif
-}
-
 /**
- * @brief	Initialize each file and lame library.
- *		Set encoding quality level as set in an option parameter.
- * @param [out]	pgf         Pointer to lame global flag
- * @param [in]	param       Option set
- * @param [in]	in_file     Input filename
- * @param [in]	out_file	Output filename
- * @param [in]	idx_file	The ID number of the file to be used for get_audio_global_data
- * @return	Pointer of FILE structure
+ * @brief	Add a job per line of a manifest. A line holds an input path, and
+ *		optionally a tab and the output path. Without one the output is
+ *		derived from the input as usual. Empty lines and lines starting with
+ *		'#' are skipped. The manifest is read line by line, so with found the
+ *		first jobs are encoded while the rest is still being written.
+ * @param [out]	list		Job list
+ * @param [in]	path		Path of the manifest, '-' for stdin
+ * @param [in]	found		Function called for every job added, NULL if none
+ * @param [in]	arg			Argument of found
  */
-static FILE *init_file(lame_t *pgf, const opt_set_t *param, const char *in_file, const char *out_file, const int idx_file)
+static void read_manifest(job_list_t *list, const char *path, walk_found_fn found, void *arg)
 {
-	FILE *outf;
+	char line[2 * (PATH_MAX + 1) + 2];
+	unsigned long num = 0;
+	FILE *fp;
 
-	*pgf = lame_init();
-	if (param->quality == QL_MODE_BEST) {
-		lame_set_preset(*pgf, INSANE);
-		lame_set_quality(*pgf, 0);
+	fp = IS_STDIO(path) ? stdin : fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "ERROR: Cannot open manifest %s\n", path);
+		return;
 	}
-	else if (param->quality == QL_MODE_FAST) {
-		lame_set_force_ms(*pgf, 1);
-		lame_set_mode(*pgf, JOINT_STEREO);
-		lame_set_quality(*pgf, 7);
+
+	while (fgets(line, sizeof(line), fp)) {
+		size_t len = strlen(line);
+		char *out;
+		job_t *job;
+
+		num++;
+		if (len > 0 && line[len - 1] != '\n' && !feof(fp)) {
+			int c;
+
+			fprintf(stderr, "ERROR: Line %lu of the manifest is too long, skipped\n", num);
+			while ((c = fgetc(fp)) != EOF && c != '\n')
+				;
+			continue;
+		}
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+			line[--len] = '\0';
+		}
+		if (len == 0 || line[0] == '#') {
+			continue;
+		}
+
+		out = strchr(line, '\t');
+		if (out) {
+			*out++ = '\0';
+			if (*out == '\0') {
+				out = NULL;
+			}
+		}
+		if (strlen(line) > PATH_MAX || (out && strlen(out) > PATH_MAX)) {
+			fprintf(stderr, "ERROR: Line %lu of the manifest is too long, skipped\n", num);
+			continue;
+		}
+
+		job = job_list_add(list, line, out);
+		if (job == NULL || (found && found(arg, 0, job) < 0)) {
+			break;
+		}
 	}
-	else {
-        lame_set_VBR_q(*pgf, 2);
-        lame_set_VBR(*pgf, vbr_default);;
+	if (ferror(fp)) {
+		fprintf(stderr, "ERROR: Reading manifest %s failed\n", path);
 	}
-
-	if (strcmp(in_file, out_file) == 0) {
-		fprintf(stderr, "ERROR: The input file name is same with output file name. Abort.\n");
-		return NULL;
+	if (fp != stdin) {
+		fclose(fp);
 	}
+}
 
-	if (!isWAV(in_file)) {
-		fprintf(stderr, "ERROR: Input file is not wav file.\n");
-		return NULL;
+/**
+ * @brief	Get file list from argument.
+ *		Add a job per input file to the job list.
+ *		If the argument is directory, search all the files in it.
+ *		Ignore files if the filename extension is not 'wav'
+ *		A sub-directory can be searched recursively with option '-r'.
+ *		Linux uses the directory walker of walker.c, Windows uses WIN32_FIND_DATA.
+ *		With '--manifest' the jobs are read from the manifest instead.
+ * @param [out]	list		Job list. Output filenames are derived when the job is encoded
+ * @param [in]	param		Option set containing name of input and output and option parameters
+ * @param [in]	found		Function called for every job added, NULL if none.
+ *							The Linux walker calls it while the search goes on.
+ * @param [in]	arg			Argument of found
+ */
+void get_filelist(job_list_t *list, const opt_set_t *param, walk_found_fn found, void *arg)
+{
+	if (param->manifest) {
+		read_manifest(list, param->manifest, found, arg);
+		return;
 	}
+	if (IS_STDIO(param->srcfile)) {
+		job_t *job = job_list_add(list, param->srcfile, param->dstfile);
 
-	if (init_infile(*pgf, in_file, idx_file) < 0) {
-		fprintf(stderr, "ERROR: Initializing input file failed.\n");
-		return NULL;
+		if (job && found) {
+			found(arg, 0, job);
+		}
+		return;
 	}
+#if defined (__linux)
+	walk_tree(list, param, found, NULL, arg);
+#elif defined (_WIN32)
+	get_filelist_windows(list, param);
+	if (found) {
+		size_t i;
 
-	if ((outf = init_outfile(out_file)) == NULL) {
-		fprintf(stderr, "ERROR: Initializing output file failed.\n");
-		return NULL;
+		for (i = 0; i < list->num_jobs; i++) {
+			if (found(arg, 0, list->jobs[i]) < 0) {
+				break;
+			}
+		}
 	}
+#endif
+}
 
-	lame_set_write_id3tag_automatic(*pgf, 0);
-	if (lame_init_params(*pgf) < 0) {
-		fprintf(stderr, "ERROR: lame_init_params() error.\n");
-		return NULL;
-	}
+/**
+ * @typedef	discovery_t
+ * @brief	argument of discover()
+ * @param	list				Job list the search adds to
+ * @param	opt					Option set
+ * @param	queue				Queue of the running pool
+ */
+typedef struct discovery {
+	job_list_t *list;
+	const opt_set_t *opt;
+	job_queue_t *queue;
+} discovery_t;
+
+/**
+ * @brief	Hand a job just found to the pool, through the deque of the finding thread
+ */
+static int feed_job(void *arg, int thread, job_t *job)
+{
+	discovery_t *d = (discovery_t *)arg;
 
-	return outf;
+	return job_queue_feed(d->queue, thread, job);
+}
+
+/**
+ * @brief	Search the input while the workers already encode what is found
+ */
+static void discover(job_queue_t *queue, void *arg)
+{
+	discovery_t *d = (discovery_t *)arg;
+
+	d->queue = queue;
+	get_filelist(d->list, d->opt, feed_job, d);
 }
 
 void usage()
 {
+	printf("MP3enc v" VERSION "\n");
 	printf("Usage:\n"
 		"   MP3enc <input_filename [-o <output_filename>] | input_directory> [OPTIONS]\n"
+		"   MP3enc --manifest <file> [OPTIONS]\n"
+		"   '-' as input_filename reads stdin and as output_filename writes stdout\n"
 		"\nOptions:\n"
         "    -h             Show help\n"
         "    -r             Search subdirectories recursively\n"
@@ -341,6 +465,29 @@ void usage()
         "        fast       fast encoding with small file size\n"
         "        standard   standard quality - default\n"
         "        best       best quality\n"
+        "    -j <num>       Set the number of worker threads, default is the number of cores\n"
+        "    --scan-threads <num> Set the number of threads searching directories, default is 1\n"
+        "    --order <policy> Set the order in which files are encoded\n"
+        "        lpt        largest file first, shortest total time - default\n"
+        "        spt        smallest file first, shortest time per file\n"
+        "        none       order of the directory listing, encoding starts while searching\n"
+        "    --readahead <MB> Set the input read-ahead block size, default is 1\n"
+        "    --sync <policy> Set when the output files are flushed to the disk\n"
+        "        none       leave it to the system - default\n"
+        "        file       fsync every file when it is written\n"
+        "        batch      sync each output file system once after all files\n"
+        "    --split        Split long files into segments encoded in parallel\n"
+        "    --pipeline     Read, encode and write each file in separate threads\n"
+        "    -d <dir>       Write the outputs under dir, mirroring the input tree\n"
+        "    --manifest <file> Encode the files listed in file, '-' for stdin. A line holds\n"
+        "                   an input path and optionally a tab and the output path\n"
+        "    --cache <dir>  Keep encoded files in dir by their samples and settings,\n"
+        "                   and copy them instead of encoding the same samples again\n"
+        "    --watch        Keep running and encode every wav file written into\n"
+        "                   input_directory until interrupted, Linux only\n"
+        "    -u             Skip files whose output is newer than the input and\n"
+        "                   was encoded with the same settings. The settings are\n"
+        "                   kept in an extended attribute, Linux only\n"
         "    -v             Show verbose encoding details\n"
 
 		"\nExample:\n"
@@ -352,6 +499,7 @@ void usage()
 		"\\"
 #endif
 		" -r -q fast -v\n"
+		"   capture | MP3enc - | upload\n"
 		);
 	exit(0);
 }
@@ -394,9 +542,89 @@ void parseopt(int argc, char *argv[], opt_set_t *param)
 					exit(0);
 				}
 			}
+			else if (!strcmp(argv[i], "--manifest")) {
+				if (!param->manifest) {
+					i++;
+					if (i < argc) {
+						param->manifest = strdup(argv[i]);
+					}
+					else {
+						fprintf(stderr, "ERROR: '--manifest' option requires a file."
+								" See below usage:\n");
+						deinit_optset(param);
+						usage();
+					}
+				}
+				else {
+					fprintf(stderr, "ERROR: Duplicated parameter '--manifest'\n");
+					deinit_optset(param);
+					exit(0);
+				}
+			}
+			else if (!strcmp(argv[i], "--cache")) {
+				if (!param->cache_dir) {
+					i++;
+					if (i < argc) {
+						param->cache_dir = strdup(argv[i]);
+					}
+					else {
+						fprintf(stderr, "ERROR: '--cache' option requires a directory."
+								" See below usage:\n");
+						deinit_optset(param);
+						usage();
+					}
+				}
+				else {
+					fprintf(stderr, "ERROR: Duplicated parameter '--cache'\n");
+					deinit_optset(param);
+					exit(0);
+				}
+			}
+			else if (!strcmp(argv[i], "-d")) {
+				if (!param->outdir) {
+					i++;
+					if (i < argc) {
+						param->outdir = strdup(argv[i]);
+					}
+					else {
+						fprintf(stderr, "ERROR: Output directory is missing."
+								" See below usage:\n");
+						deinit_optset(param);
+						usage();
+					}
+				}
+				else {
+					fprintf(stderr, "ERROR: Duplicated parameter '-d'\n");
+					deinit_optset(param);
+					exit(0);
+				}
+			}
 			else if (!strcmp(argv[i], "-r")) {
 				param->recursion = 1;
 			}
+			else if (!strcmp(argv[i], "-j")) {
+				if (!param->num_workers) {
+					char *end = NULL;
+					long num = 0;
+
+					i++;
+					if (i < argc) {
+						num = strtol(argv[i], &end, 10);
+					}
+					if (end == NULL || *end != '\0' || num < 1 || num > INT_MAX) {
+						fprintf(stderr, "ERROR: '-j' option requires a positive number."
+								" See below usage:\n");
+						deinit_optset(param);
+						usage();
+					}
+					param->num_workers = (int)num;
+				}
+				else {
+					fprintf(stderr, "ERROR: Duplicated parameter '-j'\n");
+					deinit_optset(param);
+					exit(0);
+				}
+			}
 			else if (!strcmp(argv[i], "-q")) {
 				if (!(param->quality & QL_SET)) {
 					i++;
@@ -430,6 +658,114 @@ void parseopt(int argc, char *argv[], opt_set_t *param)
 					exit(0);
 				}
 			}
+			else if (!strcmp(argv[i], "--order")) {
+				if (!(param->order & ORDER_SET)) {
+					i++;
+					if (i < argc && !strcmp(argv[i], "lpt")) {
+						param->order = ORDER_LPT;
+					}
+					else if (i < argc && !strcmp(argv[i], "spt")) {
+						param->order = ORDER_SPT;
+					}
+					else if (i < argc && !strcmp(argv[i], "none")) {
+						param->order = ORDER_NONE;
+					}
+					else {
+						fprintf(stderr, "ERROR: '--order' option requires lpt, spt or none."
+								" See below usage:\n");
+						deinit_optset(param);
+						usage();
+					}
+				}
+				else {
+					fprintf(stderr, "ERROR: Duplicated parameter '--order'\n");
+					deinit_optset(param);
+					exit(0);
+				}
+			}
+			else if (!strcmp(argv[i], "--scan-threads")) {
+				if (!param->scan_threads) {
+					char *end = NULL;
+					long num = 0;
+
+					i++;
+					if (i < argc) {
+						num = strtol(argv[i], &end, 10);
+					}
+					if (end == NULL || *end != '\0' || num < 1 || num > WALK_MAX_THREADS) {
+						fprintf(stderr, "ERROR: '--scan-threads' option requires a number"
+								" from 1 to %d. See below usage:\n", WALK_MAX_THREADS);
+						deinit_optset(param);
+						usage();
+					}
+					param->scan_threads = (int)num;
+				}
+				else {
+					fprintf(stderr, "ERROR: Duplicated parameter '--scan-threads'\n");
+					deinit_optset(param);
+					exit(0);
+				}
+			}
+			else if (!strcmp(argv[i], "--readahead")) {
+				if (!param->readahead) {
+					char *end = NULL;
+					long num = 0;
+
+					i++;
+					if (i < argc) {
+						num = strtol(argv[i], &end, 10);
+					}
+					if (end == NULL || *end != '\0' || num < 1 || num > 1024) {
+						fprintf(stderr, "ERROR: '--readahead' option requires a size"
+								" from 1 to 1024 MB. See below usage:\n");
+						deinit_optset(param);
+						usage();
+					}
+					param->readahead = (int)num;
+				}
+				else {
+					fprintf(stderr, "ERROR: Duplicated parameter '--readahead'\n");
+					deinit_optset(param);
+					exit(0);
+				}
+			}
+			else if (!strcmp(argv[i], "--sync")) {
+				if (!(param->sync & SYNC_SET)) {
+					i++;
+					if (i < argc && !strcmp(argv[i], "none")) {
+						param->sync = SYNC_NONE;
+					}
+					else if (i < argc && !strcmp(argv[i], "file")) {
+						param->sync = SYNC_FILE;
+					}
+					else if (i < argc && !strcmp(argv[i], "batch")) {
+						param->sync = SYNC_BATCH;
+					}
+					else {
+						fprintf(stderr, "ERROR: '--sync' option requires none, file or batch."
+								" See below usage:\n");
+						deinit_optset(param);
+						usage();
+					}
+				}
+				else {
+					fprintf(stderr, "ERROR: Duplicated parameter '--sync'\n");
+					deinit_optset(param);
+					exit(0);
+				}
+			}
+			else if (!strcmp(argv[i], "--split")) {
+				param->split = 1;
+			}
+			else if (!strcmp(argv[i], "--pipeline")) {
+				param->pipeline = 1;
+			}
+			else if (!strcmp(argv[i], "--watch")) {
+				param->watch = 1;
+			}
+			else if (!strcmp(argv[i], "-u")) {
+				param->incremental = 1;
+			}
 			else if (!strcmp(argv[i], "-v")) {
 				param->verbose = 1;
 			}
@@ -446,7 +782,13 @@ void parseopt(int argc, char *argv[], opt_set_t *param)
 			}
 		}
 
-		if (!param->srcfile) {
+		if (param->manifest && (param->srcfile || param->dstfile || param->watch)) {
+			fprintf(stderr, "ERROR: '--manifest' gives the files itself, it cannot be used with"
+					" an input, '-o' or '--watch'. See below usage:\n");
+			deinit_optset(param);
+			usage();
+		}
+		if (!param->srcfile && !param->manifest) {
 			fprintf(stderr, "ERROR: Input file or directory is missing."
 					" See below usage:\n");
 			deinit_optset(param);
@@ -457,70 +799,92 @@ void parseopt(int argc, char *argv[], opt_set_t *param)
 
 int main(int argc, char *argv[])
 {
-	char in_list[NAME_MAX][PATH_MAX + 1];
-	char out_list[NAME_MAX][PATH_MAX + 1];
 	opt_set_t *opt_param = NULL;
-	FILE *outf[NAME_MAX];
-	lame_t gf[NAME_MAX];
-	int num_file = 0;
+	job_list_t job_list;
+	double start;
 	int ret = 0;
-	int i, j;
 
-	printf("MP3enc v" VERSION "\n");
 	opt_param = init_optset();
     if (opt_param == NULL) {
         return -1;
     }
 	parseopt(argc, argv, opt_param);
 
-	get_filelist(in_list, out_list, &num_file, opt_param);
-	if (num_file < 1) {
-		fprintf(stderr, "No files to encoding.\n");
-		return -1;
+	/* the encoded stream owns stdout, messages go to stderr */
+	if (opt_param->dstfile ? IS_STDIO(opt_param->dstfile)
+		: (opt_param->srcfile && IS_STDIO(opt_param->srcfile))) {
+		if (out_claim_stdout() < 0) {
+			fprintf(stderr, "ERROR: Cannot write to stdout.\n");
+			deinit_optset(opt_param);
+			return -1;
+		}
 	}
-	else if (num_file > NAME_MAX) {
-		fprintf(stderr, "ERROR: Input files are too many.\n"
-				"The number of maximum input files is %d", NAME_MAX);
-		return -1;
+	printf("MP3enc v" VERSION "\n");
+	if (opt_param->verbose) {
+		printf("Sample unpacking: %s\n", unpack_isa());
 	}
 
-	for (i = 0; i < num_file; i++) {
-		if ((outf[i] = init_file(&gf[i], opt_param, in_list[i], out_list[i], i)) == NULL) {
-			fprintf(stderr, "ERROR: init_file() failed, (%s)\n", in_list[i]);
-			return -1;
+	job_list_init(&job_list);
+	start = get_time();
+	if (opt_param->watch) {
+		if (watch_tree(&job_list, opt_param) != 0) {
+			ret = -1;
+		}
+		if (opt_param->verbose) {
+			printf("Encoded %lu files in %.3f sec\n",
+					(unsigned long)job_list.num_jobs, get_time() - start);
 		}
+		job_list_free(&job_list);
+		deinit_optset(opt_param);
+
+		return ret;
 	}
-	printf("init_file succeeded\n");
+	if (opt_param->order == ORDER_NONE) {
+		/* no order to keep, so the workers need not wait for the whole list */
+		discovery_t d;
+
+		d.list = &job_list;
+		d.opt = opt_param;
+		d.queue = NULL;
+		if (run_worker_pool_fed(discover, &d,
+				opt_param->scan_threads > 0 ? opt_param->scan_threads : 1, opt_param) != 0) {
+			ret = -1;
+		}
+		if (job_list.num_jobs < 1) {
+			fprintf(stderr, "No files to encoding.\n");
+			ret = -1;
+		}
+		else if (opt_param->verbose) {
+			printf("Encoded %lu files in %.3f sec\n",
+					(unsigned long)job_list.num_jobs, get_time() - start);
+		}
+		job_list_free(&job_list);
+		deinit_optset(opt_param);
 
-	pthread_t *tid = malloc(sizeof(pthread_t) * num_file);
-	th_param_t *params = malloc(sizeof(th_param_t) * num_file);
-	if (num_file > 1) {
-		printf("%d threads created\n", num_file);
-    }
-	for (i = 0; i < num_file; i++) {
-		(params + i)->gf = gf[i];
-		(params + i)->outf = outf[i];
-		(params + i)->in_path = in_list[i];
-		(params + i)->out_path = out_list[i];
-		(params + i)->idx_file = i;
-		(params + i)->verbose = opt_param->verbose;
-
-		pthread_create(&tid[i], NULL, lame_encoder_loop, (void *)(params + i));
-		lame_init_bitstream(gf[i]);
+		return ret;
 	}
 
-	for	(j = 0; j < num_file; j++) {
-		pthread_join(tid[j], (void *)&ret);
-		if (ret)
-			fprintf(stderr, "ERROR: Encoding #%d is failed\n", j + 1);
+	get_filelist(&job_list, opt_param, NULL, NULL);
+	if (job_list.num_jobs < 1) {
+		fprintf(stderr, "No files to encoding.\n");
+		job_list_free(&job_list);
+		deinit_optset(opt_param);
+		return -1;
 	}
 
-	for	(i = 0; i < num_file; i++) {
-		fclose(outf[i]);
-		close_infile(i);
-		lame_close(gf[i]);
+	job_list_sort(&job_list, opt_param->order ? opt_param->order : ORDER_LPT);
+
+	start = get_time();
+	if (run_worker_pool(job_list.jobs, job_list.num_jobs, opt_param) != 0) {
+		ret = -1;
 	}
+	if (opt_param->verbose) {
+		printf("Encoded %lu files in %.3f sec\n",
+				(unsigned long)job_list.num_jobs, get_time() - start);
+	}
+
+	job_list_free(&job_list);
 	deinit_optset(opt_param);
 
-	return 0;
+	return ret;
 }
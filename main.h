@@ -15,6 +15,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <limits.h>
+#include <time.h>
 #include <assert.h>
 
 #if !defined (_WIN32)
@@ -32,6 +33,35 @@
 
 #include <pthread.h>
 #include "lame.h"
+
+/**
+ * @typedef	enc_ctx_t
+ * @brief	per-job encoder context, opaque outside audio.c
+ * @see		enc_ctx_new()
+ */
+typedef struct enc_ctx enc_ctx_t;
+
+/**
+ * @typedef	out_file_t
+ * @brief	buffered output file
+ * @see		out_open()
+ */
+typedef struct out_file out_file_t;
+
+/**
+ * @typedef	hash64_t
+ * @brief	state of the hash of the encode cache
+ * @see		hash64_init()
+ */
+typedef struct hash64 hash64_t;
+
+/**
+ * @typedef	pcm_view_t
+ * @brief	samples of an opened input as they are stored in the file
+ * @see		get_pcm_view()
+ */
+typedef struct pcm_view pcm_view_t;
+
 #include "audio.h"
 
 #define VERSION "0.6"
@@ -50,6 +80,16 @@
 #define DIRENT_TYPE_DIRECTORY	4
 #define DIRENT_TYPE_FILE		8
 
+/* '-' in place of a path stands for stdin or stdout */
+#define STDIO_PATH				"-"
+#define IS_STDIO(path)			(strcmp((path), STDIO_PATH) == 0)
+
+#if defined (_WIN32)
+#define PATH_SEP(c)				((c) == '\\' || (c) == '/')
+#else
+#define PATH_SEP(c)				((c) == '/')
+#endif
+
 /**
  * @enum	quality_mode
  * @brief	enum for quality level option set
@@ -57,7 +97,7 @@
  * @param	QL_MODE_FAST		Fast encoding mode
  * @param	QL_MODE_STANDARD	Standard encoding mode, default
  * @param	QL_MODE_BEST		Best encoding mode
- * @see		init_file()
+ * @see		init_job()
  * @see		parseopt()
  */
 enum quality_mode {
@@ -67,22 +107,89 @@ enum quality_mode {
 	QL_MODE_BEST,
 };
 
+/**
+ * @enum	job_order
+ * @brief	enum for the order in which jobs are taken by the workers
+ * @param	ORDER_SET			Setting bit to check duplicated option
+ * @param	ORDER_LPT			Largest input first, shortest batch time - default
+ * @param	ORDER_SPT			Smallest input first, shortest mean time per file
+ * @param	ORDER_NONE			Order of discovery
+ * @see		job_list_sort()
+ * @see		parseopt()
+ */
+enum job_order {
+	ORDER_SET = (1 << 4),
+	ORDER_LPT,
+	ORDER_SPT,
+	ORDER_NONE,
+};
+
+/**
+ * @enum	sync_mode
+ * @brief	enum for the durability policy of the output files
+ * @param	SYNC_SET			Setting bit to check duplicated option
+ * @param	SYNC_NONE			Leave it to the system - default
+ * @param	SYNC_FILE			fsync every file when it is closed
+ * @param	SYNC_BATCH			Sync each output filesystem once at the end of the batch
+ * @see		out_close()
+ * @see		parseopt()
+ */
+enum sync_mode {
+	SYNC_SET = (1 << 4),
+	SYNC_NONE,
+	SYNC_FILE,
+	SYNC_BATCH,
+};
+
+/**
+ * @typedef	job_t
+ * @brief	encoding job description queued for the worker pool
+ * @param	in_path				Input file path
+ * @param	out_path			Output file path, NULL to derive it from in_path
+ * @param	idx_file			File index number
+ * @param	size				Input file size in bytes, filled by job_list_sort()
+ * @param	group				Segment group if the job encodes one segment of a file
+ * @param	release				Function freeing the job once it is done, NULL if a job list owns it
+ * @see		job_list_add()
+ */
+typedef struct job {
+	char *in_path;
+	char *out_path;
+	int idx_file;
+	unsigned long long size;
+	struct seg_group *group;
+	void (*release)(struct job *job);
+} job_t;
+
 /**
  * @typedef	th_param_t
  * @brief	thread parameter structure to be passed as a pthread argument
  * @param	gf					Global flags for lame encoder library
+ * @param	outf				Output file, opened by the worker right before encoding
  * @param	in_path				Input file path
  * @param	out_path			Output file path
- * @param	idx_file			Thread index number
+ * @param	idx_file			File index number
+ * @param	seg_index			Segment index number if the file is split
+ * @param	num_segs			The number of segments of the file, 1 if not split
+ * @param	ctx					Encoder context of the worker running the job
+ * @param	sync				Durability policy of the output file
+ * @param	stamp				Stamp attached to the output, NULL if none
+ * @param	pipeline			Option flag to read, encode and write in separate threads
  * @param	verbose				Verbose option flag to be used in encoding loop
  * @see		lame_encoder_loop()
  */
 typedef struct th_param {
 	lame_global_flags *gf;
-	FILE *outf;
+	out_file_t *outf;
 	char *in_path;
 	char *out_path;
 	int idx_file;
+	int seg_index;
+	int num_segs;
+	enc_ctx_t *ctx;
+	int sync;
+	const char *stamp;
+	char pipeline;
 	char verbose;
 } th_param_t;
 
@@ -91,19 +198,46 @@ typedef struct th_param {
  * @brief	option set structure given from the application arguments
  * @param	srcfile				Name of input file or directory
  * @param	dstfile				Name of output file
+ * @param	cache_dir			Directory of the encode cache, NULL if none
+ * @param	outdir				Directory the output tree is written to, NULL to write next to the inputs
+ * @param	manifest			File listing the input and output pairs, '-' for stdin, NULL if none
  * @param	recursion			Option flag for recursive subdirectory search
  * @param	quality				Quality level
+ * @param	num_workers			The number of worker threads, 0 for the number of cores
+ * @param	order				Job order
+ * @param	readahead			Input read-ahead block in MB, 0 for the default
+ * @param	scan_threads		The number of threads searching directories, 0 for one
+ * @param	sync				Durability policy of the output files
+ * @param	split				Option flag to split long files into segments encoded in parallel
+ * @param	pipeline			Option flag to read, encode and write in separate threads
+ * @param	incremental			Option flag to skip files whose output is up to date
+ * @param	watch				Option flag to keep encoding files written into the input directory
  * @param	verbose				Verbose option flag to be used in encoding loop
- * @see		init_file()
+ * @see		init_job()
  * @see		parseopt()
  * @see		get_filelist()
  */
 typedef struct opt_set {
 	char *srcfile;
 	char *dstfile;
+	char *cache_dir;
+	char *manifest;
+	char *outdir;
 	unsigned int recursion;
 	int quality;
+	int num_workers;
+	int order;
+	int readahead;
+	int scan_threads;
+	int sync;
+	char split;
+	char pipeline;
+	char incremental;
+	char watch;
 	char verbose;
 } opt_set_t;
 
+int isWAV(const char *filename);
+void set_outlist(char outlist[PATH_MAX + 1], const char *filename, const opt_set_t *param);
+
 #endif /* MAIN_H_ */
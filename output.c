@@ -0,0 +1,927 @@
+/**
+ * @file		output.c
+ * @version		0.6
+ * @brief		coalescing output writer with a durability policy
+ * @date		Feb 25, 2020
+ * @author		Siwon Kang (kkangshawn@gmail.com)
+ */
+
+#if defined (__linux) && !defined (_GNU_SOURCE)
+#define _GNU_SOURCE				/* syncfs(), fallocate(), O_TMPFILE */
+#endif
+
+#include "output.h"
+#include "atomics.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#if !defined (_WIN32)
+#include <unistd.h>
+#include <sys/uio.h>
+#else
+#include <io.h>
+#include <process.h>
+#include <direct.h>
+#endif
+#if defined (__linux)
+#include <sys/xattr.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>			/* FICLONE */
+#endif
+#ifndef O_BINARY
+#define O_BINARY				0
+#endif
+
+#if defined (_WIN32)
+#define getpid()				_getpid()
+#define mkdir(path, mode)		_mkdir(path)
+#endif
+
+/* numbers the temporary files of this process */
+static volatile long tmp_serial;
+/* the original stdout, once out_claim_stdout() moved it aside */
+static int stdout_fd = -1;
+/* directories out_make_dirs() made or found, open addressing over a power of two slots */
+static char **dir_cache;
+static size_t dir_cache_size;
+static size_t dir_cache_num;
+static pthread_mutex_t dir_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#if defined (__linux)
+/* one open file per filesystem written under the batch durability policy */
+static int *sync_fds;
+static dev_t *sync_devs;
+static size_t sync_num;
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+/**
+ * @brief	Write the whole buffer at a file offset, retrying short writes.
+ *		A stream is written at its current position, which is the offset.
+ * @return	0 on success, -1 on failure
+ */
+static int write_at(const out_file_t *out, const unsigned char *data, size_t n, long long offset)
+{
+	int fd = out->fd;
+
+	while (n > 0) {
+#if defined (_WIN32)
+		int written;
+
+		if (!out->stream && _lseeki64(fd, offset, SEEK_SET) < 0)
+			return -1;
+		written = _write(fd, data, (unsigned int)n);
+#else
+		ssize_t written = out->stream ? write(fd, data, n) : pwrite(fd, data, n, (off_t)offset);
+#endif
+		if (written < 0) {
+#if !defined (_WIN32)
+			if (errno == EINTR)
+				continue;
+#endif
+			return -1;
+		}
+		data += written;
+		n -= written;
+		offset += written;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief	Allocate an output file with an empty block
+ */
+static out_file_t *out_alloc(size_t size)
+{
+	out_file_t *out = (out_file_t *)calloc(1, sizeof(out_file_t));
+
+	if (out == NULL) {
+		return NULL;
+	}
+#if defined (_WIN32)
+	out->buf = (unsigned char *)_aligned_malloc(size, OUT_BLOCK_ALIGN);
+#else
+	if (posix_memalign((void **)&out->buf, OUT_BLOCK_ALIGN, size) != 0)
+		out->buf = NULL;
+#endif
+	if (out->buf == NULL) {
+		free(out);
+		return NULL;
+	}
+	out->size = size;
+	out->fd = -1;
+
+	return out;
+}
+
+static void out_free(out_file_t *out)
+{
+#if defined (_WIN32)
+	_aligned_free(out->buf);
+#else
+	free(out->buf);
+#endif
+	free(out->path);
+	free(out->tmp_path);
+	free(out);
+}
+
+/**
+ * @brief	Get the length of the directory part of a path, including the separator
+ */
+static size_t dir_len(const char *path)
+{
+	size_t len = strlen(path);
+
+	while (len > 0 && !PATH_SEP(path[len - 1]))
+		len--;
+
+	return len;
+}
+
+/**
+ * @brief	Find the slot of a directory in the cache, or the empty slot it would take.
+ *		Called with the lock held and at least one slot empty.
+ */
+static size_t dir_cache_slot(const char *path, size_t len)
+{
+	size_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)path[i]) * 16777619u;
+	}
+	for (i = h & (dir_cache_size - 1); dir_cache[i]; i = (i + 1) & (dir_cache_size - 1)) {
+		if (strncmp(dir_cache[i], path, len) == 0 && dir_cache[i][len] == '\0') {
+			break;
+		}
+	}
+
+	return i;
+}
+
+/**
+ * @brief	Check if the first len bytes of path name a directory already made
+ */
+static int dir_cache_has(const char *path, size_t len)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&dir_cache_lock);
+	if (dir_cache_size > 0) {
+		found = (dir_cache[dir_cache_slot(path, len)] != NULL);
+	}
+	pthread_mutex_unlock(&dir_cache_lock);
+
+	return found;
+}
+
+/**
+ * @brief	Remember that the first len bytes of path name a directory.
+ *		Nothing is remembered if out of memory, which costs a mkdir() later.
+ */
+static void dir_cache_add(const char *path, size_t len)
+{
+	char *dir = (char *)malloc(len + 1);
+	size_t i;
+
+	if (dir == NULL) {
+		return;
+	}
+	memcpy(dir, path, len);
+	dir[len] = '\0';
+
+	pthread_mutex_lock(&dir_cache_lock);
+	if ((dir_cache_num + 1) * 2 > dir_cache_size) {
+		char **old = dir_cache;
+		size_t old_size = dir_cache_size;
+		size_t size = old_size ? old_size * 2 : OUT_DIR_CACHE_SLOTS;
+		char **slots = (char **)calloc(size, sizeof(char *));
+
+		if (slots == NULL) {
+			pthread_mutex_unlock(&dir_cache_lock);
+			free(dir);
+			return;
+		}
+		dir_cache = slots;
+		dir_cache_size = size;
+		for (i = 0; i < old_size; i++) {
+			if (old[i]) {
+				dir_cache[dir_cache_slot(old[i], strlen(old[i]))] = old[i];
+			}
+		}
+		free(old);
+	}
+	i = dir_cache_slot(dir, len);
+	if (dir_cache[i] == NULL) {
+		dir_cache[i] = dir;
+		dir_cache_num++;
+		dir = NULL;
+	}
+	pthread_mutex_unlock(&dir_cache_lock);
+	/* another worker made it in the meantime */
+	free(dir);
+}
+
+/**
+ * @brief	Make the directory a file is to be written in, with the missing
+ *		directories above it, like mkdir -p. Directories made or found are
+ *		cached, so a tree of outputs costs one mkdir() per directory rather
+ *		than per file. Workers making the same directory at once is fine.
+ * @param [in]	path		Path of the file
+ * @return	0 on success, -1 on failure
+ */
+int out_make_dirs(const char *path)
+{
+	char dir[PATH_MAX + 1];
+	size_t len = dir_len(path);
+
+	while (len > 1 && PATH_SEP(path[len - 1])) {
+		len--;
+	}
+	if (len == 0 || (len == 1 && PATH_SEP(path[0])) || len > PATH_MAX) {
+		return 0;
+	}
+	if (dir_cache_has(path, len)) {
+		return 0;
+	}
+
+	memcpy(dir, path, len);
+	dir[len] = '\0';
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		/* make the parents first, then try again */
+		if (errno != ENOENT || out_make_dirs(dir) < 0
+			|| (mkdir(dir, 0755) != 0 && errno != EEXIST)) {
+			fprintf(stderr, "ERROR: Cannot make directory %s\n", dir);
+			return -1;
+		}
+	}
+	dir_cache_add(dir, len);
+
+	return 0;
+}
+
+#if defined (__linux)
+/**
+ * @brief	Remember the filesystem an output of the batch lives on, keeping
+ *		a duplicate of fd for the first output seen on each of them
+ * @return	0 on success, -1 if it cannot be remembered and needs its own fsync()
+ */
+static int sync_note(int fd)
+{
+	struct stat st;
+	size_t i;
+	int ret = 0;
+
+	if (fstat(fd, &st) != 0) {
+		return -1;
+	}
+	pthread_mutex_lock(&sync_lock);
+	for (i = 0; i < sync_num; i++) {
+		if (sync_devs[i] == st.st_dev) {
+			break;
+		}
+	}
+	if (i == sync_num) {
+		int *fds = (int *)realloc(sync_fds, (sync_num + 1) * sizeof(int));
+		dev_t *devs;
+
+		if (fds) {
+			sync_fds = fds;
+		}
+		devs = fds ? (dev_t *)realloc(sync_devs, (sync_num + 1) * sizeof(dev_t)) : NULL;
+		if (devs) {
+			sync_devs = devs;
+		}
+		if (devs == NULL || (sync_fds[sync_num] = dup(fd)) < 0) {
+			ret = -1;
+		}
+		else {
+			sync_devs[sync_num++] = st.st_dev;
+		}
+	}
+	pthread_mutex_unlock(&sync_lock);
+
+	return ret;
+}
+#endif
+
+/**
+ * @brief	Make a hidden temporary name next to path, such as "dir/.name.mp3.1234-5.tmp"
+ * @return	Allocated name, or NULL if out of memory
+ */
+static char *make_tmp_path(const char *path)
+{
+	size_t dlen = dir_len(path);
+	size_t size = strlen(path) + 48;
+	char *tmp = (char *)malloc(size);
+
+	if (tmp) {
+		snprintf(tmp, size, "%.*s.%s.%ld-%ld.tmp", (int)dlen, path, path + dlen,
+				(long)getpid(), (long)ATOMIC_ADD(&tmp_serial, 1));
+	}
+
+	return tmp;
+}
+
+#if defined (__linux) && defined (O_TMPFILE)
+/**
+ * @brief	Create an unnamed file in the directory of path.
+ *		Nothing is left behind if the process dies before the file is linked.
+ * @return	File descriptor, or -1 if the file system does not support it
+ *			or /proc is not there to link it by
+ */
+static int open_unnamed(const char *path)
+{
+	size_t dlen = dir_len(path);
+	char dir[PATH_MAX + 1];
+	char proc_path[64];
+	int fd;
+
+	if (dlen == 0) {
+		strcpy(dir, ".");
+	}
+	else if (dlen <= PATH_MAX) {
+		memcpy(dir, path, dlen);
+		dir[dlen] = '\0';
+	}
+	else {
+		return -1;
+	}
+
+	fd = open(dir, O_WRONLY | O_TMPFILE, 0666);
+	/* link_unnamed() names the file through /proc, it is too late to fall back by then */
+	if (fd >= 0) {
+		snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+		if (access(proc_path, F_OK) != 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	return fd;
+}
+
+/**
+ * @brief	Give a name to a file created by open_unnamed()
+ * @return	0 on success, -1 on failure
+ */
+static int link_unnamed(out_file_t *out)
+{
+	char proc_path[64];
+	int tries;
+
+	snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", out->fd);
+	for (tries = 0; tries < 8; tries++) {
+		out->tmp_path = make_tmp_path(out->path);
+		if (out->tmp_path == NULL) {
+			return -1;
+		}
+		if (linkat(AT_FDCWD, proc_path, AT_FDCWD, out->tmp_path, AT_SYMLINK_FOLLOW) == 0) {
+			return 0;
+		}
+		free(out->tmp_path);
+		out->tmp_path = NULL;
+		if (errno != EEXIST) {
+			return -1;
+		}
+	}
+
+	return -1;
+}
+#endif
+
+/**
+ * @brief	Keep the original stdout for the encoded stream and point stdout at stderr,
+ *		so that the messages printed while encoding do not end up in the stream.
+ *		Must be called before anything is printed.
+ * @return	0 on success, -1 on failure
+ */
+int out_claim_stdout(void)
+{
+	fflush(stdout);
+#if defined (_WIN32)
+	stdout_fd = _dup(_fileno(stdout));
+	if (stdout_fd < 0 || _dup2(_fileno(stderr), _fileno(stdout)) != 0) {
+		return -1;
+	}
+	_setmode(stdout_fd, _O_BINARY);
+#else
+	stdout_fd = dup(STDOUT_FILENO);
+	if (stdout_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+		return -1;
+	}
+#endif
+
+	return 0;
+}
+
+/**
+ * @brief	Create a file to be written out to path.
+ *		The file has no name or a hidden temporary one until out_close().
+ * @param [in]	sync		SYNC_FILE to fsync the file when it is closed
+ * @return	Pointer of the file, or NULL on failure
+ */
+out_file_t *out_open(const char *path, int sync)
+{
+	out_file_t *out = out_alloc(OUT_BLOCK_SIZE);
+
+	if (out == NULL) {
+		return NULL;
+	}
+	out->path = (char *)malloc(strlen(path) + 1);
+	if (out->path == NULL) {
+		out_free(out);
+		return NULL;
+	}
+	strcpy(out->path, path);
+	out->sync = sync;
+
+	if (IS_STDIO(path)) {
+		/* stdout is written as it is, there is nothing to move into place */
+		out->stream = 1;
+#if defined (_WIN32)
+		out->fd = (stdout_fd >= 0) ? _dup(stdout_fd) : -1;
+#else
+		out->fd = (stdout_fd >= 0) ? dup(stdout_fd) : -1;
+#endif
+		if (out->fd < 0) {
+			out_free(out);
+			return NULL;
+		}
+		return out;
+	}
+
+#if defined (__linux) && defined (O_TMPFILE)
+	out->fd = open_unnamed(path);
+	if (out->fd >= 0) {
+		return out;
+	}
+#endif
+	out->tmp_path = make_tmp_path(path);
+	if (out->tmp_path) {
+		out->fd = open(out->tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0666);
+	}
+	if (out->fd < 0) {
+		out_free(out);
+		return NULL;
+	}
+
+	return out;
+}
+
+/**
+ * @brief	Preallocate the space of a file to be about size bytes,
+ *		so that it is laid out in few extents. The size of the file is unchanged
+ *		and whatever is left over is released by out_close().
+ */
+void out_reserve(out_file_t *out, long long size)
+{
+#if defined (__linux)
+	if (out->fd >= 0 && !out->stream && size > out->reserved
+		&& fallocate(out->fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)size) == 0) {
+		out->reserved = size;
+	}
+#else
+	(void)out;
+	(void)size;
+#endif
+}
+
+/**
+ * @brief	Create an output kept in memory, for the segments of a split file
+ */
+out_file_t *out_open_mem(void)
+{
+	return out_alloc(OUT_BLOCK_SIZE / 16);
+}
+
+/**
+ * @brief	Write out the block
+ * @return	0 on success, -1 on failure
+ */
+int out_flush(out_file_t *out)
+{
+	if (out->fd < 0 || out->len == 0 || out->error) {
+		return out->error ? -1 : 0;
+	}
+	if (write_at(out, out->buf, out->len, out->offset) < 0) {
+		out->error = 1;
+		return -1;
+	}
+	out->offset += out->len;
+	out->len = 0;
+
+	return 0;
+}
+
+/**
+ * @brief	Grow the block of a file kept in memory to hold n more bytes
+ */
+static int out_grow(out_file_t *out, size_t n)
+{
+	size_t size = out->size;
+	unsigned char *buf;
+
+	while (size - out->len < n)
+		size *= 2;
+#if defined (_WIN32)
+	buf = (unsigned char *)_aligned_realloc(out->buf, size, OUT_BLOCK_ALIGN);
+#else
+	buf = (unsigned char *)realloc(out->buf, size);
+#endif
+	if (buf == NULL) {
+		return -1;
+	}
+	out->buf = buf;
+	out->size = size;
+
+	return 0;
+}
+
+/**
+ * @brief	Append data. It is written once the block is full.
+ * @return	0 on success, -1 on failure
+ */
+int out_write(out_file_t *out, const void *data, size_t n)
+{
+	const unsigned char *p = (const unsigned char *)data;
+
+	if (out->error) {
+		return -1;
+	}
+	if (out->size - out->len >= n) {
+		memcpy(out->buf + out->len, p, n);
+		out->len += n;
+		return 0;
+	}
+	if (out->fd < 0) {
+		if (out_grow(out, n) < 0) {
+			out->error = 1;
+			return -1;
+		}
+		memcpy(out->buf + out->len, p, n);
+		out->len += n;
+		return 0;
+	}
+
+#if defined (__linux)
+	if (n >= out->size / 2) {
+		/* large data goes out with the block in one call, without copying it */
+		struct iovec iov[2];
+		ssize_t written;
+
+		iov[0].iov_base = out->buf;
+		iov[0].iov_len = out->len;
+		iov[1].iov_base = (void *)p;
+		iov[1].iov_len = n;
+		do {
+			written = out->stream ? writev(out->fd, iov, 2)
+					: pwritev(out->fd, iov, 2, (off_t)out->offset);
+		} while (written < 0 && errno == EINTR);
+		if (written < 0) {
+			out->error = 1;
+			return -1;
+		}
+		if ((size_t)written < out->len + n) {
+			/* short write, finish it the plain way */
+			size_t done_buf = (size_t)written < out->len ? (size_t)written : out->len;
+			size_t done_data = (size_t)written - done_buf;
+
+			if (write_at(out, out->buf + done_buf, out->len - done_buf,
+						out->offset + done_buf) < 0
+				|| write_at(out, p + done_data, n - done_data,
+						out->offset + out->len + done_data) < 0) {
+				out->error = 1;
+				return -1;
+			}
+		}
+		out->offset += out->len + n;
+		out->len = 0;
+		return 0;
+	}
+#endif
+
+	/* fill the block up, write it and keep the rest */
+	while (n > 0) {
+		size_t room = out->size - out->len;
+		size_t chunk = (n < room) ? n : room;
+
+		memcpy(out->buf + out->len, p, chunk);
+		out->len += chunk;
+		p += chunk;
+		n -= chunk;
+		if (out->len == out->size && out_flush(out) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief	Overwrite data at a file offset already written, like the Xing frame at the head
+ * @return	0 on success, -1 on failure
+ */
+int out_pwrite(out_file_t *out, const void *data, size_t n, long long offset)
+{
+	if (out->error) {
+		return -1;
+	}
+	if (offset >= out->offset && offset + (long long)n <= out->offset + (long long)out->len) {
+		/* still in the block */
+		memcpy(out->buf + (offset - out->offset), data, n);
+		return 0;
+	}
+	if (out->fd < 0 || out->stream || out_flush(out) < 0) {
+		return -1;
+	}
+	if (write_at(out, (const unsigned char *)data, n, offset) < 0) {
+		out->error = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief	Get the size of the file written so far
+ */
+long long out_tell(out_file_t *out)
+{
+	return out->offset + (long long)out->len;
+}
+
+/**
+ * @brief	Move the temporary file over the final path in one step
+ * @return	0 on success, -1 on failure
+ */
+static int publish(out_file_t *out)
+{
+#if defined (_WIN32)
+	return MoveFileExA(out->tmp_path, out->path, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+#else
+	if (rename(out->tmp_path, out->path) != 0) {
+		return -1;
+	}
+	free(out->tmp_path);
+	out->tmp_path = NULL;
+
+	/* the new name is durable only once the directory is */
+	if (out->sync == SYNC_FILE) {
+		size_t dlen = dir_len(out->path);
+		char dir[PATH_MAX + 1];
+		int fd;
+
+		if (dlen == 0) {
+			strcpy(dir, ".");
+		}
+		else if (dlen <= PATH_MAX) {
+			memcpy(dir, out->path, dlen);
+			dir[dlen] = '\0';
+		}
+		else {
+			return 0;
+		}
+		fd = open(dir, O_RDONLY);
+		if (fd >= 0) {
+			fsync(fd);
+			close(fd);
+		}
+	}
+
+	return 0;
+#endif
+}
+
+/**
+ * @brief	Write the rest, apply the durability policy, close the file
+ *		and move it into place. Nothing is left on failure.
+ * @return	0 on success, -1 if anything failed to be written
+ */
+int out_close(out_file_t *out)
+{
+	int ret = 0;
+
+	if (out == NULL) {
+		return 0;
+	}
+	if (out->fd < 0) {
+		out_free(out);
+		return 0;
+	}
+
+	if (out_flush(out) < 0) {
+		ret = -1;
+	}
+	if (out->stream) {
+		if (close(out->fd) != 0) {
+			ret = -1;
+		}
+		out_free(out);
+		return ret;
+	}
+#if defined (_WIN32)
+	if (ret == 0 && (out->sync == SYNC_FILE || out->sync == SYNC_BATCH) && _commit(out->fd) != 0) {
+		ret = -1;
+	}
+#else
+	/* give back the preallocated space beyond the end */
+	if (ret == 0 && out->reserved > out->offset && ftruncate(out->fd, (off_t)out->offset) != 0) {
+		ret = -1;
+	}
+	/* without syncfs(), a batch sync falls back to a sync per file */
+#if defined (__linux)
+	if (ret == 0 && (out->sync == SYNC_FILE || (out->sync == SYNC_BATCH && sync_note(out->fd) < 0))
+		&& fsync(out->fd) != 0) {
+#else
+	if (ret == 0 && (out->sync == SYNC_FILE || out->sync == SYNC_BATCH) && fsync(out->fd) != 0) {
+#endif
+		ret = -1;
+	}
+#endif
+#if defined (__linux) && defined (O_TMPFILE)
+	if (ret == 0 && out->tmp_path == NULL && link_unnamed(out) < 0) {
+		ret = -1;
+	}
+#endif
+	if (close(out->fd) != 0) {
+		ret = -1;
+	}
+	out->fd = -1;
+
+	if (ret == 0 && publish(out) < 0) {
+		ret = -1;
+	}
+	if (ret < 0 && out->tmp_path) {
+		remove(out->tmp_path);
+	}
+	out_free(out);
+
+	return ret;
+}
+
+/**
+ * @brief	Close a file which failed to be encoded, leaving the final path untouched
+ */
+void out_discard(out_file_t *out)
+{
+	if (out == NULL) {
+		return;
+	}
+	if (out->fd >= 0) {
+		close(out->fd);
+		if (out->tmp_path) {
+			remove(out->tmp_path);
+		}
+	}
+	out_free(out);
+}
+
+/**
+ * @brief	Flush every filesystem the outputs of the batch were written on
+ *		to the disk at once, for the batch durability policy
+ * @return	0 on success, -1 on failure
+ */
+int out_sync_batch(void)
+{
+	int ret = 0;
+#if defined (__linux)
+	size_t i;
+
+	pthread_mutex_lock(&sync_lock);
+	for (i = 0; i < sync_num; i++) {
+		if (syncfs(sync_fds[i]) != 0) {
+			ret = -1;
+		}
+		close(sync_fds[i]);
+	}
+	free(sync_fds);
+	free(sync_devs);
+	sync_fds = NULL;
+	sync_devs = NULL;
+	sync_num = 0;
+	pthread_mutex_unlock(&sync_lock);
+#endif
+
+	return ret;
+}
+
+/**
+ * @brief	Attach a small named value to an output before it is closed. It moves
+ *		into place along with the file. Linux keeps it in an extended attribute,
+ *		the other systems do not keep them.
+ * @param [in]	name		Name of the attribute, like OUT_STAMP_ATTR
+ * @param [in]	value		String to be kept
+ * @return	0 on success, -1 if the output cannot hold it
+ */
+int out_set_attr(out_file_t *out, const char *name, const char *value)
+{
+#if defined (__linux)
+	if (out->fd < 0 || out->stream) {
+		return -1;
+	}
+	return (fsetxattr(out->fd, name, value, strlen(value), 0) == 0) ? 0 : -1;
+#else
+	(void)out;
+	(void)name;
+	(void)value;
+	return -1;
+#endif
+}
+
+/**
+ * @brief	Read a value out_set_attr() attached to an existing file
+ * @param [out]	buf			Value, not null-terminated
+ * @param [in]	size		Capacity of buf
+ * @return	Length of the value, 0 if the file has none,
+ *			-1 if the file system does not keep them at all
+ */
+int out_get_attr(const char *path, const char *name, char *buf, size_t size)
+{
+#if defined (__linux)
+	ssize_t len = getxattr(path, name, buf, size);
+
+	if (len < 0) {
+		return (errno == ENOTSUP) ? -1 : 0;
+	}
+	return (int)len;
+#else
+	(void)path;
+	(void)name;
+	(void)buf;
+	(void)size;
+	return -1;
+#endif
+}
+
+/**
+ * @brief	Fill an output nothing is written to yet with the contents of a file.
+ *		The blocks are shared with the file if the file system can clone them,
+ *		else they are copied in the kernel. A stream is written as usual.
+ * @return	0 on success, -1 on failure
+ */
+int out_copy_file(out_file_t *out, const char *src_path)
+{
+	unsigned char buf[64 * 1024];
+	long long done = 0;
+	struct stat st;
+	int src;
+	int ret = 0;
+
+	if (out->fd < 0 || out->len > 0 || out->offset > 0) {
+		return -1;
+	}
+	src = open(src_path, O_RDONLY | O_BINARY);
+	if (src < 0) {
+		return -1;
+	}
+	if (fstat(src, &st) != 0) {
+		close(src);
+		return -1;
+	}
+#if defined (__linux)
+	if (!out->stream) {
+#if defined (FICLONE)
+		if (ioctl(out->fd, FICLONE, src) == 0) {
+			done = st.st_size;
+		}
+#endif
+		while (done < st.st_size) {
+			ssize_t n = copy_file_range(src, NULL, out->fd, NULL, (size_t)(st.st_size - done), 0);
+
+			if (n <= 0) {
+				break;
+			}
+			done += n;
+		}
+		/* whatever is left goes through the buffer below */
+		if (done > 0 && lseek(src, (off_t)done, SEEK_SET) < 0) {
+			close(src);
+			return -1;
+		}
+		out->offset = done;
+	}
+#endif
+	while (ret == 0 && done < st.st_size) {
+#if defined (_WIN32)
+		int n = _read(src, buf, sizeof(buf));
+#else
+		ssize_t n = read(src, buf, sizeof(buf));
+#endif
+
+		if (n <= 0) {
+			ret = -1;
+			break;
+		}
+		ret = out_write(out, buf, (size_t)n);
+		done += n;
+	}
+	close(src);
+	if (ret < 0) {
+		out->error = 1;
+	}
+
+	return ret;
+}
@@ -0,0 +1,75 @@
+/**
+ * @file		output.h
+ * @version		0.6
+ * @brief		header for output.c
+ * @date		Feb 25, 2020
+ * @author		Siwon Kang (kkangshawn@gmail.com)
+ */
+
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+
+#include "main.h"
+
+/* frames are gathered into blocks of this size before they are written */
+#define OUT_BLOCK_SIZE			(1024 * 1024)
+#define OUT_BLOCK_ALIGN			4096
+
+/* initial slots of the cache of directories made by out_make_dirs(), a power of two */
+#define OUT_DIR_CACHE_SLOTS		1024
+
+/* extended attribute holding the stamp of an output */
+#define OUT_STAMP_ATTR			"user.mp3enc.stamp"
+
+/**
+ * @typedef	out_file_t
+ * @brief	buffered output file. Encoded frames are gathered into one aligned
+ *		block which is written with a single positioned write when it is full.
+ *		The file is written under a temporary name in the destination directory
+ *		and appears under its own name only when out_close() succeeds, so an
+ *		interrupted batch never leaves a truncated output behind.
+ *		A file opened by out_open_mem() is never written and grows in memory.
+ * @param	fd					File descriptor, -1 for a file kept in memory
+ * @param	path				Final path of the file
+ * @param	tmp_path			Temporary path of the file, NULL while it has no name (O_TMPFILE)
+ * @param	reserved			Bytes preallocated by out_reserve()
+ * @param	stream				Set for stdout. It is written in order and never seeked.
+ * @param	buf					Block of the bytes not written yet
+ * @param	size				Capacity of buf
+ * @param	len					Bytes used in buf
+ * @param	offset				File offset of buf[0]
+ * @param	sync				Durability policy applied on out_close()
+ * @param	error				Set once a write fails. Later writes are ignored.
+ * @see		out_open()
+ */
+struct out_file {
+	int fd;
+	char *path;
+	char *tmp_path;
+	long long reserved;
+	int stream;
+	unsigned char *buf;
+	size_t size;
+	size_t len;
+	long long offset;
+	int sync;
+	int error;
+};
+
+int   out_claim_stdout(void);
+out_file_t *out_open(const char *path, int sync);
+out_file_t *out_open_mem(void);
+void  out_reserve(out_file_t *out, long long size);
+int   out_write(out_file_t *out, const void *data, size_t n);
+int   out_pwrite(out_file_t *out, const void *data, size_t n, long long offset);
+int   out_flush(out_file_t *out);
+long long out_tell(out_file_t *out);
+int   out_close(out_file_t *out);
+void  out_discard(out_file_t *out);
+int   out_sync_batch(void);
+int   out_make_dirs(const char *path);
+int   out_set_attr(out_file_t *out, const char *name, const char *value);
+int   out_get_attr(const char *path, const char *name, char *buf, size_t size);
+int   out_copy_file(out_file_t *out, const char *src_path);
+
+#endif /* OUTPUT_H_ */
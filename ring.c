@@ -0,0 +1,158 @@
+/**
+ * @file		ring.c
+ * @version		0.6
+ * @brief		single-producer single-consumer ring buffer linking the encoding stages
+ * @date		Feb 25, 2020
+ * @author		Siwon Kang (kkangshawn@gmail.com)
+ */
+
+#include "ring.h"
+
+
+/**
+ * @brief	Initialize a ring
+ * @param [in]	slot_size	Bytes per slot
+ * @param [in]	num_slots	The number of slots, rounded up to a power of two
+ * @return	0 on success, -1 if out of memory
+ */
+int ring_init(spsc_ring_t *ring, size_t slot_size, unsigned int num_slots)
+{
+	unsigned int n = 1;
+
+	while (n < num_slots)
+		n <<= 1;
+
+	ring->slots = (unsigned char *)malloc(slot_size * n);
+	if (ring->slots == NULL) {
+		fprintf(stderr, "ERROR: Cannot allocate memory.\n");
+		return -1;
+	}
+	ring->slot_size = slot_size;
+	ring->mask = n - 1;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->closed = 0;
+	ring->waiters = 0;
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+
+	return 0;
+}
+
+/**
+ * @brief	Release a ring. Neither side may use it any more.
+ */
+void ring_destroy(spsc_ring_t *ring)
+{
+	pthread_cond_destroy(&ring->cond);
+	pthread_mutex_destroy(&ring->lock);
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+/**
+ * @brief	Wake the other side if it is parked.
+ *		The index update is seq_cst, so either the other side sees it before parking
+ *		or this side sees the other one in waiters.
+ */
+static void ring_wake(spsc_ring_t *ring)
+{
+	if (ATOMIC_LOAD(&ring->waiters)) {
+		pthread_mutex_lock(&ring->lock);
+		pthread_cond_broadcast(&ring->cond);
+		pthread_mutex_unlock(&ring->lock);
+	}
+}
+
+/**
+ * @brief	Spin, then park until a slot is free to write or filled to read
+ * @param [in]	write		1 to wait for a free slot, 0 for a filled one
+ * @return	1 if a slot is ready, 0 if the ring is closed first
+ */
+static int ring_wait(spsc_ring_t *ring, int write)
+{
+	int ready;
+	int i;
+
+#define RING_READY() (write ? \
+		((unsigned int)(ATOMIC_LOAD(&ring->head) - ATOMIC_LOAD(&ring->tail)) <= ring->mask) : \
+		(ATOMIC_LOAD(&ring->head) != ATOMIC_LOAD(&ring->tail)))
+
+	for (i = 0; i < RING_SPIN_COUNT; i++) {
+		if (RING_READY())
+			return 1;
+		if (ATOMIC_LOAD(&ring->closed))
+			return write ? 0 : RING_READY();
+		CPU_RELAX();
+	}
+
+	pthread_mutex_lock(&ring->lock);
+	ATOMIC_ADD(&ring->waiters, 1);
+	while (!(ready = RING_READY()) && !ATOMIC_LOAD(&ring->closed)) {
+		pthread_cond_wait(&ring->cond, &ring->lock);
+	}
+	ATOMIC_ADD(&ring->waiters, -1);
+	pthread_mutex_unlock(&ring->lock);
+
+#undef RING_READY
+
+	/* a writer has nothing to do once the reader is gone */
+	if (write && ATOMIC_LOAD(&ring->closed))
+		return 0;
+
+	return ready;
+}
+
+/**
+ * @brief	Get the next slot to be filled by the producer
+ * @return	Pointer of the slot, or NULL if the ring is closed
+ */
+void *ring_write_slot(spsc_ring_t *ring)
+{
+	if (!ring_wait(ring, 1))
+		return NULL;
+
+	return ring->slots + (size_t)(ring->head & ring->mask) * ring->slot_size;
+}
+
+/**
+ * @brief	Hand the slot taken by ring_write_slot() to the consumer
+ */
+void ring_write_commit(spsc_ring_t *ring)
+{
+	ATOMIC_STORE(&ring->head, ring->head + 1);
+	ring_wake(ring);
+}
+
+/**
+ * @brief	Get the oldest slot filled by the producer
+ * @return	Pointer of the slot, or NULL if the ring is closed and drained
+ */
+void *ring_read_slot(spsc_ring_t *ring)
+{
+	if (!ring_wait(ring, 0))
+		return NULL;
+
+	return ring->slots + (size_t)(ring->tail & ring->mask) * ring->slot_size;
+}
+
+/**
+ * @brief	Give the slot taken by ring_read_slot() back to the producer
+ */
+void ring_read_release(spsc_ring_t *ring)
+{
+	ATOMIC_STORE(&ring->tail, ring->tail + 1);
+	ring_wake(ring);
+}
+
+/**
+ * @brief	Close the ring. The producer closes it at the end of the stream
+ *		and the consumer closes it to stop the producer on an error.
+ */
+void ring_close(spsc_ring_t *ring)
+{
+	ATOMIC_STORE(&ring->closed, 1);
+	pthread_mutex_lock(&ring->lock);
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+}
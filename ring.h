@@ -0,0 +1,54 @@
+/**
+ * @file		ring.h
+ * @version		0.6
+ * @brief		header for ring.c
+ * @date		Feb 25, 2020
+ * @author		Siwon Kang (kkangshawn@gmail.com)
+ */
+
+#ifndef RING_H_
+#define RING_H_
+
+#include "main.h"
+#include "audio.h"
+#include "atomics.h"
+
+/* busy-wait iterations before a stage parks on the condition variable */
+#define RING_SPIN_COUNT			1024
+
+/**
+ * @typedef	spsc_ring_t
+ * @brief	lock-free ring of fixed-size slots between one producer and one consumer.
+ *		A stage spins a while on an empty or full ring, then parks on cond.
+ * @param	slots				Storage of num_slots slots of slot_size bytes
+ * @param	slot_size			Bytes per slot
+ * @param	mask				The number of slots minus one. The number is a power of two.
+ * @param	head				Count of slots committed by the producer
+ * @param	tail				Count of slots released by the consumer
+ * @param	closed				Set when either side closes the ring
+ * @param	waiters				The number of stages parked or about to park
+ * @param	lock				Mutex for parking
+ * @param	cond				Signaled when a slot is committed or released, or the ring is closed
+ * @see		ring_init()
+ */
+typedef struct spsc_ring {
+	unsigned char *slots;
+	size_t slot_size;
+	unsigned int mask;
+	CACHE_ALIGNED volatile unsigned int head;
+	CACHE_ALIGNED volatile unsigned int tail;
+	CACHE_ALIGNED volatile int closed;
+	volatile int waiters;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} spsc_ring_t;
+
+int   ring_init(spsc_ring_t *ring, size_t slot_size, unsigned int num_slots);
+void  ring_destroy(spsc_ring_t *ring);
+void *ring_write_slot(spsc_ring_t *ring);
+void  ring_write_commit(spsc_ring_t *ring);
+void *ring_read_slot(spsc_ring_t *ring);
+void  ring_read_release(spsc_ring_t *ring);
+void  ring_close(spsc_ring_t *ring);
+
+#endif /* RING_H_ */
@@ -0,0 +1,252 @@
+/**
+ * @file		order_bench.c
+ * @version		0.6
+ * @brief		makespan of the --order policies on a mixed-size batch
+ * @date		Feb 25, 2020
+ * @author		Siwon Kang (kkangshawn@gmail.com)
+ *
+ * joblist.c is built into the benchmark. A batch of short clips, songs and a
+ * few long recordings is made of sparse files in a temporary directory and
+ * ordered by job_list_sort() for every policy. The jobs are then dealt to the
+ * deques as run_pool() does and taken as job_queue_pop() takes them: the
+ * owner first in list order, a worker out of jobs stealing the last job of
+ * the next worker which has any. Encoding a file takes its size over the
+ * encoding rate plus a fixed cost per file, both measured with MP3enc on one
+ * core, so the times are what a machine with that many cores would see.
+ * The rate in MB/s can be given as the argument.
+ */
+
+#include "../joblist.c"
+#include <fcntl.h>
+#include <unistd.h>
+
+/* MB of 16-bit stereo WAV encoded per second by one core with the default settings */
+#define BENCH_MB_PER_SEC		7.5
+/* seconds spent on every file besides the encoding, opening it and setting up lame */
+#define BENCH_FILE_SEC			0.001
+
+/**
+ * @typedef	corpus_part_t
+ * @brief	files of the batch in a range of sizes
+ */
+typedef struct corpus_part {
+	int num_files;
+	unsigned long min_size;
+	unsigned long max_size;
+} corpus_part_t;
+
+static const corpus_part_t corpus[] = {
+	{ 400, 50000, 300000 },			/* clips, like wav/3.wav */
+	{ 90, 2000000, 8000000 },		/* songs, like wav/2.wav */
+	{ 10, 40000000, 120000000 },	/* live sets and audio books */
+};
+
+static unsigned int next_random(void)
+{
+	static unsigned int seed = 12345;
+
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+/**
+ * @brief	Seconds one core takes to encode a file
+ */
+static double job_cost(const job_t *job, double rate)
+{
+	struct stat st;
+
+	if (stat(job->in_path, &st) != 0) {
+		return BENCH_FILE_SEC;
+	}
+	return BENCH_FILE_SEC + (double)st.st_size / (rate * 1e6);
+}
+
+/**
+ * @brief	Run the jobs of the list on num_workers workers the way the pool takes them
+ * @param [out]	mean_done	Mean time at which a file is done
+ * @return	Time at which the last file is done
+ */
+static double simulate(const job_list_t *list, int num_workers, double rate, double *mean_done)
+{
+	double *free_at = (double *)calloc(num_workers, sizeof(double));
+	/* deque w holds jobs first[w], first[w] + num_workers, ... up to last[w] */
+	long *first = (long *)malloc(sizeof(long) * num_workers);
+	long *last = (long *)malloc(sizeof(long) * num_workers);
+	double makespan = 0, sum_done = 0;
+	long n = (long)list->num_jobs;
+	long taken;
+	int w, v = 0, i;
+
+	if (free_at == NULL || first == NULL || last == NULL) {
+		fprintf(stderr, "ERROR: Cannot allocate memory.\n");
+		exit(1);
+	}
+	for (w = 0; w < num_workers; w++) {
+		first[w] = w;
+		last[w] = (w < n) ? w + (n - 1 - w) / num_workers * num_workers : w - num_workers;
+	}
+
+	for (taken = 0; taken < n; taken++) {
+		long j;
+
+		/* the worker which is free first takes the next job */
+		w = 0;
+		for (i = 1; i < num_workers; i++) {
+			if (free_at[i] < free_at[w]) {
+				w = i;
+			}
+		}
+		if (first[w] <= last[w]) {
+			j = first[w];
+			first[w] += num_workers;
+		}
+		else {
+			for (i = 1; i < num_workers; i++) {
+				v = (w + i) % num_workers;
+				if (first[v] <= last[v]) {
+					break;
+				}
+			}
+			j = last[v];
+			last[v] -= num_workers;
+		}
+		free_at[w] += job_cost(list->jobs[j], rate);
+		sum_done += free_at[w];
+		if (free_at[w] > makespan) {
+			makespan = free_at[w];
+		}
+	}
+
+	free(free_at);
+	free(first);
+	free(last);
+	*mean_done = sum_done / n;
+
+	return makespan;
+}
+
+/**
+ * @brief	Make the files of the batch in dir, in a random order of discovery
+ * @return	The number of files, or -1 on failure
+ */
+static int make_corpus(const char *dir, job_list_t *paths)
+{
+	unsigned long sizes[1024];
+	char path[PATH_MAX + 1];
+	int num = 0;
+	size_t p;
+	int i, fd;
+
+	for (p = 0; p < sizeof(corpus) / sizeof(corpus[0]); p++) {
+		for (i = 0; i < corpus[p].num_files; i++) {
+			sizes[num++] = corpus[p].min_size
+				+ next_random() % (corpus[p].max_size - corpus[p].min_size + 1);
+		}
+	}
+	for (i = num - 1; i > 0; i--) {
+		int k = (int)(next_random() % (unsigned int)(i + 1));
+		unsigned long tmp = sizes[i];
+
+		sizes[i] = sizes[k];
+		sizes[k] = tmp;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (snprintf(path, sizeof(path), "%s/%04d.wav", dir, i) >= (int)sizeof(path)) {
+			fprintf(stderr, "ERROR: %s is too long\n", dir);
+			return -1;
+		}
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		/* sparse, only the size is read */
+		if (fd < 0 || ftruncate(fd, (off_t)sizes[i]) != 0) {
+			perror(path);
+			if (fd >= 0) {
+				close(fd);
+			}
+			return -1;
+		}
+		close(fd);
+		if (job_list_add(paths, path, NULL) == NULL) {
+			return -1;
+		}
+	}
+
+	return num;
+}
+
+int main(int argc, char *argv[])
+{
+	static const int num_workers[] = { 4, 8, 16 };
+	static const int orders[] = { ORDER_NONE, ORDER_SPT, ORDER_LPT };
+	static const char *order_names[] = { "none", "spt", "lpt" };
+	double rate = BENCH_MB_PER_SEC;
+	double total = 0, largest = 0, cost, bound, makespan, mean_done;
+	const char *tmp = getenv("TMPDIR");
+	char dir[PATH_MAX + 1];
+	job_list_t paths, list;
+	int num_files;
+	size_t i;
+	int w, o;
+
+	if (argc > 1) {
+		rate = atof(argv[1]);
+		if (rate <= 0) {
+			fprintf(stderr, "usage: order_bench [MB/s]\n");
+			return 1;
+		}
+	}
+	snprintf(dir, sizeof(dir), "%s/order_bench.XXXXXX", tmp ? tmp : "/tmp");
+	if (mkdtemp(dir) == NULL) {
+		perror(dir);
+		return 1;
+	}
+
+	job_list_init(&paths);
+	num_files = make_corpus(dir, &paths);
+	if (num_files > 0) {
+		for (i = 0; i < paths.num_jobs; i++) {
+			cost = job_cost(paths.jobs[i], rate);
+			total += cost;
+			if (cost > largest) {
+				largest = cost;
+			}
+		}
+		printf("Batch of %d files, %.0f sec of encoding at %.1f MB/s and %.0f ms per file\n",
+			   num_files, total, rate, BENCH_FILE_SEC * 1e3);
+		printf("  %7s %-5s %10s %12s %12s\n", "workers", "order", "makespan", "over bound", "mean done");
+		for (w = 0; w < (int)(sizeof(num_workers) / sizeof(num_workers[0])) && num_files > 0; w++) {
+			/* no order finishes before the work is spread evenly or the largest file is done */
+			bound = total / num_workers[w];
+			if (bound < largest) {
+				bound = largest;
+			}
+			for (o = 0; o < (int)(sizeof(orders) / sizeof(orders[0])); o++) {
+				job_list_init(&list);
+				for (i = 0; i < paths.num_jobs; i++) {
+					if (job_list_add(&list, paths.jobs[i]->in_path, NULL) == NULL) {
+						num_files = -1;
+						break;
+					}
+				}
+				if (num_files < 0) {
+					job_list_free(&list);
+					break;
+				}
+				job_list_sort(&list, orders[o]);
+				makespan = simulate(&list, num_workers[w], rate, &mean_done);
+				printf("  %7d %-5s %8.1f s %10.1f %% %10.1f s\n", num_workers[w], order_names[o],
+					   makespan, 100.0 * (makespan - bound) / bound, mean_done);
+				job_list_free(&list);
+			}
+		}
+	}
+
+	for (i = 0; i < paths.num_jobs; i++) {
+		remove(paths.jobs[i]->in_path);
+	}
+	rmdir(dir);
+	job_list_free(&paths);
+
+	return (num_files > 0) ? 0 : 1;
+}
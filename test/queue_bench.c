@@ -0,0 +1,305 @@
+/**
+ * @file		queue_bench.c
+ * @version		0.6
+ * @brief		benchmark of the job dispatch of the worker pool
+ * @date		Feb 25, 2020
+ * @author		Siwon Kang (kkangshawn@gmail.com)
+ *
+ * worker.c and deque.c are built into the benchmark, so the workers take
+ * their jobs with the job_queue_pop() and job_queue_done() of the encoder.
+ * The jobs stand for near-empty WAVs with nothing to encode: a worker marks
+ * each job done as soon as it has it, so the time per job is the dispatch
+ * alone. The same jobs are also taken from one array under one mutex, the
+ * way the pool dispatched them before the deques, for comparison.
+ * The number of jobs is 100000 unless given as the argument.
+ */
+
+#include "../deque.c"
+#include "../worker.c"
+
+/* jobs per run unless given */
+#define BENCH_JOBS				100000
+/* runs of each case, the fastest is shown */
+#define BENCH_ROUNDS			3
+
+/**
+ * @typedef	lock_queue_t
+ * @brief	one array of jobs under one mutex, as the pool had before the deques
+ */
+typedef struct lock_queue {
+	job_t **jobs;
+	size_t num_jobs;
+	size_t next;
+	int active;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} lock_queue_t;
+
+typedef struct lock_worker {
+	lock_queue_t *queue;
+	unsigned long num_jobs;
+	double dispatch_time;
+} lock_worker_t;
+
+/**
+ * @typedef	bench_result_t
+ * @brief	a run of the benchmark
+ * @param	elapsed				Seconds from the start of the workers until all are joined
+ * @param	dispatch_time		Seconds the workers spent getting jobs, summed
+ * @param	num_stolen			The number of jobs stolen
+ */
+typedef struct bench_result {
+	double elapsed;
+	double dispatch_time;
+	unsigned long num_stolen;
+} bench_result_t;
+
+/* main.c is not built in, and none of the jobs get as far as these */
+int isWAV(const char *filename)
+{
+	(void)filename;
+	return 1;
+}
+
+void set_outlist(char outlist[PATH_MAX + 1], const char *filename, const opt_set_t *param)
+{
+	(void)param;
+	snprintf(outlist, PATH_MAX + 1, "%s", filename);
+}
+
+/**
+ * @brief	Worker taking the jobs of the deques, as worker_main() does
+ */
+static void *deque_worker(void *data)
+{
+	worker_t *worker = (worker_t *)data;
+	job_t *job;
+	double start;
+
+	for (;;) {
+		start = get_time();
+		job = job_queue_pop(worker->queue, worker);
+		worker->dispatch_time += get_time() - start;
+		if (job == NULL) {
+			break;
+		}
+		worker->num_jobs++;
+		job_queue_done(worker->queue, job, 0);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief	Worker taking the jobs of the array under the mutex
+ */
+static void *lock_worker(void *data)
+{
+	lock_worker_t *worker = (lock_worker_t *)data;
+	lock_queue_t *queue = worker->queue;
+	job_t *job;
+	double start;
+
+	for (;;) {
+		start = get_time();
+		job = NULL;
+		pthread_mutex_lock(&queue->lock);
+		for (;;) {
+			if (queue->next < queue->num_jobs) {
+				job = queue->jobs[queue->next++];
+				queue->active++;
+				break;
+			}
+			if (queue->active == 0) {
+				break;
+			}
+			pthread_cond_wait(&queue->cond, &queue->lock);
+		}
+		pthread_mutex_unlock(&queue->lock);
+		worker->dispatch_time += get_time() - start;
+		if (job == NULL) {
+			break;
+		}
+		worker->num_jobs++;
+
+		pthread_mutex_lock(&queue->lock);
+		if (--queue->active == 0 && queue->next == queue->num_jobs) {
+			pthread_cond_broadcast(&queue->cond);
+		}
+		pthread_mutex_unlock(&queue->lock);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief	Run the jobs through the deques, set up as run_pool() does
+ * @return	0 on success, -1 on failure
+ */
+static int bench_deques(job_t **jobs, size_t num_jobs, int num_workers, bench_result_t *res)
+{
+	job_queue_t queue;
+	opt_set_t opt;
+	worker_t *workers;
+	pthread_t *tid;
+	double start;
+	size_t j;
+	int i, created;
+
+	memset(&queue, 0, sizeof(queue));
+	memset(&opt, 0, sizeof(opt));
+	queue.opt = &opt;
+	queue.num_workers = num_workers;
+	queue.num_deques = num_workers;
+	queue.pending = (long)num_jobs;
+	queue.fed = (long)num_jobs;
+	pthread_mutex_init(&queue.lock, NULL);
+	pthread_cond_init(&queue.cond, NULL);
+
+	tid = (pthread_t *)malloc(sizeof(pthread_t) * num_workers);
+	workers = (worker_t *)calloc(num_workers, sizeof(worker_t));
+	queue.deques = (ws_deque_t *)calloc(num_workers, sizeof(ws_deque_t));
+	if (tid == NULL || workers == NULL || queue.deques == NULL) {
+		return -1;
+	}
+	for (i = 0; i < num_workers; i++) {
+		if (ws_deque_init(&queue.deques[i], (long)(num_jobs / num_workers + 1)) < 0) {
+			return -1;
+		}
+		workers[i].queue = &queue;
+		workers[i].id = i;
+	}
+	for (j = num_jobs; j-- > 0;) {
+		ws_deque_push(&queue.deques[j % num_workers], jobs[j]);
+	}
+
+	start = get_time();
+	for (created = 0; created < num_workers; created++) {
+		if (pthread_create(&tid[created], NULL, deque_worker, &workers[created]) != 0) {
+			break;
+		}
+	}
+	for (i = 0; i < created; i++) {
+		pthread_join(tid[i], NULL);
+	}
+	res->elapsed = get_time() - start;
+
+	res->dispatch_time = 0;
+	res->num_stolen = 0;
+	for (i = 0; i < num_workers; i++) {
+		res->dispatch_time += workers[i].dispatch_time;
+		res->num_stolen += workers[i].num_stolen;
+		ws_deque_destroy(&queue.deques[i]);
+	}
+	free(queue.deques);
+	free(workers);
+	free(tid);
+	pthread_cond_destroy(&queue.cond);
+	pthread_mutex_destroy(&queue.lock);
+
+	return (created == num_workers && queue.pending == 0) ? 0 : -1;
+}
+
+/**
+ * @brief	Run the jobs through the array under the mutex
+ * @return	0 on success, -1 on failure
+ */
+static int bench_lock(job_t **jobs, size_t num_jobs, int num_workers, bench_result_t *res)
+{
+	lock_queue_t queue;
+	lock_worker_t *workers;
+	pthread_t *tid;
+	double start;
+	int i, created;
+
+	queue.jobs = jobs;
+	queue.num_jobs = num_jobs;
+	queue.next = 0;
+	queue.active = 0;
+	pthread_mutex_init(&queue.lock, NULL);
+	pthread_cond_init(&queue.cond, NULL);
+
+	tid = (pthread_t *)malloc(sizeof(pthread_t) * num_workers);
+	workers = (lock_worker_t *)calloc(num_workers, sizeof(lock_worker_t));
+	if (tid == NULL || workers == NULL) {
+		return -1;
+	}
+	for (i = 0; i < num_workers; i++) {
+		workers[i].queue = &queue;
+	}
+
+	start = get_time();
+	for (created = 0; created < num_workers; created++) {
+		if (pthread_create(&tid[created], NULL, lock_worker, &workers[created]) != 0) {
+			break;
+		}
+	}
+	for (i = 0; i < created; i++) {
+		pthread_join(tid[i], NULL);
+	}
+	res->elapsed = get_time() - start;
+
+	res->dispatch_time = 0;
+	res->num_stolen = 0;
+	for (i = 0; i < num_workers; i++) {
+		res->dispatch_time += workers[i].dispatch_time;
+	}
+	free(workers);
+	free(tid);
+	pthread_cond_destroy(&queue.cond);
+	pthread_mutex_destroy(&queue.lock);
+
+	return (created == num_workers && queue.next == num_jobs) ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+	static const int num_workers[] = { 1, 8, 64 };
+	int (*const run[2])(job_t **, size_t, int, bench_result_t *) = { bench_lock, bench_deques };
+	static const char *names[2] = { "mutex", "deques" };
+	size_t num_jobs = BENCH_JOBS;
+	bench_result_t res, best;
+	job_t *job_array;
+	job_t **jobs;
+	size_t j;
+	int w, q, r;
+
+	if (argc > 1) {
+		num_jobs = (size_t)strtoul(argv[1], NULL, 10);
+	}
+	job_array = (job_t *)calloc(num_jobs, sizeof(job_t));
+	jobs = (job_t **)malloc(sizeof(job_t *) * num_jobs);
+	if (num_jobs == 0 || job_array == NULL || jobs == NULL) {
+		fprintf(stderr, "ERROR: Cannot allocate memory.\n");
+		return 1;
+	}
+	for (j = 0; j < num_jobs; j++) {
+		job_array[j].idx_file = (int)j;
+		jobs[j] = &job_array[j];
+	}
+
+	printf("Dispatch of %lu empty jobs on %d cores, fastest of %d runs\n",
+		   (unsigned long)num_jobs, get_num_cores(), BENCH_ROUNDS);
+	printf("  %-7s %7s %12s %14s %9s\n", "queue", "workers", "ns per job", "ns in pop/job", "stolen");
+	for (w = 0; w < (int)(sizeof(num_workers) / sizeof(num_workers[0])); w++) {
+		for (q = 0; q < 2; q++) {
+			for (r = 0; r < BENCH_ROUNDS; r++) {
+				if (run[q](jobs, num_jobs, num_workers[w], &res) < 0) {
+					fprintf(stderr, "ERROR: %s with %d workers failed\n", names[q], num_workers[w]);
+					return 1;
+				}
+				if (r == 0 || res.elapsed < best.elapsed) {
+					best = res;
+				}
+			}
+			printf("  %-7s %7d %12.1f %14.1f %9lu\n", names[q], num_workers[w],
+				   1e9 * best.elapsed / num_jobs, 1e9 * best.dispatch_time / num_jobs,
+				   best.num_stolen);
+		}
+	}
+
+	free(jobs);
+	free(job_array);
+
+	return 0;
+}
@@ -0,0 +1,145 @@
+/**
+ * @file		read_bench.c
+ * @version		0.6
+ * @brief		system calls and copies of the mapped and the read() input paths
+ * @date		Feb 25, 2020
+ * @author		Siwon Kang (kkangshawn@gmail.com)
+ *
+ * audio.c is built into the benchmark. A WAV file is opened and all its
+ * samples are taken with get_audio(), as the encoder does, once mapped in
+ * memory and once through the read-ahead block with enc_ctx_set_map(ctx, 0).
+ * The read() calls and the bytes they copy are the counters of /proc/self/io,
+ * and the page faults those of getrusage(). The file is in the page cache
+ * after the first pass, so the time is that of the copies and the faults.
+ * usage: read_bench [wav [passes]]
+ */
+
+#include "../audio.c"
+#include <sys/resource.h>
+
+/* passes over the file per path unless given */
+#define BENCH_PASSES			10
+
+/**
+ * @typedef	io_count_t
+ * @brief	counters of the process
+ * @param	syscr				read() calls, -1 without /proc/self/io
+ * @param	rchar				Bytes read() copied, -1 without /proc/self/io
+ * @param	faults				Page faults, minor and major
+ * @param	time				Seconds of user and system time
+ */
+typedef struct io_count {
+	long long syscr;
+	long long rchar;
+	long long faults;
+	double time;
+} io_count_t;
+
+static void get_counts(io_count_t *count)
+{
+	char line[128];
+	struct rusage ru;
+	FILE *fp;
+
+	count->syscr = -1;
+	count->rchar = -1;
+	fp = fopen("/proc/self/io", "r");
+	if (fp) {
+		while (fgets(line, sizeof(line), fp)) {
+			sscanf(line, "syscr: %lld", &count->syscr);
+			sscanf(line, "rchar: %lld", &count->rchar);
+		}
+		fclose(fp);
+	}
+	getrusage(RUSAGE_SELF, &ru);
+	count->faults = ru.ru_minflt + ru.ru_majflt;
+	count->time = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+		+ ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/**
+ * @brief	Take every sample of the file with get_audio()
+ * @return	The number of samples per channel, or -1 on failure
+ */
+static long read_file(const char *path, enc_ctx_t *ctx, int *mapped)
+{
+	static int buf[2][1152];
+	lame_t gf;
+	long total = 0;
+	int n;
+
+	gf = lame_init();
+	if (gf == NULL) {
+		return -1;
+	}
+	if (init_infile(gf, path, ctx) < 0 || lame_init_params(gf) < 0) {
+		close_infile(ctx);
+		lame_close(gf);
+		return -1;
+	}
+	*mapped = (ctx->audio_data.map != NULL);
+	while ((n = get_audio(gf, buf, ctx)) > 0) {
+		total += n;
+	}
+	close_infile(ctx);
+	lame_close(gf);
+
+	return (n < 0) ? -1 : total;
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *names[2] = { "read()", "mapped" };
+	const char *path = (argc > 1) ? argv[1] : "wav/2.wav";
+	int passes = (argc > 2) ? atoi(argv[2]) : BENCH_PASSES;
+	io_count_t before, after;
+	enc_ctx_t *ctx;
+	struct stat st;
+	long samples = 0;
+	int map, p, mapped;
+
+	if (stat(path, &st) != 0 || passes < 1) {
+		fprintf(stderr, "usage: read_bench [wav [passes]]\n");
+		return 1;
+	}
+	ctx = enc_ctx_new();
+	if (ctx == NULL) {
+		fprintf(stderr, "ERROR: Cannot allocate memory.\n");
+		return 1;
+	}
+
+	printf("Reading %s (%lld bytes), per pass\n", path, (long long)st.st_size);
+	printf("  %-7s %12s %14s %12s %10s\n", "input", "read calls", "bytes copied", "page faults", "ms");
+	for (map = 0; map < 2; map++) {
+		enc_ctx_set_map(ctx, map);
+		/* a first pass to bring the file into the page cache */
+		if (read_file(path, ctx, &mapped) < 0) {
+			fprintf(stderr, "ERROR: Cannot read %s\n", path);
+			enc_ctx_free(ctx);
+			return 1;
+		}
+		if (mapped != map) {
+			printf("  %-7s not taken for this file\n", names[map]);
+			continue;
+		}
+		get_counts(&before);
+		for (p = 0; p < passes; p++) {
+			samples = read_file(path, ctx, &mapped);
+		}
+		get_counts(&after);
+		if (after.syscr < 0) {
+			printf("  %-7s %12s %14s", names[map], "n/a", "n/a");
+		}
+		else {
+			printf("  %-7s %12.0f %14.0f", names[map], (double)(after.syscr - before.syscr) / passes,
+				   (double)(after.rchar - before.rchar) / passes);
+		}
+		printf(" %12.0f %10.2f\n", (double)(after.faults - before.faults) / passes,
+			   1e3 * (after.time - before.time) / passes);
+	}
+	printf("%ld samples per channel per pass\n", samples);
+
+	enc_ctx_free(ctx);
+
+	return 0;
+}
@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# Regression check for --split writing to stdout: the output must be the
+# same stream as encoding the file as a whole, and larger than the 1 MB
+# blocks the output is written in, so the first block is gone before the
+# segments are stitched.
+#
+# usage: split_stream.sh <MP3enc> <wav>
+
+BIN=$1
+WAV=$2
+TMP=${TMPDIR:-/tmp}/mp3enc_test.$$
+COPIES=8
+
+trap 'rm -rf "$TMP"' EXIT
+mkdir -p "$TMP" || exit 1
+
+# le32 <n>: n as 4 little-endian bytes
+le32()
+{
+	printf "$(printf '\\%03o\\%03o\\%03o\\%03o' $(($1 & 255)) $(($1 >> 8 & 255)) \
+		$(($1 >> 16 & 255)) $(($1 >> 24 & 255)))"
+}
+
+# a long file made of the samples of WAV repeated, behind its 44-byte header
+size=$(($(wc -c < "$WAV") - 44))
+{
+	head -c 4 "$WAV"
+	le32 $((36 + size * COPIES))
+	head -c 40 "$WAV" | tail -c 32
+	le32 $((size * COPIES))
+	i=0
+	while [ $i -lt $COPIES ]; do
+		tail -c $size "$WAV"
+		i=$((i + 1))
+	done
+} > "$TMP/long.wav"
+
+"$BIN" "$TMP/long.wav" -o - > "$TMP/whole.mp3" 2> /dev/null || exit 1
+if ! "$BIN" "$TMP/long.wav" -o - --split -j 4 > "$TMP/split.mp3" 2> "$TMP/err"; then
+	cat "$TMP/err"
+	echo "FAIL: --split to stdout"
+	exit 1
+fi
+if [ $(wc -c < "$TMP/split.mp3") -le 1048576 ]; then
+	echo "FAIL: output not over 1 MB, the check needs a longer file"
+	exit 1
+fi
+if ! cmp -s "$TMP/whole.mp3" "$TMP/split.mp3"; then
+	echo "FAIL: --split to stdout differs from the whole file"
+	exit 1
+fi
+echo "split_stream: OK"
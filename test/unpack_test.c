@@ -0,0 +1,352 @@
+/**
+ * @file		unpack_test.c
+ * @version		0.6
+ * @brief		differential test and benchmark of the unpacking kernels
+ * @date		Feb 25, 2020
+ * @author		Siwon Kang (kkangshawn@gmail.com)
+ *
+ * unpack.c is built into the test, so every kernel the CPU runs is reached,
+ * not only the one unpack_select() picks. Each is compared to the scalar
+ * kernel of its format for every length up to a few steps and some odd
+ * tails, at every misalignment of the input. The planar kernels are compared
+ * to the scalar kernel of the interleaved samples, split into the channels
+ * afterwards, so the scalar planar kernels are tested too. The input is allocated to its
+ * exact size and the output is followed by guard ints, so reading or writing
+ * past the end shows under AddressSanitizer or as a broken guard.
+ * With -b the kernels are timed instead.
+ */
+
+#include "../unpack.c"
+#include <time.h>
+
+/* ints after the output which no kernel may touch */
+#define TEST_GUARD				16
+#define TEST_GUARD_VALUE		0x5a5a5a5a
+/* samples unpacked per call of the benchmark, to stay in the L2 cache */
+#define BENCH_SAMPLES			(16 * 1024)
+/* seconds each kernel is timed for */
+#define BENCH_SECONDS			0.2
+
+enum {
+	ISA_SCALAR,
+	ISA_SSE2,
+	ISA_SSSE3,
+	ISA_AVX2,
+	ISA_NEON,
+};
+
+static const char *isa_names[] = { "scalar", "sse2", "ssse3", "avx2", "neon" };
+
+/**
+ * @typedef	kernel_t
+ * @brief	kernel under test
+ * @param	name				Name of the kernel
+ * @param	bytes				Bytes per sample
+ * @param	swap				Byte order, as given to unpack_select()
+ * @param	isa					Instruction set the kernel needs
+ * @param	fn					The kernel, NULL if planar
+ * @param	planar				The planar kernel, NULL if not
+ */
+typedef struct kernel {
+	const char *name;
+	int bytes;
+	int swap;
+	int isa;
+	unpack_fn fn;
+	unpack_planar_fn planar;
+} kernel_t;
+
+#define KERNEL(name, bytes, swap, isa)	{ #name, bytes, swap, isa, name, NULL }
+#define PLANAR(name, bytes, swap, isa)	{ #name, bytes, swap, isa, NULL, name }
+
+static const kernel_t kernels[] = {
+	PLANAR(unpack_s8_planar_scalar, 1, 0, ISA_SCALAR),
+	PLANAR(unpack_u8_planar_scalar, 1, 1, ISA_SCALAR),
+	PLANAR(unpack_le16_planar_scalar, 2, 0, ISA_SCALAR),
+	PLANAR(unpack_be16_planar_scalar, 2, 1, ISA_SCALAR),
+	PLANAR(unpack_le24_planar_scalar, 3, 0, ISA_SCALAR),
+	PLANAR(unpack_be24_planar_scalar, 3, 1, ISA_SCALAR),
+	PLANAR(unpack_le32_planar_scalar, 4, 0, ISA_SCALAR),
+	PLANAR(unpack_be32_planar_scalar, 4, 1, ISA_SCALAR),
+#if defined (UNPACK_X86)
+	KERNEL(unpack_s8_sse2, 1, 0, ISA_SSE2),
+	KERNEL(unpack_u8_sse2, 1, 1, ISA_SSE2),
+	KERNEL(unpack_le16_sse2, 2, 0, ISA_SSE2),
+	KERNEL(unpack_be16_sse2, 2, 1, ISA_SSE2),
+	KERNEL(unpack_le32_copy, 4, 0, ISA_SSE2),
+	KERNEL(unpack_be32_sse2, 4, 1, ISA_SSE2),
+	KERNEL(unpack_le24_ssse3, 3, 0, ISA_SSSE3),
+	KERNEL(unpack_be24_ssse3, 3, 1, ISA_SSSE3),
+	KERNEL(unpack_be32_ssse3, 4, 1, ISA_SSSE3),
+	KERNEL(unpack_s8_avx2, 1, 0, ISA_AVX2),
+	KERNEL(unpack_u8_avx2, 1, 1, ISA_AVX2),
+	KERNEL(unpack_le16_avx2, 2, 0, ISA_AVX2),
+	KERNEL(unpack_be16_avx2, 2, 1, ISA_AVX2),
+	KERNEL(unpack_le24_avx2, 3, 0, ISA_AVX2),
+	KERNEL(unpack_be24_avx2, 3, 1, ISA_AVX2),
+	KERNEL(unpack_be32_avx2, 4, 1, ISA_AVX2),
+	PLANAR(unpack_s8_planar_sse2, 1, 0, ISA_SSE2),
+	PLANAR(unpack_u8_planar_sse2, 1, 1, ISA_SSE2),
+	PLANAR(unpack_le16_planar_sse2, 2, 0, ISA_SSE2),
+	PLANAR(unpack_be16_planar_sse2, 2, 1, ISA_SSE2),
+	PLANAR(unpack_le32_planar_sse2, 4, 0, ISA_SSE2),
+	PLANAR(unpack_be32_planar_sse2, 4, 1, ISA_SSE2),
+	PLANAR(unpack_le24_planar_ssse3, 3, 0, ISA_SSSE3),
+	PLANAR(unpack_be24_planar_ssse3, 3, 1, ISA_SSSE3),
+	PLANAR(unpack_le16_planar_avx2, 2, 0, ISA_AVX2),
+	PLANAR(unpack_be16_planar_avx2, 2, 1, ISA_AVX2),
+#elif defined (UNPACK_NEON)
+	KERNEL(unpack_s8_neon, 1, 0, ISA_NEON),
+	KERNEL(unpack_u8_neon, 1, 1, ISA_NEON),
+	KERNEL(unpack_le16_neon, 2, 0, ISA_NEON),
+	KERNEL(unpack_be16_neon, 2, 1, ISA_NEON),
+	KERNEL(unpack_le24_neon, 3, 0, ISA_NEON),
+	KERNEL(unpack_be24_neon, 3, 1, ISA_NEON),
+	KERNEL(unpack_le32_copy, 4, 0, ISA_NEON),
+	KERNEL(unpack_be32_neon, 4, 1, ISA_NEON),
+	PLANAR(unpack_s8_planar_neon, 1, 0, ISA_NEON),
+	PLANAR(unpack_u8_planar_neon, 1, 1, ISA_NEON),
+	PLANAR(unpack_le16_planar_neon, 2, 0, ISA_NEON),
+	PLANAR(unpack_be16_planar_neon, 2, 1, ISA_NEON),
+	PLANAR(unpack_le24_planar_neon, 3, 0, ISA_NEON),
+	PLANAR(unpack_be24_planar_neon, 3, 1, ISA_NEON),
+	PLANAR(unpack_le32_planar_neon, 4, 0, ISA_NEON),
+	PLANAR(unpack_be32_planar_neon, 4, 1, ISA_NEON),
+#endif
+};
+
+/* the reference of every format, by bytes per sample - 1 and byte order */
+static const kernel_t scalar[4][2] = {
+	{ KERNEL(unpack_s8_scalar, 1, 0, ISA_SCALAR), KERNEL(unpack_u8_scalar, 1, 1, ISA_SCALAR) },
+	{ KERNEL(unpack_le16_scalar, 2, 0, ISA_SCALAR), KERNEL(unpack_be16_scalar, 2, 1, ISA_SCALAR) },
+	{ KERNEL(unpack_le24_scalar, 3, 0, ISA_SCALAR), KERNEL(unpack_be24_scalar, 3, 1, ISA_SCALAR) },
+	{ KERNEL(unpack_le32_scalar, 4, 0, ISA_SCALAR), KERNEL(unpack_be32_scalar, 4, 1, ISA_SCALAR) },
+};
+
+/* lengths tested besides 0 to 64, odd tails around the steps */
+static const size_t tails[] = { 65, 67, 95, 127, 129, 191, 255, 257, 1023, 4099 };
+
+/**
+ * @brief	Tell whether the CPU runs the kernels of an instruction set
+ */
+static int isa_supported(int isa)
+{
+#if defined (UNPACK_X86)
+	int sse2, ssse3, avx2;
+
+	unpack_cpu(&sse2, &ssse3, &avx2);
+	return isa == ISA_SCALAR || (isa == ISA_SSE2 && sse2)
+		|| (isa == ISA_SSSE3 && sse2 && ssse3) || (isa == ISA_AVX2 && sse2 && ssse3 && avx2);
+#elif defined (UNPACK_NEON)
+	return isa == ISA_SCALAR || (isa == ISA_NEON && unpack_has_neon());
+#else
+	return isa == ISA_SCALAR;
+#endif
+}
+
+/**
+ * @brief	Pseudo-random bytes, the same on every run
+ */
+static void fill_random(unsigned char *buf, size_t n)
+{
+	static unsigned int seed = 12345;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = (unsigned char)(seed >> 16);
+	}
+}
+
+/**
+ * @brief	Tell whether the first n ints of got are want, and the guard after them is intact
+ * @return	0 if so, -1 if not
+ */
+static int check_output(const kernel_t *k, const char *what, const int *got, const int *want,
+						size_t stride, size_t n, size_t offset)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (got[i] != want[i * stride]) {
+			printf("FAIL: %s%s, %zu samples at offset %zu: sample %zu is %08x, not %08x\n",
+				   k->name, what, n, offset, i, (unsigned int)got[i], (unsigned int)want[i * stride]);
+			return -1;
+		}
+	}
+	for (i = n; i < n + TEST_GUARD; i++) {
+		if (got[i] != TEST_GUARD_VALUE) {
+			printf("FAIL: %s%s, %zu samples at offset %zu: wrote past the end\n",
+				   k->name, what, n, offset);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief	Compare a kernel with the scalar one for n samples, or n frames
+ *		of two channels if it is planar, with the input starting offset
+ *		bytes into its allocation
+ * @return	0 if they match, -1 if not
+ */
+static int check_kernel(const kernel_t *k, size_t n, size_t offset)
+{
+	size_t channels = k->planar ? 2 : 1;
+	size_t size = n * channels * k->bytes;
+	/* the samples end right at the end of the allocation */
+	unsigned char *in = (unsigned char *)malloc(size + offset + (size + offset == 0));
+	int *want = (int *)malloc((n * channels + 1) * sizeof(int));
+	int *left = (int *)malloc((n + TEST_GUARD) * sizeof(int));
+	int *right = (int *)malloc((n + TEST_GUARD) * sizeof(int));
+	size_t i;
+	int ret;
+
+	if (in == NULL || want == NULL || left == NULL || right == NULL) {
+		fprintf(stderr, "ERROR: Cannot allocate memory.\n");
+		exit(1);
+	}
+	fill_random(in + offset, size);
+	for (i = 0; i < n + TEST_GUARD; i++) {
+		left[i] = TEST_GUARD_VALUE;
+		right[i] = TEST_GUARD_VALUE;
+	}
+	scalar[k->bytes - 1][k->swap].fn(want, in + offset, n * channels);
+	if (k->planar) {
+		k->planar(left, right, in + offset, n);
+		ret = check_output(k, " left", left, want, 2, n, offset);
+		if (ret == 0) {
+			ret = check_output(k, " right", right, want + 1, 2, n, offset);
+		}
+	}
+	else {
+		k->fn(left, in + offset, n);
+		ret = check_output(k, "", left, want, 1, n, offset);
+	}
+	free(in);
+	free(want);
+	free(left);
+	free(right);
+
+	return ret;
+}
+
+/**
+ * @brief	Compare a kernel with the scalar one for every length and misalignment
+ * @return	The number of failed cases
+ */
+static int test_kernel(const kernel_t *k)
+{
+	size_t n, offset, i;
+	int failed = 0;
+
+	for (offset = 0; offset < 4; offset++) {
+		for (n = 0; n <= 64; n++) {
+			failed += check_kernel(k, n, offset) < 0;
+		}
+		for (i = 0; i < sizeof(tails) / sizeof(tails[0]); i++) {
+			failed += check_kernel(k, tails[i], offset) < 0;
+		}
+	}
+
+	return failed;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief	Time a kernel and print the bytes of samples it reads per second
+ */
+static void bench_kernel(const kernel_t *k)
+{
+	size_t size = (size_t)BENCH_SAMPLES * k->bytes;
+	unsigned char *in = (unsigned char *)malloc(size);
+	int *out = (int *)malloc(BENCH_SAMPLES * sizeof(int));
+	double start, elapsed;
+	long calls = 0;
+
+	if (in == NULL || out == NULL) {
+		fprintf(stderr, "ERROR: Cannot allocate memory.\n");
+		exit(1);
+	}
+	fill_random(in, size);
+	start = now();
+	do {
+		if (k->planar) {
+			/* the same bytes as frames of two channels */
+			k->planar(out, out + BENCH_SAMPLES / 2, in, BENCH_SAMPLES / 2);
+		}
+		else {
+			k->fn(out, in, BENCH_SAMPLES);
+		}
+		calls++;
+		elapsed = now() - start;
+	} while (elapsed < BENCH_SECONDS);
+	printf("  %-26s %-6s %7.2f GB/s\n", k->name, isa_names[k->isa],
+		   (double)size * calls / elapsed / 1e9);
+	free(in);
+	free(out);
+}
+
+int main(int argc, char *argv[])
+{
+	kernel_t k;
+	size_t i;
+	int bench = (argc > 1 && !strcmp(argv[1], "-b"));
+	int failed = 0;
+	int tested = 0;
+	int b, s;
+
+	printf("Sample unpacking: %s\n", unpack_isa());
+	if (bench) {
+		for (b = 0; b < 4; b++) {
+			for (s = 0; s < 2; s++) {
+				bench_kernel(&scalar[b][s]);
+			}
+		}
+	}
+	else {
+		/* what the encoder runs, whichever kernel it is */
+		for (b = 1; b <= 4; b++) {
+			for (s = 0; s < 2; s++) {
+				k.name = "unpack_select()";
+				k.bytes = b;
+				k.swap = s;
+				k.isa = ISA_SCALAR;
+				k.fn = unpack_select(b, s);
+				k.planar = NULL;
+				failed += test_kernel(&k);
+				k.name = "unpack_select_planar()";
+				k.fn = NULL;
+				k.planar = unpack_select_planar(b, s);
+				failed += test_kernel(&k);
+				tested += 2;
+			}
+		}
+	}
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		if (!isa_supported(kernels[i].isa)) {
+			printf("  %-26s skipped, no %s\n", kernels[i].name, isa_names[kernels[i].isa]);
+		}
+		else if (bench) {
+			bench_kernel(&kernels[i]);
+		}
+		else {
+			failed += test_kernel(&kernels[i]);
+			tested++;
+		}
+	}
+
+	if (!bench) {
+		printf("unpack: %d kernels, %s\n", tested, failed ? "FAILED" : "OK");
+	}
+
+	return failed ? 1 : 0;
+}
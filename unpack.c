@@ -0,0 +1,1102 @@
+/**
+ * @file		unpack.c
+ * @version		0.6
+ * @brief		kernels unpacking PCM samples of every width and byte order into ints
+ * @date		Feb 25, 2020
+ * @author		Siwon Kang (kkangshawn@gmail.com)
+ *
+ * A sample of b bytes ends up in the high b bytes of the int, the rest is
+ * zero. Unsigned 8-bit samples are flipped to signed and 0x7f fills the byte
+ * below. IEEE float samples are not converted, the 32-bit kernels leave
+ * their bits in the native byte order for the float encoder.
+ * The kernel for the format is chosen once by what the CPU supports:
+ * SSE2, SSSE3 and AVX2 on x86, NEON on ARM. Every SIMD kernel hands the
+ * samples short of a whole step to the scalar kernel, so the results are the
+ * same bit for bit whichever is chosen.
+ * The planar kernels unpack stereo samples into a plane per channel on the
+ * way, which is what the encoder takes.
+ */
+
+#include "unpack.h"
+
+#if defined (__x86_64__) || defined (__i386__) || defined (_M_X64) || defined (_M_IX86)
+#define UNPACK_X86
+#include <immintrin.h>
+#if defined (_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined (__aarch64__) || (defined (__arm__) && defined (__GNUC__))
+#define UNPACK_NEON
+#if defined (__arm__) && defined (__linux)
+#include <sys/auxv.h>
+#ifndef HWCAP_NEON
+#define HWCAP_NEON				(1 << 12)
+#endif
+#endif
+#endif
+
+/* frames a scalar planar kernel unpacks at a time, so they stay in the L1 cache */
+#define UNPACK_PLANAR_CHUNK		64
+
+#if defined (__GNUC__)
+#define UNPACK_TARGET(isa)		__attribute__((target(isa)))
+#else
+#define UNPACK_TARGET(isa)
+#endif
+
+/* kernels by bytes per sample - 1 and byte order, set once by unpack_init() */
+static unpack_fn unpack_table[4][2];
+/* planar kernels, likewise */
+static unpack_planar_fn unpack_planar_table[4][2];
+static const char *unpack_name = "scalar";
+static pthread_once_t unpack_once = PTHREAD_ONCE_INIT;
+
+
+static void unpack_s8_scalar(int *out, const unsigned char *in, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		out[i] = (int)((unsigned int)in[i] << 24);
+	}
+}
+
+static void unpack_u8_scalar(int *out, const unsigned char *in, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		out[i] = (int)((unsigned int)(in[i] ^ 0x80) << 24 | 0x7f << 16);
+	}
+}
+
+static void unpack_le16_scalar(int *out, const unsigned char *in, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++, in += 2) {
+		out[i] = (int)((unsigned int)in[0] << 16 | (unsigned int)in[1] << 24);
+	}
+}
+
+static void unpack_be16_scalar(int *out, const unsigned char *in, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++, in += 2) {
+		out[i] = (int)((unsigned int)in[0] << 24 | (unsigned int)in[1] << 16);
+	}
+}
+
+static void unpack_le24_scalar(int *out, const unsigned char *in, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++, in += 3) {
+		out[i] = (int)((unsigned int)in[0] << 8 | (unsigned int)in[1] << 16
+				| (unsigned int)in[2] << 24);
+	}
+}
+
+static void unpack_be24_scalar(int *out, const unsigned char *in, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++, in += 3) {
+		out[i] = (int)((unsigned int)in[0] << 24 | (unsigned int)in[1] << 16
+				| (unsigned int)in[2] << 8);
+	}
+}
+
+static void unpack_le32_scalar(int *out, const unsigned char *in, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++, in += 4) {
+		out[i] = (int)((unsigned int)in[0] | (unsigned int)in[1] << 8
+				| (unsigned int)in[2] << 16 | (unsigned int)in[3] << 24);
+	}
+}
+
+static void unpack_be32_scalar(int *out, const unsigned char *in, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++, in += 4) {
+		out[i] = (int)((unsigned int)in[0] << 24 | (unsigned int)in[1] << 16
+				| (unsigned int)in[2] << 8 | (unsigned int)in[3]);
+	}
+}
+
+/**
+ * @brief	Split stereo samples unpacked by an interleaved kernel into the planes
+ * @param [in]	unpack		Interleaved kernel of the format
+ * @param [in]	bytes		Bytes per sample
+ */
+static void unpack_planar(unpack_fn unpack, size_t bytes, int *left, int *right,
+						  const unsigned char *in, size_t n)
+{
+	int frames[2 * UNPACK_PLANAR_CHUNK];
+	size_t i, j, m;
+
+	for (i = 0; i < n; i += m) {
+		m = (n - i < UNPACK_PLANAR_CHUNK) ? n - i : UNPACK_PLANAR_CHUNK;
+		unpack(frames, in + 2 * bytes * i, 2 * m);
+		for (j = 0; j < m; j++) {
+			left[i + j] = frames[2 * j];
+			right[i + j] = frames[2 * j + 1];
+		}
+	}
+}
+
+#define UNPACK_PLANAR_SCALAR(name, bytes) \
+static void unpack_##name##_planar_scalar(int *left, int *right, const unsigned char *in, size_t n) \
+{ \
+	unpack_planar(unpack_##name##_scalar, bytes, left, right, in, n); \
+}
+
+UNPACK_PLANAR_SCALAR(s8, 1)
+UNPACK_PLANAR_SCALAR(u8, 1)
+UNPACK_PLANAR_SCALAR(le16, 2)
+UNPACK_PLANAR_SCALAR(be16, 2)
+UNPACK_PLANAR_SCALAR(le24, 3)
+UNPACK_PLANAR_SCALAR(be24, 3)
+UNPACK_PLANAR_SCALAR(le32, 4)
+UNPACK_PLANAR_SCALAR(be32, 4)
+
+#undef UNPACK_PLANAR_SCALAR
+
+#if defined (UNPACK_X86) || defined (UNPACK_NEON)
+/**
+ * @brief	Little-endian 32-bit samples on a little-endian CPU are ints already
+ */
+static void unpack_le32_copy(int *out, const unsigned char *in, size_t n)
+{
+	memcpy(out, in, n * 4);
+}
+#endif
+
+#if defined (UNPACK_X86)
+/**
+ * @brief	8-bit samples, 16 per step. Interleaving zero bytes in front of each
+ *		byte twice moves it to the top of a 32-bit lane.
+ */
+UNPACK_TARGET("sse2")
+static void unpack_8_sse2(int *out, const unsigned char *in, size_t n, int is_unsigned)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i flip = _mm_set1_epi8(is_unsigned ? (char)0x80 : 0);
+	const __m128i fill = _mm_set1_epi32(is_unsigned ? 0x7f << 16 : 0);
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + i)), flip);
+		__m128i lo = _mm_unpacklo_epi8(zero, v);
+		__m128i hi = _mm_unpackhi_epi8(zero, v);
+
+		_mm_storeu_si128((__m128i *)(out + i), _mm_or_si128(_mm_unpacklo_epi16(zero, lo), fill));
+		_mm_storeu_si128((__m128i *)(out + i + 4), _mm_or_si128(_mm_unpackhi_epi16(zero, lo), fill));
+		_mm_storeu_si128((__m128i *)(out + i + 8), _mm_or_si128(_mm_unpacklo_epi16(zero, hi), fill));
+		_mm_storeu_si128((__m128i *)(out + i + 12), _mm_or_si128(_mm_unpackhi_epi16(zero, hi), fill));
+	}
+	if (is_unsigned) {
+		unpack_u8_scalar(out + i, in + i, n - i);
+	}
+	else {
+		unpack_s8_scalar(out + i, in + i, n - i);
+	}
+}
+
+UNPACK_TARGET("sse2")
+static void unpack_s8_sse2(int *out, const unsigned char *in, size_t n)
+{
+	unpack_8_sse2(out, in, n, 0);
+}
+
+UNPACK_TARGET("sse2")
+static void unpack_u8_sse2(int *out, const unsigned char *in, size_t n)
+{
+	unpack_8_sse2(out, in, n, 1);
+}
+
+UNPACK_TARGET("sse2")
+static void unpack_le16_sse2(int *out, const unsigned char *in, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + 2 * i));
+
+		_mm_storeu_si128((__m128i *)(out + i), _mm_unpacklo_epi16(zero, v));
+		_mm_storeu_si128((__m128i *)(out + i + 4), _mm_unpackhi_epi16(zero, v));
+	}
+	unpack_le16_scalar(out + i, in + 2 * i, n - i);
+}
+
+UNPACK_TARGET("sse2")
+static void unpack_be16_sse2(int *out, const unsigned char *in, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + 2 * i));
+
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *)(out + i), _mm_unpacklo_epi16(zero, v));
+		_mm_storeu_si128((__m128i *)(out + i + 4), _mm_unpackhi_epi16(zero, v));
+	}
+	unpack_be16_scalar(out + i, in + 2 * i, n - i);
+}
+
+/**
+ * @brief	Swap the bytes of each half, then the halves
+ */
+UNPACK_TARGET("sse2")
+static __m128i unpack_bswap32_sse2(__m128i v)
+{
+	v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+	v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+
+	return _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+UNPACK_TARGET("sse2")
+static void unpack_be32_sse2(int *out, const unsigned char *in, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + 4 * i));
+
+		_mm_storeu_si128((__m128i *)(out + i), unpack_bswap32_sse2(v));
+	}
+	unpack_be32_scalar(out + i, in + 4 * i, n - i);
+}
+
+/**
+ * @brief	Stereo 8-bit samples, 8 frames per step. As a 16-bit lane a frame
+ *		is the right sample above the left one, so a shift and a mask take
+ *		them apart.
+ */
+UNPACK_TARGET("sse2")
+static void unpack_8_planar_sse2(int *left, int *right, const unsigned char *in, size_t n,
+								 int is_unsigned)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i flip = _mm_set1_epi8(is_unsigned ? (char)0x80 : 0);
+	const __m128i fill = _mm_set1_epi32(is_unsigned ? 0x7f << 16 : 0);
+	const __m128i high = _mm_set1_epi16((short)0xff00);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + 2 * i)), flip);
+		__m128i l = _mm_slli_epi16(v, 8);
+		__m128i r = _mm_and_si128(v, high);
+
+		_mm_storeu_si128((__m128i *)(left + i), _mm_or_si128(_mm_unpacklo_epi16(zero, l), fill));
+		_mm_storeu_si128((__m128i *)(left + i + 4), _mm_or_si128(_mm_unpackhi_epi16(zero, l), fill));
+		_mm_storeu_si128((__m128i *)(right + i), _mm_or_si128(_mm_unpacklo_epi16(zero, r), fill));
+		_mm_storeu_si128((__m128i *)(right + i + 4), _mm_or_si128(_mm_unpackhi_epi16(zero, r), fill));
+	}
+	if (is_unsigned) {
+		unpack_u8_planar_scalar(left + i, right + i, in + 2 * i, n - i);
+	}
+	else {
+		unpack_s8_planar_scalar(left + i, right + i, in + 2 * i, n - i);
+	}
+}
+
+UNPACK_TARGET("sse2")
+static void unpack_s8_planar_sse2(int *left, int *right, const unsigned char *in, size_t n)
+{
+	unpack_8_planar_sse2(left, right, in, n, 0);
+}
+
+UNPACK_TARGET("sse2")
+static void unpack_u8_planar_sse2(int *left, int *right, const unsigned char *in, size_t n)
+{
+	unpack_8_planar_sse2(left, right, in, n, 1);
+}
+
+/**
+ * @brief	Stereo 16-bit samples, 4 frames per step. As a 32-bit lane a frame
+ *		is the right sample above the left one, which is already where the
+ *		right one goes.
+ */
+UNPACK_TARGET("sse2")
+static void unpack_16_planar_sse2(int *left, int *right, const unsigned char *in, size_t n,
+								  int swap)
+{
+	const __m128i high = _mm_set1_epi32((int)0xffff0000);
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + 4 * i));
+
+		if (swap) {
+			v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		}
+		_mm_storeu_si128((__m128i *)(left + i), _mm_slli_epi32(v, 16));
+		_mm_storeu_si128((__m128i *)(right + i), _mm_and_si128(v, high));
+	}
+	if (swap) {
+		unpack_be16_planar_scalar(left + i, right + i, in + 4 * i, n - i);
+	}
+	else {
+		unpack_le16_planar_scalar(left + i, right + i, in + 4 * i, n - i);
+	}
+}
+
+UNPACK_TARGET("sse2")
+static void unpack_le16_planar_sse2(int *left, int *right, const unsigned char *in, size_t n)
+{
+	unpack_16_planar_sse2(left, right, in, n, 0);
+}
+
+UNPACK_TARGET("sse2")
+static void unpack_be16_planar_sse2(int *left, int *right, const unsigned char *in, size_t n)
+{
+	unpack_16_planar_sse2(left, right, in, n, 1);
+}
+
+/**
+ * @brief	Stereo 32-bit samples, 4 frames per step, split by shuffling the
+ *		even and the odd lanes of two vectors together
+ */
+UNPACK_TARGET("sse2")
+static void unpack_32_planar_sse2(int *left, int *right, const unsigned char *in, size_t n,
+								  int swap)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(in + 8 * i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(in + 8 * i + 16));
+
+		if (swap) {
+			a = unpack_bswap32_sse2(a);
+			b = unpack_bswap32_sse2(b);
+		}
+		_mm_storeu_ps((float *)(left + i), _mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b),
+														  _MM_SHUFFLE(2, 0, 2, 0)));
+		_mm_storeu_ps((float *)(right + i), _mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b),
+														   _MM_SHUFFLE(3, 1, 3, 1)));
+	}
+	if (swap) {
+		unpack_be32_planar_scalar(left + i, right + i, in + 8 * i, n - i);
+	}
+	else {
+		unpack_le32_planar_scalar(left + i, right + i, in + 8 * i, n - i);
+	}
+}
+
+UNPACK_TARGET("sse2")
+static void unpack_le32_planar_sse2(int *left, int *right, const unsigned char *in, size_t n)
+{
+	unpack_32_planar_sse2(left, right, in, n, 0);
+}
+
+UNPACK_TARGET("sse2")
+static void unpack_be32_planar_sse2(int *left, int *right, const unsigned char *in, size_t n)
+{
+	unpack_32_planar_sse2(left, right, in, n, 1);
+}
+
+/**
+ * @brief	24-bit samples, 8 per step. Each load covers 16 bytes of which the
+ *		first 12 are used, so a step needs 28 bytes left.
+ */
+UNPACK_TARGET("ssse3")
+static void unpack_24_ssse3(int *out, const unsigned char *in, size_t n, __m128i mask, int swap)
+{
+	size_t i;
+
+	for (i = 0; i + 10 <= n; i += 8) {
+		__m128i lo = _mm_loadu_si128((const __m128i *)(in + 3 * i));
+		__m128i hi = _mm_loadu_si128((const __m128i *)(in + 3 * i + 12));
+
+		_mm_storeu_si128((__m128i *)(out + i), _mm_shuffle_epi8(lo, mask));
+		_mm_storeu_si128((__m128i *)(out + i + 4), _mm_shuffle_epi8(hi, mask));
+	}
+	if (swap) {
+		unpack_be24_scalar(out + i, in + 3 * i, n - i);
+	}
+	else {
+		unpack_le24_scalar(out + i, in + 3 * i, n - i);
+	}
+}
+
+UNPACK_TARGET("ssse3")
+static void unpack_le24_ssse3(int *out, const unsigned char *in, size_t n)
+{
+	unpack_24_ssse3(out, in, n, _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5,
+											  -1, 6, 7, 8, -1, 9, 10, 11), 0);
+}
+
+UNPACK_TARGET("ssse3")
+static void unpack_be24_ssse3(int *out, const unsigned char *in, size_t n)
+{
+	unpack_24_ssse3(out, in, n, _mm_setr_epi8(-1, 2, 1, 0, -1, 5, 4, 3,
+											  -1, 8, 7, 6, -1, 11, 10, 9), 1);
+}
+
+/**
+ * @brief	Stereo 24-bit samples, 4 frames per step. The shuffle of a load puts
+ *		the two left samples of it before the two right ones, the 64-bit
+ *		halves of two loads then make the planes.
+ */
+UNPACK_TARGET("ssse3")
+static void unpack_24_planar_ssse3(int *left, int *right, const unsigned char *in, size_t n,
+								   __m128i mask, int swap)
+{
+	size_t i;
+
+	for (i = 0; i + 5 <= n; i += 4) {
+		__m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in + 6 * i)), mask);
+		__m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in + 6 * i + 12)), mask);
+
+		_mm_storeu_si128((__m128i *)(left + i), _mm_unpacklo_epi64(a, b));
+		_mm_storeu_si128((__m128i *)(right + i), _mm_unpackhi_epi64(a, b));
+	}
+	if (swap) {
+		unpack_be24_planar_scalar(left + i, right + i, in + 6 * i, n - i);
+	}
+	else {
+		unpack_le24_planar_scalar(left + i, right + i, in + 6 * i, n - i);
+	}
+}
+
+UNPACK_TARGET("ssse3")
+static void unpack_le24_planar_ssse3(int *left, int *right, const unsigned char *in, size_t n)
+{
+	unpack_24_planar_ssse3(left, right, in, n, _mm_setr_epi8(-1, 0, 1, 2, -1, 6, 7, 8,
+															 -1, 3, 4, 5, -1, 9, 10, 11), 0);
+}
+
+UNPACK_TARGET("ssse3")
+static void unpack_be24_planar_ssse3(int *left, int *right, const unsigned char *in, size_t n)
+{
+	unpack_24_planar_ssse3(left, right, in, n, _mm_setr_epi8(-1, 2, 1, 0, -1, 8, 7, 6,
+															 -1, 5, 4, 3, -1, 11, 10, 9), 1);
+}
+
+UNPACK_TARGET("ssse3")
+static void unpack_be32_ssse3(int *out, const unsigned char *in, size_t n)
+{
+	const __m128i mask = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + 4 * i));
+
+		_mm_storeu_si128((__m128i *)(out + i), _mm_shuffle_epi8(v, mask));
+	}
+	unpack_be32_scalar(out + i, in + 4 * i, n - i);
+}
+
+/**
+ * @brief	8-bit samples, 16 per step, widened by sign extension and shifted
+ *		to the top
+ */
+UNPACK_TARGET("avx2")
+static void unpack_8_avx2(int *out, const unsigned char *in, size_t n, int is_unsigned)
+{
+	const __m128i flip = _mm_set1_epi8(is_unsigned ? (char)0x80 : 0);
+	const __m256i fill = _mm256_set1_epi32(is_unsigned ? 0x7f << 16 : 0);
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + i)), flip);
+		__m256i lo = _mm256_slli_epi32(_mm256_cvtepi8_epi32(v), 24);
+		__m256i hi = _mm256_slli_epi32(_mm256_cvtepi8_epi32(_mm_srli_si128(v, 8)), 24);
+
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_or_si256(lo, fill));
+		_mm256_storeu_si256((__m256i *)(out + i + 8), _mm256_or_si256(hi, fill));
+	}
+	if (is_unsigned) {
+		unpack_u8_scalar(out + i, in + i, n - i);
+	}
+	else {
+		unpack_s8_scalar(out + i, in + i, n - i);
+	}
+}
+
+UNPACK_TARGET("avx2")
+static void unpack_s8_avx2(int *out, const unsigned char *in, size_t n)
+{
+	unpack_8_avx2(out, in, n, 0);
+}
+
+UNPACK_TARGET("avx2")
+static void unpack_u8_avx2(int *out, const unsigned char *in, size_t n)
+{
+	unpack_8_avx2(out, in, n, 1);
+}
+
+UNPACK_TARGET("avx2")
+static void unpack_le16_avx2(int *out, const unsigned char *in, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i lo = _mm_loadu_si128((const __m128i *)(in + 2 * i));
+		__m128i hi = _mm_loadu_si128((const __m128i *)(in + 2 * i + 16));
+
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_slli_epi32(_mm256_cvtepu16_epi32(lo), 16));
+		_mm256_storeu_si256((__m256i *)(out + i + 8), _mm256_slli_epi32(_mm256_cvtepu16_epi32(hi), 16));
+	}
+	unpack_le16_scalar(out + i, in + 2 * i, n - i);
+}
+
+UNPACK_TARGET("avx2")
+static void unpack_be16_avx2(int *out, const unsigned char *in, size_t n)
+{
+	const __m256i mask = _mm256_setr_epi8(-1, -1, 1, 0, -1, -1, 3, 2, -1, -1, 5, 4, -1, -1, 7, 6,
+										  -1, -1, 1, 0, -1, -1, 3, 2, -1, -1, 5, 4, -1, -1, 7, 6);
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(in + 2 * i));
+		/* each lane takes the 4 samples of one 8-byte quarter */
+		__m256i lo = _mm256_permute4x64_epi64(v, _MM_SHUFFLE(1, 1, 0, 0));
+		__m256i hi = _mm256_permute4x64_epi64(v, _MM_SHUFFLE(3, 3, 2, 2));
+
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_shuffle_epi8(lo, mask));
+		_mm256_storeu_si256((__m256i *)(out + i + 8), _mm256_shuffle_epi8(hi, mask));
+	}
+	unpack_be16_scalar(out + i, in + 2 * i, n - i);
+}
+
+UNPACK_TARGET("avx2")
+static void unpack_16_planar_avx2(int *left, int *right, const unsigned char *in, size_t n,
+								  int swap)
+{
+	const __m256i high = _mm256_set1_epi32((int)0xffff0000);
+	const __m256i mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+										  1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(in + 4 * i));
+
+		if (swap) {
+			v = _mm256_shuffle_epi8(v, mask);
+		}
+		_mm256_storeu_si256((__m256i *)(left + i), _mm256_slli_epi32(v, 16));
+		_mm256_storeu_si256((__m256i *)(right + i), _mm256_and_si256(v, high));
+	}
+	if (swap) {
+		unpack_be16_planar_scalar(left + i, right + i, in + 4 * i, n - i);
+	}
+	else {
+		unpack_le16_planar_scalar(left + i, right + i, in + 4 * i, n - i);
+	}
+}
+
+UNPACK_TARGET("avx2")
+static void unpack_le16_planar_avx2(int *left, int *right, const unsigned char *in, size_t n)
+{
+	unpack_16_planar_avx2(left, right, in, n, 0);
+}
+
+UNPACK_TARGET("avx2")
+static void unpack_be16_planar_avx2(int *left, int *right, const unsigned char *in, size_t n)
+{
+	unpack_16_planar_avx2(left, right, in, n, 1);
+}
+
+/**
+ * @brief	24-bit samples, 8 per step. The 24 bytes of a step are spread over
+ *		the two lanes, 12 each, before the bytes are shuffled within the lanes.
+ *		A load covers 32 bytes, so a step needs 32 bytes left.
+ */
+UNPACK_TARGET("avx2")
+static void unpack_24_avx2(int *out, const unsigned char *in, size_t n, __m256i mask, int swap)
+{
+	const __m256i spread = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+	size_t i;
+
+	for (i = 0; i + 11 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(in + 3 * i));
+
+		v = _mm256_permutevar8x32_epi32(v, spread);
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_shuffle_epi8(v, mask));
+	}
+	if (swap) {
+		unpack_be24_scalar(out + i, in + 3 * i, n - i);
+	}
+	else {
+		unpack_le24_scalar(out + i, in + 3 * i, n - i);
+	}
+}
+
+UNPACK_TARGET("avx2")
+static void unpack_le24_avx2(int *out, const unsigned char *in, size_t n)
+{
+	unpack_24_avx2(out, in, n, _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+												-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11), 0);
+}
+
+UNPACK_TARGET("avx2")
+static void unpack_be24_avx2(int *out, const unsigned char *in, size_t n)
+{
+	unpack_24_avx2(out, in, n, _mm256_setr_epi8(-1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9,
+												-1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9), 1);
+}
+
+UNPACK_TARGET("avx2")
+static void unpack_be32_avx2(int *out, const unsigned char *in, size_t n)
+{
+	const __m256i mask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+										  3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(in + 4 * i));
+
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_shuffle_epi8(v, mask));
+	}
+	unpack_be32_scalar(out + i, in + 4 * i, n - i);
+}
+
+/**
+ * @brief	Check the CPU, AVX2 also needs the OS to save the ymm registers
+ */
+static void unpack_cpu(int *sse2, int *ssse3, int *avx2)
+{
+#if defined (_MSC_VER)
+	int info[4];
+
+	__cpuid(info, 1);
+	*sse2 = (info[3] >> 26) & 1;
+	*ssse3 = (info[2] >> 9) & 1;
+	*avx2 = 0;
+	if ((info[2] >> 27) & 1 && (_xgetbv(0) & 6) == 6) {
+		__cpuidex(info, 7, 0);
+		*avx2 = (info[1] >> 5) & 1;
+	}
+#else
+	__builtin_cpu_init();
+	*sse2 = __builtin_cpu_supports("sse2");
+	*ssse3 = __builtin_cpu_supports("ssse3");
+	*avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+#endif /* UNPACK_X86 */
+
+#if defined (UNPACK_NEON)
+/*
+ * The NEON kernels load the bytes of 16 samples split by their position in
+ * the sample, and store them interleaved 4 bytes per sample, so every width
+ * and byte order is one load and one store.
+ */
+#if defined (__arm__)
+#pragma GCC push_options
+#pragma GCC target ("fpu=neon")
+#endif
+#include <arm_neon.h>
+
+static void unpack_s8_neon(int *out, const unsigned char *in, size_t n)
+{
+	uint8x16x4_t v;
+	size_t i;
+
+	v.val[0] = vdupq_n_u8(0);
+	v.val[1] = v.val[0];
+	v.val[2] = v.val[0];
+	for (i = 0; i + 16 <= n; i += 16) {
+		v.val[3] = vld1q_u8(in + i);
+		vst4q_u8((uint8_t *)(out + i), v);
+	}
+	unpack_s8_scalar(out + i, in + i, n - i);
+}
+
+static void unpack_u8_neon(int *out, const unsigned char *in, size_t n)
+{
+	uint8x16x4_t v;
+	size_t i;
+
+	v.val[0] = vdupq_n_u8(0);
+	v.val[1] = v.val[0];
+	v.val[2] = vdupq_n_u8(0x7f);
+	for (i = 0; i + 16 <= n; i += 16) {
+		v.val[3] = veorq_u8(vld1q_u8(in + i), vdupq_n_u8(0x80));
+		vst4q_u8((uint8_t *)(out + i), v);
+	}
+	unpack_u8_scalar(out + i, in + i, n - i);
+}
+
+static void unpack_le16_neon(int *out, const unsigned char *in, size_t n)
+{
+	uint8x16x4_t v;
+	uint8x16x2_t s;
+	size_t i;
+
+	v.val[0] = vdupq_n_u8(0);
+	v.val[1] = v.val[0];
+	for (i = 0; i + 16 <= n; i += 16) {
+		s = vld2q_u8(in + 2 * i);
+		v.val[2] = s.val[0];
+		v.val[3] = s.val[1];
+		vst4q_u8((uint8_t *)(out + i), v);
+	}
+	unpack_le16_scalar(out + i, in + 2 * i, n - i);
+}
+
+static void unpack_be16_neon(int *out, const unsigned char *in, size_t n)
+{
+	uint8x16x4_t v;
+	uint8x16x2_t s;
+	size_t i;
+
+	v.val[0] = vdupq_n_u8(0);
+	v.val[1] = v.val[0];
+	for (i = 0; i + 16 <= n; i += 16) {
+		s = vld2q_u8(in + 2 * i);
+		v.val[2] = s.val[1];
+		v.val[3] = s.val[0];
+		vst4q_u8((uint8_t *)(out + i), v);
+	}
+	unpack_be16_scalar(out + i, in + 2 * i, n - i);
+}
+
+static void unpack_le24_neon(int *out, const unsigned char *in, size_t n)
+{
+	uint8x16x4_t v;
+	uint8x16x3_t s;
+	size_t i;
+
+	v.val[0] = vdupq_n_u8(0);
+	for (i = 0; i + 16 <= n; i += 16) {
+		s = vld3q_u8(in + 3 * i);
+		v.val[1] = s.val[0];
+		v.val[2] = s.val[1];
+		v.val[3] = s.val[2];
+		vst4q_u8((uint8_t *)(out + i), v);
+	}
+	unpack_le24_scalar(out + i, in + 3 * i, n - i);
+}
+
+static void unpack_be24_neon(int *out, const unsigned char *in, size_t n)
+{
+	uint8x16x4_t v;
+	uint8x16x3_t s;
+	size_t i;
+
+	v.val[0] = vdupq_n_u8(0);
+	for (i = 0; i + 16 <= n; i += 16) {
+		s = vld3q_u8(in + 3 * i);
+		v.val[1] = s.val[2];
+		v.val[2] = s.val[1];
+		v.val[3] = s.val[0];
+		vst4q_u8((uint8_t *)(out + i), v);
+	}
+	unpack_be24_scalar(out + i, in + 3 * i, n - i);
+}
+
+static void unpack_be32_neon(int *out, const unsigned char *in, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		vst1q_u8((uint8_t *)(out + i), vrev32q_u8(vld1q_u8(in + 4 * i)));
+		vst1q_u8((uint8_t *)(out + i + 4), vrev32q_u8(vld1q_u8(in + 4 * i + 16)));
+		vst1q_u8((uint8_t *)(out + i + 8), vrev32q_u8(vld1q_u8(in + 4 * i + 32)));
+		vst1q_u8((uint8_t *)(out + i + 12), vrev32q_u8(vld1q_u8(in + 4 * i + 48)));
+	}
+	unpack_be32_scalar(out + i, in + 4 * i, n - i);
+}
+
+/*
+ * The planar kernels load a frame per sample of the plain ones, and split
+ * the channels by loading with one more byte per sample, or by unzipping.
+ */
+static void unpack_8_planar_neon(int *left, int *right, const unsigned char *in, size_t n,
+								 int is_unsigned)
+{
+	const uint8x16_t flip = vdupq_n_u8(is_unsigned ? 0x80 : 0);
+	uint8x16x4_t l, r;
+	uint8x16x2_t s;
+	size_t i;
+
+	l.val[0] = vdupq_n_u8(0);
+	l.val[1] = l.val[0];
+	l.val[2] = vdupq_n_u8(is_unsigned ? 0x7f : 0);
+	r = l;
+	for (i = 0; i + 16 <= n; i += 16) {
+		s = vld2q_u8(in + 2 * i);
+		l.val[3] = veorq_u8(s.val[0], flip);
+		r.val[3] = veorq_u8(s.val[1], flip);
+		vst4q_u8((uint8_t *)(left + i), l);
+		vst4q_u8((uint8_t *)(right + i), r);
+	}
+	if (is_unsigned) {
+		unpack_u8_planar_scalar(left + i, right + i, in + 2 * i, n - i);
+	}
+	else {
+		unpack_s8_planar_scalar(left + i, right + i, in + 2 * i, n - i);
+	}
+}
+
+static void unpack_s8_planar_neon(int *left, int *right, const unsigned char *in, size_t n)
+{
+	unpack_8_planar_neon(left, right, in, n, 0);
+}
+
+static void unpack_u8_planar_neon(int *left, int *right, const unsigned char *in, size_t n)
+{
+	unpack_8_planar_neon(left, right, in, n, 1);
+}
+
+static void unpack_le16_planar_neon(int *left, int *right, const unsigned char *in, size_t n)
+{
+	uint8x16x4_t l, r, s;
+	size_t i;
+
+	l.val[0] = vdupq_n_u8(0);
+	l.val[1] = l.val[0];
+	r = l;
+	for (i = 0; i + 16 <= n; i += 16) {
+		s = vld4q_u8(in + 4 * i);
+		l.val[2] = s.val[0];
+		l.val[3] = s.val[1];
+		r.val[2] = s.val[2];
+		r.val[3] = s.val[3];
+		vst4q_u8((uint8_t *)(left + i), l);
+		vst4q_u8((uint8_t *)(right + i), r);
+	}
+	unpack_le16_planar_scalar(left + i, right + i, in + 4 * i, n - i);
+}
+
+static void unpack_be16_planar_neon(int *left, int *right, const unsigned char *in, size_t n)
+{
+	uint8x16x4_t l, r, s;
+	size_t i;
+
+	l.val[0] = vdupq_n_u8(0);
+	l.val[1] = l.val[0];
+	r = l;
+	for (i = 0; i + 16 <= n; i += 16) {
+		s = vld4q_u8(in + 4 * i);
+		l.val[2] = s.val[1];
+		l.val[3] = s.val[0];
+		r.val[2] = s.val[3];
+		r.val[3] = s.val[2];
+		vst4q_u8((uint8_t *)(left + i), l);
+		vst4q_u8((uint8_t *)(right + i), r);
+	}
+	unpack_be16_planar_scalar(left + i, right + i, in + 4 * i, n - i);
+}
+
+/**
+ * @brief	Stereo 24-bit samples, 8 frames per step. Byte k of 16 samples is
+ *		loaded together, the left samples at the even positions.
+ */
+static void unpack_24_planar_neon(int *left, int *right, const unsigned char *in, size_t n,
+								  int swap)
+{
+	uint8x8x4_t l, r;
+	uint8x16x3_t s;
+	uint8x8x2_t b[3];
+	size_t i;
+	int k;
+
+	l.val[0] = vdup_n_u8(0);
+	r.val[0] = l.val[0];
+	for (i = 0; i + 8 <= n; i += 8) {
+		s = vld3q_u8(in + 6 * i);
+		for (k = 0; k < 3; k++) {
+			b[k] = vuzp_u8(vget_low_u8(s.val[k]), vget_high_u8(s.val[k]));
+		}
+		for (k = 0; k < 3; k++) {
+			l.val[1 + k] = b[swap ? 2 - k : k].val[0];
+			r.val[1 + k] = b[swap ? 2 - k : k].val[1];
+		}
+		vst4_u8((uint8_t *)(left + i), l);
+		vst4_u8((uint8_t *)(right + i), r);
+	}
+	if (swap) {
+		unpack_be24_planar_scalar(left + i, right + i, in + 6 * i, n - i);
+	}
+	else {
+		unpack_le24_planar_scalar(left + i, right + i, in + 6 * i, n - i);
+	}
+}
+
+static void unpack_le24_planar_neon(int *left, int *right, const unsigned char *in, size_t n)
+{
+	unpack_24_planar_neon(left, right, in, n, 0);
+}
+
+static void unpack_be24_planar_neon(int *left, int *right, const unsigned char *in, size_t n)
+{
+	unpack_24_planar_neon(left, right, in, n, 1);
+}
+
+static void unpack_le32_planar_neon(int *left, int *right, const unsigned char *in, size_t n)
+{
+	uint32x4x2_t s;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		s = vuzpq_u32(vreinterpretq_u32_u8(vld1q_u8(in + 8 * i)),
+					  vreinterpretq_u32_u8(vld1q_u8(in + 8 * i + 16)));
+		vst1q_s32(left + i, vreinterpretq_s32_u32(s.val[0]));
+		vst1q_s32(right + i, vreinterpretq_s32_u32(s.val[1]));
+	}
+	unpack_le32_planar_scalar(left + i, right + i, in + 8 * i, n - i);
+}
+
+static void unpack_be32_planar_neon(int *left, int *right, const unsigned char *in, size_t n)
+{
+	uint32x4x2_t s;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		s = vuzpq_u32(vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(in + 8 * i))),
+					  vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(in + 8 * i + 16))));
+		vst1q_s32(left + i, vreinterpretq_s32_u32(s.val[0]));
+		vst1q_s32(right + i, vreinterpretq_s32_u32(s.val[1]));
+	}
+	unpack_be32_planar_scalar(left + i, right + i, in + 8 * i, n - i);
+}
+
+#if defined (__arm__)
+#pragma GCC pop_options
+#endif
+
+/**
+ * @brief	NEON is optional on ARMv7, the kernel tells whether the CPU has it
+ */
+static int unpack_has_neon(void)
+{
+#if defined (__aarch64__)
+	return 1;
+#elif defined (__linux)
+	return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#else
+	return 0;
+#endif
+}
+#endif /* UNPACK_NEON */
+
+/**
+ * @brief	Fill the table with the best kernel of every format the CPU runs
+ */
+static void unpack_init(void)
+{
+#if defined (UNPACK_X86)
+	int sse2, ssse3, avx2;
+#endif
+
+	unpack_table[0][0] = unpack_s8_scalar;
+	unpack_table[0][1] = unpack_u8_scalar;
+	unpack_table[1][0] = unpack_le16_scalar;
+	unpack_table[1][1] = unpack_be16_scalar;
+	unpack_table[2][0] = unpack_le24_scalar;
+	unpack_table[2][1] = unpack_be24_scalar;
+	unpack_table[3][0] = unpack_le32_scalar;
+	unpack_table[3][1] = unpack_be32_scalar;
+	unpack_planar_table[0][0] = unpack_s8_planar_scalar;
+	unpack_planar_table[0][1] = unpack_u8_planar_scalar;
+	unpack_planar_table[1][0] = unpack_le16_planar_scalar;
+	unpack_planar_table[1][1] = unpack_be16_planar_scalar;
+	unpack_planar_table[2][0] = unpack_le24_planar_scalar;
+	unpack_planar_table[2][1] = unpack_be24_planar_scalar;
+	unpack_planar_table[3][0] = unpack_le32_planar_scalar;
+	unpack_planar_table[3][1] = unpack_be32_planar_scalar;
+
+#if defined (UNPACK_X86)
+	unpack_cpu(&sse2, &ssse3, &avx2);
+	if (sse2) {
+		unpack_table[0][0] = unpack_s8_sse2;
+		unpack_table[0][1] = unpack_u8_sse2;
+		unpack_table[1][0] = unpack_le16_sse2;
+		unpack_table[1][1] = unpack_be16_sse2;
+		unpack_table[3][0] = unpack_le32_copy;
+		unpack_table[3][1] = unpack_be32_sse2;
+		unpack_planar_table[0][0] = unpack_s8_planar_sse2;
+		unpack_planar_table[0][1] = unpack_u8_planar_sse2;
+		unpack_planar_table[1][0] = unpack_le16_planar_sse2;
+		unpack_planar_table[1][1] = unpack_be16_planar_sse2;
+		unpack_planar_table[3][0] = unpack_le32_planar_sse2;
+		unpack_planar_table[3][1] = unpack_be32_planar_sse2;
+		unpack_name = "sse2";
+	}
+	if (sse2 && ssse3) {
+		unpack_table[2][0] = unpack_le24_ssse3;
+		unpack_table[2][1] = unpack_be24_ssse3;
+		unpack_table[3][1] = unpack_be32_ssse3;
+		unpack_planar_table[2][0] = unpack_le24_planar_ssse3;
+		unpack_planar_table[2][1] = unpack_be24_planar_ssse3;
+		unpack_name = "ssse3";
+	}
+	if (sse2 && ssse3 && avx2) {
+		unpack_table[0][0] = unpack_s8_avx2;
+		unpack_table[0][1] = unpack_u8_avx2;
+		unpack_table[1][0] = unpack_le16_avx2;
+		unpack_table[1][1] = unpack_be16_avx2;
+		unpack_table[2][0] = unpack_le24_avx2;
+		unpack_table[2][1] = unpack_be24_avx2;
+		unpack_table[3][1] = unpack_be32_avx2;
+		unpack_planar_table[1][0] = unpack_le16_planar_avx2;
+		unpack_planar_table[1][1] = unpack_be16_planar_avx2;
+		unpack_name = "avx2";
+	}
+#elif defined (UNPACK_NEON)
+	if (unpack_has_neon()) {
+		unpack_table[0][0] = unpack_s8_neon;
+		unpack_table[0][1] = unpack_u8_neon;
+		unpack_table[1][0] = unpack_le16_neon;
+		unpack_table[1][1] = unpack_be16_neon;
+		unpack_table[2][0] = unpack_le24_neon;
+		unpack_table[2][1] = unpack_be24_neon;
+		unpack_table[3][0] = unpack_le32_copy;
+		unpack_table[3][1] = unpack_be32_neon;
+		unpack_planar_table[0][0] = unpack_s8_planar_neon;
+		unpack_planar_table[0][1] = unpack_u8_planar_neon;
+		unpack_planar_table[1][0] = unpack_le16_planar_neon;
+		unpack_planar_table[1][1] = unpack_be16_planar_neon;
+		unpack_planar_table[2][0] = unpack_le24_planar_neon;
+		unpack_planar_table[2][1] = unpack_be24_planar_neon;
+		unpack_planar_table[3][0] = unpack_le32_planar_neon;
+		unpack_planar_table[3][1] = unpack_be32_planar_neon;
+		unpack_name = "neon";
+	}
+#endif
+}
+
+/**
+ * @brief	Kernel for a sample format, the same for the whole run
+ * @param [in]	bytes_per_sample	1 to 4
+ * @param [in]	swap_order			Set for big-endian samples, or unsigned ones if 8-bit
+ * @return	The kernel
+ */
+unpack_fn unpack_select(int bytes_per_sample, int swap_order)
+{
+	pthread_once(&unpack_once, unpack_init);
+
+	return unpack_table[bytes_per_sample - 1][swap_order ? 1 : 0];
+}
+
+/**
+ * @brief	Planar kernel for a sample format of stereo input, see unpack_select()
+ */
+unpack_planar_fn unpack_select_planar(int bytes_per_sample, int swap_order)
+{
+	pthread_once(&unpack_once, unpack_init);
+
+	return unpack_planar_table[bytes_per_sample - 1][swap_order ? 1 : 0];
+}
+
+/**
+ * @brief	Name of the instruction set the kernels use
+ */
+const char *unpack_isa(void)
+{
+	pthread_once(&unpack_once, unpack_init);
+
+	return unpack_name;
+}
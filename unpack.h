@@ -0,0 +1,38 @@
+/**
+ * @file		unpack.h
+ * @version		0.6
+ * @brief		header for unpack.c
+ * @date		Feb 25, 2020
+ * @author		Siwon Kang (kkangshawn@gmail.com)
+ */
+
+#ifndef UNPACK_H_
+#define UNPACK_H_
+
+#include "main.h"
+
+/**
+ * @typedef	unpack_fn
+ * @brief	kernel unpacking PCM samples into ints, the sample in the high bits.
+ *		in and out must not overlap.
+ * @param	out					n ints
+ * @param	in					n samples as stored in the file
+ * @param	n					The number of samples
+ */
+typedef void (*unpack_fn)(int *out, const unsigned char *in, size_t n);
+
+/**
+ * @typedef	unpack_planar_fn
+ * @brief	kernel unpacking stereo PCM samples into a plane per channel
+ * @param	left				n ints of the left channel
+ * @param	right				n ints of the right channel
+ * @param	in					n frames as stored in the file
+ * @param	n					The number of frames
+ */
+typedef void (*unpack_planar_fn)(int *left, int *right, const unsigned char *in, size_t n);
+
+unpack_fn   unpack_select(int bytes_per_sample, int swap_order);
+unpack_planar_fn unpack_select_planar(int bytes_per_sample, int swap_order);
+const char *unpack_isa(void);
+
+#endif /* UNPACK_H_ */
@@ -0,0 +1,384 @@
+/**
+ * @file		walker.c
+ * @version		0.6
+ * @brief		iterative directory walker collecting the wav files of a tree
+ * @date		Feb 25, 2020
+ * @author		Siwon Kang (kkangshawn@gmail.com)
+ */
+
+#if defined (__linux) && !defined (_GNU_SOURCE)
+#define _GNU_SOURCE				/* O_DIRECTORY, fstatat() */
+#endif
+
+#include "walker.h"
+#include "atomics.h"
+
+#if defined (__linux)
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/**
+ * @brief	Entry returned by getdents64()
+ */
+struct linux_dirent64 {
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/**
+ * @typedef	walk_dir_t
+ * @brief	directory waiting to be scanned
+ * @param	fd					Descriptor opened relative to the parent, -1 to open it by path
+ * @param	path				Path of the directory, in the arena of the thread which found it
+ * @param	len					Length of path without trailing separators
+ */
+typedef struct walk_dir {
+	int fd;
+	const char *path;
+	size_t len;
+} walk_dir_t;
+
+/**
+ * @typedef	walk_state_t
+ * @brief	stack of directories shared by the walking threads
+ * @param	stack				Directories not scanned yet
+ * @param	num					The number of directories on the stack
+ * @param	capacity			The number of directories allocated
+ * @param	num_open			The number of descriptors held by the stack
+ * @param	busy				The number of threads scanning a directory
+ * @param	failed				Set if out of memory
+ * @param	recursion			Option flag to descend into subdirectories
+ * @param	found				Function called for every job found, NULL if none
+ * @param	entered				Function called for every directory read, NULL if none
+ * @param	arg					Argument of found and entered
+ * @param	lock				Mutex for all of the above
+ * @param	cond				Signaled when a directory is pushed or the walk is over
+ */
+typedef struct walk_state {
+	walk_dir_t *stack;
+	size_t num;
+	size_t capacity;
+	int num_open;
+	int busy;
+	volatile int failed;
+	unsigned int recursion;
+	walk_found_fn found;
+	walk_dir_fn entered;
+	void *arg;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} walk_state_t;
+
+/**
+ * @typedef	walk_thread_t
+ * @brief	one walking thread
+ * @param	state				Shared stack
+ * @param	index				Index of the thread
+ * @param	list				Job list the thread adds to
+ * @param	own					Private job list of a helper thread, merged at the end
+ * @param	dents				Buffer for getdents64()
+ */
+typedef struct walk_thread {
+	walk_state_t *state;
+	int index;
+	job_list_t *list;
+	job_list_t own;
+	char *dents;
+} walk_thread_t;
+
+
+/**
+ * @brief	Push a directory found by a thread. Called with the lock held.
+ * @return	0 on success, -1 if out of memory
+ */
+static int walk_push(walk_state_t *state, int fd, const char *path, size_t len)
+{
+	if (state->num == state->capacity) {
+		size_t capacity = state->capacity ? state->capacity * 2 : 64;
+		walk_dir_t *stack = (walk_dir_t *)realloc(state->stack, sizeof(walk_dir_t) * capacity);
+
+		if (stack == NULL) {
+			fprintf(stderr, "ERROR: Cannot allocate memory.\n");
+			return -1;
+		}
+		state->stack = stack;
+		state->capacity = capacity;
+	}
+	state->stack[state->num].fd = fd;
+	state->stack[state->num].path = path;
+	state->stack[state->num].len = len;
+	state->num++;
+	if (fd >= 0) {
+		state->num_open++;
+	}
+	pthread_cond_signal(&state->cond);
+
+	return 0;
+}
+
+/**
+ * @brief	Read one directory. Wav files become jobs and subdirectories are pushed.
+ *		The type of an entry is taken from getdents64(), fstatat() is called
+ *		only if the file system does not fill it in.
+ */
+static void walk_dir(walk_thread_t *th, const walk_dir_t *dir)
+{
+	walk_state_t *state = th->state;
+	char path[PATH_MAX + 1];
+	int fd = dir->fd;
+	long n;
+
+	if (fd < 0) {
+		fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0) {
+			fprintf(stderr, "ERROR: Cannot open directory %s\n", dir->path);
+			return;
+		}
+	}
+	if (state->entered) {
+		state->entered(state->arg, dir->path);
+	}
+	memcpy(path, dir->path, dir->len);
+	path[dir->len] = '/';
+
+	while ((n = (long)syscall(SYS_getdents64, fd, th->dents, WALK_DENTS_SIZE)) > 0) {
+		long off;
+
+		for (off = 0; off < n;) {
+			struct linux_dirent64 *d = (struct linux_dirent64 *)(th->dents + off);
+			const char *name = d->d_name;
+			unsigned char type = d->d_type;
+			size_t name_len;
+			struct stat st;
+
+			off += d->d_reclen;
+			/* ignore directory name './' and '../' to prevent infinite loop */
+			if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+				continue;
+			}
+			if (type == DT_UNKNOWN) {
+				if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+					continue;
+				}
+				type = S_ISREG(st.st_mode) ? DT_REG : (S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN);
+			}
+			if (type == DT_REG ? !isWAV(name) : (type != DT_DIR || !state->recursion)) {
+				continue;
+			}
+
+			name_len = strlen(name);
+			if (dir->len + 1 + name_len > PATH_MAX) {
+				printf("%.*s/%s is too long. Maximum length is %d\n",
+						(int)dir->len, dir->path, name, PATH_MAX);
+				continue;
+			}
+			memcpy(path + dir->len + 1, name, name_len + 1);
+
+			if (type == DT_REG) {
+				job_t *job = job_list_add(th->list, path, NULL);
+
+				if (job == NULL || (state->found && state->found(state->arg, th->index, job) < 0)) {
+					ATOMIC_STORE(&state->failed, 1);
+					break;
+				}
+			}
+			else {
+				char *sub = arena_strdup(&th->list->arena, path);
+				int sub_fd = -1;
+
+				if (sub == NULL) {
+					ATOMIC_STORE(&state->failed, 1);
+					break;
+				}
+				pthread_mutex_lock(&state->lock);
+				if (state->num_open < WALK_MAX_OPEN_DIRS) {
+					sub_fd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+				}
+				if (walk_push(state, sub_fd, sub, dir->len + 1 + name_len) < 0) {
+					ATOMIC_STORE(&state->failed, 1);
+					if (sub_fd >= 0) {
+						close(sub_fd);
+					}
+				}
+				pthread_mutex_unlock(&state->lock);
+			}
+		}
+		if (ATOMIC_LOAD(&state->failed)) {
+			break;
+		}
+	}
+
+	close(fd);
+}
+
+/**
+ * @brief	Take directories from the stack until every thread runs out of them
+ */
+static void *walk_main(void *data)
+{
+	walk_thread_t *th = (walk_thread_t *)data;
+	walk_state_t *state = th->state;
+	walk_dir_t dir;
+
+	for (;;) {
+		pthread_mutex_lock(&state->lock);
+		while (state->num == 0 && state->busy > 0 && !state->failed) {
+			pthread_cond_wait(&state->cond, &state->lock);
+		}
+		if (state->num == 0 || state->failed) {
+			/* nothing left and nobody to push more */
+			pthread_cond_broadcast(&state->cond);
+			pthread_mutex_unlock(&state->lock);
+			break;
+		}
+		dir = state->stack[--state->num];
+		if (dir.fd >= 0) {
+			state->num_open--;
+		}
+		state->busy++;
+		pthread_mutex_unlock(&state->lock);
+
+		walk_dir(th, &dir);
+
+		pthread_mutex_lock(&state->lock);
+		state->busy--;
+		if (state->busy == 0 && state->num == 0) {
+			pthread_cond_broadcast(&state->cond);
+		}
+		pthread_mutex_unlock(&state->lock);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief	Add a job per wav file of the tree under param->srcfile, or a job
+ *		for param->srcfile itself if it is not a directory.
+ *		Directories are taken from an explicit stack instead of recursion, and
+ *		subdirectories are opened relative to their parent. With scan_threads
+ *		over 1, that many threads share the stack so that a wide tree on a slow
+ *		file system is read in parallel. The order of the jobs then depends on
+ *		the timing, which is fine since they are sorted afterwards.
+ *		With found, every job is also handed over as soon as it is found,
+ *		by the thread which found it.
+ * @param [out]	list		Job list
+ * @param [in]	param		Option set containing the source, -r and --scan-threads
+ * @param [in]	found		Function called for every job found, NULL if none
+ * @param [in]	entered		Function called for every directory before it is read, NULL if none.
+ *							It may be called by several threads at once.
+ * @param [in]	arg			Argument of found and entered
+ * @return	0 on success, -1 if out of memory or found failed
+ */
+int walk_tree(job_list_t *list, const opt_set_t *param, walk_found_fn found,
+			  walk_dir_fn entered, void *arg)
+{
+	job_t *job;
+	walk_state_t state;
+	walk_thread_t *threads;
+	pthread_t *tid;
+	int num_threads = (param->scan_threads > 0) ? param->scan_threads : 1;
+	size_t len = strlen(param->srcfile);
+	int created = 1;
+	int fd;
+	int i;
+
+	if (len > PATH_MAX) {
+		fprintf(stderr, "ERROR: %s is too long. Maximum length is %d\n",
+				param->srcfile, PATH_MAX);
+		return 0;
+	}
+	fd = open(param->srcfile, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		/* if param->srcfile is file */
+		job = job_list_add(list, param->srcfile, param->dstfile);
+		if (job == NULL || (found && found(arg, 0, job) < 0)) {
+			return -1;
+		}
+		return 0;
+	}
+	/* if param->srcfile is directory */
+	while (len > 0 && param->srcfile[len - 1] == '/') {
+		len--;
+	}
+
+	memset(&state, 0, sizeof(state));
+	state.recursion = param->recursion;
+	state.found = found;
+	state.entered = entered;
+	state.arg = arg;
+	pthread_mutex_init(&state.lock, NULL);
+	pthread_cond_init(&state.cond, NULL);
+
+	threads = (walk_thread_t *)calloc(num_threads, sizeof(walk_thread_t));
+	tid = (pthread_t *)malloc(sizeof(pthread_t) * num_threads);
+	for (i = 0; threads && i < num_threads; i++) {
+		threads[i].state = &state;
+		threads[i].index = i;
+		/* the first thread adds to the list itself, helpers to their own */
+		job_list_init(&threads[i].own);
+		threads[i].list = (i == 0) ? list : &threads[i].own;
+		threads[i].dents = (char *)malloc(WALK_DENTS_SIZE);
+		if (threads[i].dents == NULL) {
+			break;
+		}
+	}
+	if (threads == NULL || tid == NULL || i < num_threads) {
+		fprintf(stderr, "ERROR: Cannot allocate memory.\n");
+		/* calloc() left the rest empty, so all of them are released below */
+		num_threads = threads ? num_threads : 0;
+		state.failed = 1;
+		close(fd);
+	}
+	else if (walk_push(&state, fd, param->srcfile, len) < 0) {
+		state.failed = 1;
+		close(fd);
+	}
+	else {
+		for (i = 1; i < num_threads; i++) {
+			if (pthread_create(&tid[i], NULL, walk_main, (void *)&threads[i]) != 0) {
+				break;
+			}
+			created++;
+		}
+		/* the calling thread walks too, alone if no helper could be created */
+		walk_main((void *)&threads[0]);
+		for (i = 1; i < created; i++) {
+			pthread_join(tid[i], NULL);
+		}
+	}
+
+	/* left over if the walk failed */
+	while (state.num > 0) {
+		if (state.stack[--state.num].fd >= 0) {
+			close(state.stack[state.num].fd);
+		}
+	}
+	for (i = 0; i < num_threads; i++) {
+		if (i > 0 && job_list_merge(list, &threads[i].own) < 0) {
+			state.failed = 1;
+		}
+		job_list_free(&threads[i].own);
+		free(threads[i].dents);
+	}
+	/* without found nobody has seen the numbers yet, make them follow the list */
+	if (found == NULL) {
+		size_t j;
+
+		for (j = 0; j < list->num_jobs; j++) {
+			list->jobs[j]->idx_file = (int)j;
+		}
+	}
+	free(threads);
+	free(tid);
+	free(state.stack);
+	pthread_cond_destroy(&state.cond);
+	pthread_mutex_destroy(&state.lock);
+
+	return state.failed ? -1 : 0;
+}
+#endif
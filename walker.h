@@ -0,0 +1,45 @@
+/**
+ * @file		walker.h
+ * @version		0.6
+ * @brief		header for walker.c
+ * @date		Feb 25, 2020
+ * @author		Siwon Kang (kkangshawn@gmail.com)
+ */
+
+#ifndef WALKER_H_
+#define WALKER_H_
+
+#include "main.h"
+#include "joblist.h"
+
+/* bytes of directory entries fetched by one getdents64() call */
+#define WALK_DENTS_SIZE			(64 * 1024)
+
+/* directories kept open on the stack, the rest are reopened by path */
+#define WALK_MAX_OPEN_DIRS		256
+
+/* upper bound of --scan-threads */
+#define WALK_MAX_THREADS		64
+
+/**
+ * @typedef	walk_found_fn
+ * @brief	function called for every job as soon as it is found
+ * @param	arg					Argument given to walk_tree()
+ * @param	thread				Index of the walking thread, from 0 to scan_threads - 1
+ * @param	job					The job, owned by the job list
+ * @return	0 to go on, -1 to stop the walk
+ */
+typedef int (*walk_found_fn)(void *arg, int thread, job_t *job);
+
+/**
+ * @typedef	walk_dir_fn
+ * @brief	function called for every directory right before it is read
+ * @param	arg					Argument given to walk_tree()
+ * @param	path				Path of the directory
+ */
+typedef void (*walk_dir_fn)(void *arg, const char *path);
+
+int walk_tree(job_list_t *list, const opt_set_t *param, walk_found_fn found,
+			  walk_dir_fn entered, void *arg);
+
+#endif /* WALKER_H_ */
@@ -0,0 +1,355 @@
+/**
+ * @file		watch.c
+ * @version		0.6
+ * @brief		long-running mode encoding wav files as they are written into a directory
+ * @date		Feb 25, 2020
+ * @author		Siwon Kang (kkangshawn@gmail.com)
+ */
+
+#if defined (__linux) && !defined (_GNU_SOURCE)
+#define _GNU_SOURCE				/* ppoll() */
+#endif
+
+#include "watch.h"
+#include "walker.h"
+#include "worker.h"
+
+#if defined (__linux)
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+/* a wav file is ready once its writer closes it or it is moved in */
+#define WATCH_FILE_MASK			(IN_CLOSE_WRITE | IN_MOVED_TO)
+/* new subdirectories are watched and searched too with -r */
+#define WATCH_DIR_MASK			(IN_CREATE | IN_MOVED_TO)
+
+/**
+ * @typedef	watch_state_t
+ * @brief	state of the watch, given to the pool as the argument of watch_feed()
+ * @param	fd					inotify descriptor
+ * @param	mask				Events watched in every directory
+ * @param	paths				Path of every watched directory, indexed by watch descriptor
+ * @param	num_paths			The number of entries in paths
+ * @param	list				Job list the walker adds the jobs it finds to, emptied after every search
+ * @param	param				Option set containing the source and -r
+ * @param	queue				Queue of the running pool
+ * @param	sigmask				Signal mask to wait for events with, SIGINT and SIGTERM unblocked
+ * @param	lock				Mutex for paths, the walker adds watches from several threads
+ */
+typedef struct watch_state {
+	int fd;
+	unsigned int mask;
+	char **paths;
+	int num_paths;
+	job_list_t *list;
+	const opt_set_t *param;
+	job_queue_t *queue;
+	sigset_t sigmask;
+	pthread_mutex_t lock;
+} watch_state_t;
+
+/* set by SIGINT or SIGTERM */
+static volatile sig_atomic_t watch_stop;
+
+
+static void watch_signal(int sig)
+{
+	(void)sig;
+	watch_stop = 1;
+}
+
+/**
+ * @brief	Watch a directory, called by the walker right before the directory is
+ *		read so that no file written in the meantime is missed
+ */
+static void watch_add(void *arg, const char *path)
+{
+	watch_state_t *state = (watch_state_t *)arg;
+	int wd;
+
+	wd = inotify_add_watch(state->fd, path, state->mask);
+	if (wd < 0) {
+		fprintf(stderr, "ERROR: Cannot watch %s%s\n", path,
+				errno == ENOSPC ? ", raise fs.inotify.max_user_watches" : "");
+		return;
+	}
+
+	pthread_mutex_lock(&state->lock);
+	if (wd >= state->num_paths) {
+		int num = (wd + 1 > state->num_paths * 2) ? wd + 1 : state->num_paths * 2;
+		char **paths = (char **)realloc(state->paths, sizeof(char *) * num);
+
+		if (paths == NULL) {
+			fprintf(stderr, "ERROR: Cannot allocate memory.\n");
+			pthread_mutex_unlock(&state->lock);
+			inotify_rm_watch(state->fd, wd);
+			return;
+		}
+		memset(paths + state->num_paths, 0, sizeof(char *) * (num - state->num_paths));
+		state->paths = paths;
+		state->num_paths = num;
+	}
+	/* the same directory found again keeps its descriptor */
+	free(state->paths[wd]);
+	state->paths[wd] = strdup(path);
+	pthread_mutex_unlock(&state->lock);
+}
+
+/**
+ * @brief	Free a job of watch_job_new(), called by the worker once it is done
+ */
+static void watch_job_free(job_t *job)
+{
+	free(job);
+}
+
+/**
+ * @brief	Make a job of its own for a file found, with the path in the same
+ *		allocation. The pool frees it once it is done, so a long watch holds
+ *		only the jobs in progress rather than every file ever found.
+ * @return	The job, or NULL if out of memory
+ */
+static job_t *watch_job_new(const char *path)
+{
+	size_t len = strlen(path) + 1;
+	job_t *job = (job_t *)malloc(sizeof(job_t) + len);
+
+	if (job == NULL) {
+		fprintf(stderr, "ERROR: Cannot allocate memory.\n");
+		return NULL;
+	}
+	job->in_path = (char *)(job + 1);
+	memcpy(job->in_path, path, len);
+	job->out_path = NULL;
+	job->idx_file = 0;
+	job->size = 0;
+	job->group = NULL;
+	job->release = watch_job_free;
+
+	return job;
+}
+
+/**
+ * @brief	Hand a copy of a job the walker found to the pool
+ */
+static int watch_found(void *arg, int thread, job_t *job)
+{
+	watch_state_t *state = (watch_state_t *)arg;
+
+	job = watch_job_new(job->in_path);
+	if (job == NULL) {
+		return -1;
+	}
+	if (job_queue_feed(state->queue, thread, job) < 0) {
+		free(job);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief	Watch a directory and encode the wav files already in it.
+ *		With -r its subdirectories are watched and searched as well.
+ */
+static int watch_scan(watch_state_t *state, const char *path)
+{
+	opt_set_t param = *state->param;
+	int ret;
+
+	param.srcfile = (char *)path;
+	param.dstfile = NULL;
+	ret = walk_tree(state->list, &param, watch_found, watch_add, state);
+	/* the pool got copies, the jobs of the walker are not needed any more */
+	job_list_free(state->list);
+
+	return ret;
+}
+
+/**
+ * @brief	Handle one inotify event
+ * @return	0 to go on, -1 if out of memory
+ */
+static int watch_event(watch_state_t *state, const struct inotify_event *ev)
+{
+	char path[PATH_MAX + 1];
+	const char *dir;
+	job_t *job;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		/* events were lost, only a full search finds what they were about */
+		fprintf(stderr, "WARNING: Too many events, searching %s again\n", state->param->srcfile);
+		return watch_scan(state, state->param->srcfile);
+	}
+	if (ev->wd < 0 || ev->wd >= state->num_paths || state->paths[ev->wd] == NULL) {
+		return 0;
+	}
+	dir = state->paths[ev->wd];
+	if (ev->mask & IN_IGNORED) {
+		/* the directory is gone */
+		free(state->paths[ev->wd]);
+		state->paths[ev->wd] = NULL;
+		return 0;
+	}
+	if (ev->len == 0 || snprintf(path, sizeof(path), "%s/%s", dir, ev->name) >= (int)sizeof(path)) {
+		return 0;
+	}
+
+	if (ev->mask & IN_ISDIR) {
+		if (state->param->recursion && (ev->mask & WATCH_DIR_MASK)) {
+			/* files may have landed before the watch, so search it as well */
+			return watch_scan(state, path);
+		}
+	}
+	else if ((ev->mask & WATCH_FILE_MASK) && isWAV(ev->name)) {
+		job = watch_job_new(path);
+		if (job == NULL) {
+			return -1;
+		}
+		if (job_queue_feed(state->queue, 0, job) < 0) {
+			free(job);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief	Feed of the pool. Search the tree once, then wait for events until
+ *		SIGINT or SIGTERM. The pool finishes the jobs already given afterwards.
+ */
+static void watch_feed(job_queue_t *queue, void *arg)
+{
+	watch_state_t *state = (watch_state_t *)arg;
+	char *events;
+	struct pollfd pfd;
+
+	state->queue = queue;
+	events = (char *)malloc(WATCH_EVENTS_SIZE);
+	if (events == NULL) {
+		fprintf(stderr, "ERROR: Cannot allocate memory.\n");
+		return;
+	}
+	if (watch_scan(state, state->param->srcfile) < 0) {
+		free(events);
+		return;
+	}
+	printf("Watching %s, press Ctrl+C to stop\n", state->param->srcfile);
+	fflush(stdout);
+
+	pfd.fd = state->fd;
+	pfd.events = POLLIN;
+	while (!watch_stop) {
+		long n, off;
+
+		/* the signals are let in only while waiting, so they cannot be missed */
+		if (ppoll(&pfd, 1, NULL, &state->sigmask) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "ERROR: Waiting for events failed\n");
+			break;
+		}
+		n = (long)read(state->fd, events, WATCH_EVENTS_SIZE);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			fprintf(stderr, "ERROR: Reading events failed\n");
+			break;
+		}
+		for (off = 0; off < n;) {
+			const struct inotify_event *ev = (const struct inotify_event *)(events + off);
+
+			off += sizeof(struct inotify_event) + ev->len;
+			if (watch_event(state, ev) < 0) {
+				watch_stop = 1;
+				break;
+			}
+		}
+	}
+	printf("Stopped watching, finishing the files given so far\n");
+	free(events);
+}
+
+/**
+ * @brief	Encode the wav files under param->srcfile, then keep encoding every
+ *		wav file written or moved into it until SIGINT or SIGTERM.
+ *		The workers stay up the whole time and take the files through the
+ *		feed of the pool, so a file is encoded as soon as its writer closes
+ *		it, without searching the tree again. With -r subdirectories, also
+ *		those created later, are watched as well.
+ *		A job is freed as soon as its file is encoded, so the memory held
+ *		does not grow with the number of files seen.
+ * @param [out]	list		Job list for the walker, left empty
+ * @param [in]	param		Option set containing the source, -r and --scan-threads
+ * @return	The number of failed jobs, or -1 if the directory cannot be watched
+ */
+int watch_tree(job_list_t *list, const opt_set_t *param)
+{
+	watch_state_t state;
+	struct sigaction sa;
+	sigset_t block;
+	struct stat st;
+	int ret;
+	int i;
+
+	if (stat(param->srcfile, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "ERROR: '--watch' requires an input directory.\n");
+		return -1;
+	}
+
+	memset(&state, 0, sizeof(state));
+	state.fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (state.fd < 0) {
+		fprintf(stderr, "ERROR: Cannot create inotify instance.\n");
+		return -1;
+	}
+	state.mask = WATCH_FILE_MASK | IN_ONLYDIR | IN_DONT_FOLLOW
+		| (param->recursion ? WATCH_DIR_MASK : 0);
+	state.list = list;
+	state.param = param;
+	pthread_mutex_init(&state.lock, NULL);
+
+	/* the workers inherit the blocked signals, only the feed takes them */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = watch_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &block, &state.sigmask);
+	sigdelset(&state.sigmask, SIGINT);
+	sigdelset(&state.sigmask, SIGTERM);
+
+	ret = run_worker_pool_fed(watch_feed, &state,
+			param->scan_threads > 0 ? param->scan_threads : 1, param);
+
+	pthread_sigmask(SIG_UNBLOCK, &block, NULL);
+	for (i = 0; i < state.num_paths; i++) {
+		free(state.paths[i]);
+	}
+	free(state.paths);
+	pthread_mutex_destroy(&state.lock);
+	close(state.fd);
+
+	return ret;
+}
+
+#else
+
+int watch_tree(job_list_t *list, const opt_set_t *param)
+{
+	(void)list;
+	(void)param;
+	fprintf(stderr, "ERROR: '--watch' is supported on Linux only.\n");
+
+	return -1;
+}
+#endif
@@ -0,0 +1,20 @@
+/**
+ * @file		watch.h
+ * @version		0.6
+ * @brief		header for watch.c
+ * @date		Feb 25, 2020
+ * @author		Siwon Kang (kkangshawn@gmail.com)
+ */
+
+#ifndef WATCH_H_
+#define WATCH_H_
+
+#include "main.h"
+#include "joblist.h"
+
+/* bytes of inotify events fetched by one read() call */
+#define WATCH_EVENTS_SIZE		(64 * 1024)
+
+int watch_tree(job_list_t *list, const opt_set_t *param);
+
+#endif /* WATCH_H_ */
@@ -0,0 +1,968 @@
+/**
+ * @file		worker.c
+ * @version		0.6
+ * @brief		fixed-size worker pool taking encoding jobs from work-stealing deques
+ * @date		Feb 25, 2020
+ * @author		Siwon Kang (kkangshawn@gmail.com)
+ */
+
+#include "worker.h"
+#include "output.h"
+#include "cache.h"
+
+#if !defined (_WIN32)
+#include <unistd.h>
+#endif
+
+/* 64-bit FNV-1a */
+#define FNV_OFFSET				0xcbf29ce484222325ULL
+#define FNV_PRIME				0x100000001b3ULL
+
+
+/**
+ * @brief	Get the number of online processors to be used as the default pool size
+ */
+int get_num_cores(void)
+{
+#if defined (_WIN32)
+	SYSTEM_INFO sysinfo;
+
+	GetSystemInfo(&sysinfo);
+	return (sysinfo.dwNumberOfProcessors > 0) ? (int)sysinfo.dwNumberOfProcessors : 1;
+#else
+	long ncores = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return (ncores > 0) ? (int)ncores : 1;
+#endif
+}
+
+/**
+ * @brief	Get monotonic time in seconds
+ */
+double get_time(void)
+{
+#if defined (_WIN32)
+	return GetTickCount64() / 1000.0;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+/**
+ * @brief	Check whether any deque of the pool has a job
+ */
+static int job_queue_has_jobs(job_queue_t *queue)
+{
+	int i;
+
+	for (i = 0; i < queue->num_deques; i++) {
+		if (ws_deque_size(&queue->deques[i]) > 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief	Wake the parked workers, if any.
+ *		Callers update the deques or pending first. Both are seq_cst like idle,
+ *		so a worker about to park either sees the update or is seen here.
+ */
+static void job_queue_wake(job_queue_t *queue)
+{
+	if (ATOMIC_LOAD(&queue->idle) > 0) {
+		pthread_mutex_lock(&queue->lock);
+		pthread_cond_broadcast(&queue->cond);
+		pthread_mutex_unlock(&queue->lock);
+	}
+}
+
+/**
+ * @brief	Take the next job for a worker.
+ *		The newest job of its own deque is taken first, without a lock. Otherwise
+ *		the oldest job of another deque is stolen, trying the next workers in turn.
+ *		While other workers are still running a job that may push segments,
+ *		spin a few rounds and then park until a job is pushed.
+ * @return	Pointer of the job, or NULL if every job is done
+ */
+static job_t *job_queue_pop(job_queue_t *queue, worker_t *worker)
+{
+	ws_deque_t *own = &queue->deques[worker->id];
+	void *job;
+	int spin = 0;
+	int retry;
+	int i, ret;
+
+	for (;;) {
+		job = ws_deque_take(own);
+		if (job) {
+			return (job_t *)job;
+		}
+
+		retry = 0;
+		for (i = 1; i < queue->num_deques; i++) {
+			ret = ws_deque_steal(&queue->deques[(worker->id + i) % queue->num_deques], &job);
+			if (ret > 0) {
+				worker->num_stolen++;
+				return (job_t *)job;
+			}
+			if (ret < 0) {
+				retry = 1;
+			}
+		}
+		if (retry) {
+			continue;
+		}
+		if (ATOMIC_LOAD(&queue->pending) == 0) {
+			return NULL;
+		}
+		if (spin++ < QUEUE_SPIN_COUNT) {
+			CPU_RELAX();
+			continue;
+		}
+
+		pthread_mutex_lock(&queue->lock);
+		ATOMIC_ADD(&queue->idle, 1);
+		while (ATOMIC_LOAD(&queue->pending) > 0 && !job_queue_has_jobs(queue)) {
+			pthread_cond_wait(&queue->cond, &queue->lock);
+		}
+		ATOMIC_ADD(&queue->idle, -1);
+		pthread_mutex_unlock(&queue->lock);
+		spin = 0;
+	}
+}
+
+/**
+ * @brief	Push the segment jobs of a file split while running its job.
+ *		They go to the deque of the worker, the idle workers steal them from there.
+ * @return	0 on success, -1 if out of memory
+ */
+static int job_queue_push(job_queue_t *queue, worker_t *worker, seg_group_t *group)
+{
+	ws_deque_t *own = &queue->deques[worker->id];
+	int i;
+
+	if (ws_deque_reserve(own, group->num_segs) < 0) {
+		return -1;
+	}
+	ATOMIC_ADD(&queue->pending, group->num_segs);
+	/* pushed in reverse so that the owner takes the first segment first */
+	for (i = group->num_segs - 1; i >= 0; i--) {
+		ws_deque_push(own, &group->segs[i].job);
+	}
+	job_queue_wake(queue);
+
+	return 0;
+}
+
+/**
+ * @brief	Mark a job taken by job_queue_pop() as finished, and free it if it
+ *		is not owned by a job list
+ * @param [in]	job			The job, NULL for a segment or when the feed closes the queue
+ */
+static void job_queue_done(job_queue_t *queue, job_t *job, int failed)
+{
+	if (job && job->release) {
+		job->release(job);
+	}
+	if (failed) {
+		ATOMIC_ADD(&queue->failed, 1);
+	}
+	if (ATOMIC_ADD(&queue->pending, -1) == 1) {
+		/* the last one, release the parked workers */
+		job_queue_wake(queue);
+	}
+}
+
+/**
+ * @brief	Set encoding quality level as set in an option parameter
+ */
+static void set_quality(lame_t gf, const opt_set_t *param)
+{
+	if (param->quality == QL_MODE_BEST) {
+		lame_set_preset(gf, INSANE);
+		lame_set_quality(gf, 0);
+	}
+	else if (param->quality == QL_MODE_FAST) {
+		lame_set_force_ms(gf, 1);
+		lame_set_mode(gf, JOINT_STEREO);
+		lame_set_quality(gf, 7);
+	}
+	else {
+		lame_set_VBR_q(gf, 2);
+		lame_set_VBR(gf, vbr_default);
+	}
+	lame_set_write_id3tag_automatic(gf, 0);
+}
+
+/**
+ * @brief	Fingerprint of the encoder settings an option set leads to.
+ *		The settings are read back from lame after the preset is applied,
+ *		together with the version of lame and of the input reader, so any
+ *		change of them changes the fingerprint. Splitting is part of it as it
+ *		changes the frames.
+ * @return	FNV-1a hash of the settings
+ */
+unsigned long long settings_fingerprint(const opt_set_t *param)
+{
+	unsigned long long hash = FNV_OFFSET;
+	char settings[256];
+	lame_t gf;
+	int i;
+
+	gf = lame_init();
+	if (gf == NULL) {
+		snprintf(settings, sizeof(settings), "%s %d %d", get_lame_version(),
+				AUDIO_READER_VERSION, param->quality);
+	}
+	else {
+		set_quality(gf, param);
+		snprintf(settings, sizeof(settings), "%s %d %d %d %d %d %d %d %d %d %d",
+				get_lame_version(), AUDIO_READER_VERSION, lame_get_VBR(gf), lame_get_VBR_q(gf),
+				lame_get_quality(gf), (int)lame_get_mode(gf), lame_get_force_ms(gf),
+				lame_get_brate(gf), lame_get_VBR_mean_bitrate_kbps(gf),
+				lame_get_lowpassfreq(gf), param->split);
+		lame_close(gf);
+	}
+	for (i = 0; settings[i]; i++) {
+		hash = (hash ^ (unsigned char)settings[i]) * FNV_PRIME;
+	}
+
+	return hash;
+}
+
+/**
+ * @brief	Describe the input of a job and the settings it is encoded with.
+ *		The stamp is attached to the output, and the output is up to date as
+ *		long as the stamp of the input stays the same.
+ * @param [out]	stamp		Stamp of STAMP_MAX bytes at most
+ * @param [in]	st			Status of the input
+ */
+static void make_stamp(char *stamp, const struct stat *st, unsigned long long fingerprint)
+{
+	long nsec = 0;
+
+#if defined (__linux)
+	nsec = st->st_mtim.tv_nsec;
+#endif
+	snprintf(stamp, STAMP_MAX, "%016llx %llu %lld.%09ld", fingerprint,
+			(unsigned long long)st->st_size, (long long)st->st_mtime, nsec);
+}
+
+/**
+ * @brief	Check the output of a job for -u, the way make does with the
+ *		modification times, then compare the stamp of the output.
+ *		The times alone miss a change of the settings, so an output
+ *		without a stamp is encoded again.
+ * @param [out]	stamp		Stamp the output is to carry, see make_stamp()
+ * @return	1 if the output is up to date, 0 if the job is to be encoded
+ */
+static int is_up_to_date(const char *in_path, const char *out_path,
+						 unsigned long long fingerprint, char *stamp)
+{
+	struct stat in_st, out_st;
+	char old[STAMP_MAX];
+	int len;
+
+	stamp[0] = '\0';
+	if (stat(in_path, &in_st) != 0) {
+		return 0;
+	}
+	make_stamp(stamp, &in_st, fingerprint);
+	if (stat(out_path, &out_st) != 0 || out_st.st_mtime < in_st.st_mtime) {
+		return 0;
+	}
+
+	len = out_get_attr(out_path, OUT_STAMP_ATTR, old, sizeof(old));
+	return (len > 0 && len == (int)strlen(stamp) && memcmp(old, stamp, len) == 0);
+}
+
+/**
+ * @brief	Try the encode cache for a whole-file job, see cache_lookup().
+ *		On a miss whose key is not known yet, the reader hashes the samples.
+ * @param [out]	entry		Key of the job, for cache_store()
+ * @return	1 if the output is filled from the cache, 0 if the job is to be
+ *			encoded and stored, -1 if the cache does not apply to it
+ */
+static int lookup_cache(job_queue_t *queue, th_param_t *param, cache_entry_t *entry)
+{
+	pcm_view_t view;
+	double saved;
+
+	/* a stream has no LAME tag, so it differs from the file the entry holds */
+	if (IS_STDIO(param->out_path) || get_pcm_view(param->gf, param->ctx, &view) < 0) {
+		return -1;
+	}
+	ATOMIC_ADD(&queue->cache_lookups, 1);
+	if (cache_lookup(queue->opt->cache_dir, queue->fingerprint, &view, entry, param->outf, &saved) > 0) {
+		ATOMIC_ADD(&queue->cache_hits, 1);
+		ATOMIC_ADD(&queue->cache_saved_ms, (long)(saved * 1000));
+		return 1;
+	}
+	if (!entry->known) {
+		enc_ctx_set_hash(param->ctx, &entry->hash);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief	Initialize lame library and open the input file of a job.
+ *		Set encoding quality level as set in an option parameter.
+ * @param [in,out]	job		Job to be initialized. gf is set on success.
+ * @param [in]	param		Option set
+ * @return	0 on success, -1 on failure
+ */
+static int init_encoder(th_param_t *job, const opt_set_t *param)
+{
+	lame_t gf;
+
+	if (!IS_STDIO(job->in_path) && !isWAV(job->in_path)) {
+		fprintf(stderr, "ERROR: Input file is not wav file.\n");
+		return -1;
+	}
+
+	if (strcmp(job->in_path, job->out_path) == 0 && !IS_STDIO(job->in_path)) {
+		fprintf(stderr, "ERROR: The input file name is same with output file name. Abort.\n");
+		return -1;
+	}
+
+	gf = lame_init();
+	if (gf == NULL) {
+		fprintf(stderr, "ERROR: lame_init() error.\n");
+		return -1;
+	}
+	job->gf = gf;
+	set_quality(gf, param);
+
+	if (init_infile(gf, job->in_path, job->ctx) < 0) {
+		fprintf(stderr, "ERROR: Initializing input file failed.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief	Initialize lame library and open the files of a job right before it is encoded.
+ *		A segment job reads only its own samples and writes to memory, the
+ *		segments are stitched into the output once every one of them is done.
+ * @param [in,out]	job		Job to be initialized. gf and outf are set on success.
+ * @param [in]	seg			Segment to be encoded, NULL for a whole file
+ * @param [in]	param		Option set
+ * @return	0 on success, -1 on failure
+ */
+static int init_job(th_param_t *job, const seg_job_t *seg, const opt_set_t *param)
+{
+	if (init_encoder(job, param) < 0) {
+		return -1;
+	}
+
+	if (seg) {
+		if (seek_infile(job->gf, job->ctx, seg->start_sample, seg->num_samples) < 0) {
+			fprintf(stderr, "ERROR: Seeking to segment %d failed.\n", job->seg_index + 1);
+			return -1;
+		}
+		/* frames must not borrow bits from a previous one to be cut anywhere */
+		lame_set_disable_reservoir(job->gf, 1);
+		if (job->seg_index > 0) {
+			lame_set_bWriteVbrTag(job->gf, 0);
+		}
+		job->outf = out_open_mem();
+	}
+	else {
+		/* the LAME tag is written back at the head, which a stream cannot do */
+		if (IS_STDIO(job->out_path)) {
+			lame_set_bWriteVbrTag(job->gf, 0);
+		}
+		job->outf = out_open(job->out_path, param->sync);
+	}
+	if (job->outf == NULL) {
+		fprintf(stderr, "ERROR: Initializing output file failed.\n");
+		return -1;
+	}
+
+	if (lame_init_params(job->gf) < 0) {
+		fprintf(stderr, "ERROR: lame_init_params() error.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief	Release everything init_job() acquired, even if it failed halfway
+ * @param [in]	failed		1 to throw the output away instead of moving it into place
+ * @return	0 on success, -1 if the output could not be written out
+ */
+static int deinit_job(th_param_t *job, int failed)
+{
+	int ret = 0;
+
+	if (job->outf) {
+		if (failed) {
+			out_discard(job->outf);
+		}
+		else {
+			if (job->stamp) {
+				/* without it the next -u run just encodes the file again */
+				out_set_attr(job->outf, OUT_STAMP_ATTR, job->stamp);
+			}
+			ret = out_close(job->outf);
+		}
+		job->outf = NULL;
+	}
+	close_infile(job->ctx);
+	if (job->gf) {
+		lame_close(job->gf);
+		job->gf = NULL;
+	}
+
+	return ret;
+}
+
+/**
+ * @brief	Release a segment group and the encoded frames of its segments
+ */
+static void free_seg_group(seg_group_t *group)
+{
+	int i;
+
+	for (i = 0; i < group->num_segs; i++) {
+		out_close(group->segs[i].mp3.data);
+	}
+	pthread_mutex_destroy(&group->lock);
+	free(group->stamp);
+	free(group->in_path);
+	free(group->out_path);
+	free(group->segs);
+	free(group);
+}
+
+/**
+ * @brief	Split a long file into frame-aligned segments and queue them.
+ *		Segment k covers frames [F(k), F(k+1)) of the output. Its input starts
+ *		'priming' frames earlier and ends 'priming' frames later, so that the
+ *		encoder delay and the psychoacoustic lookahead are covered by real
+ *		samples. The priming frames are dropped when the segments are stitched.
+ * @return	1 if the file is split and queued, 0 if it should be encoded as a whole,
+ *			-1 on failure
+ */
+static int split_job(job_queue_t *queue, worker_t *worker, job_t *job, th_param_t *param)
+{
+	seg_group_t *group;
+	unsigned long num_samples, num_frames, per_seg;
+	int framesize, priming, num_segs;
+	int same_rate;
+	int k;
+	struct stat st;
+
+	/* segments reopen the input, a pipe can only be read once */
+	if (stat(job->in_path, &st) != 0 || (st.st_mode & S_IFMT) != S_IFREG) {
+		return 0;
+	}
+	/* stitching patches the LAME tag into the first frame, a stream is gone by then */
+	if (IS_STDIO(param->out_path)) {
+		return 0;
+	}
+
+	if (init_encoder(param, queue->opt) < 0) {
+		deinit_job(param, 1);
+		return -1;
+	}
+	lame_set_disable_reservoir(param->gf, 1);
+	if (lame_init_params(param->gf) < 0) {
+		fprintf(stderr, "ERROR: lame_init_params() error.\n");
+		deinit_job(param, 1);
+		return -1;
+	}
+	num_samples = lame_get_num_samples(param->gf);
+	framesize = lame_get_framesize(param->gf);
+	priming = (lame_get_encoder_delay(param->gf) + 2 * 576 + framesize - 1) / framesize + 1;
+	/* resampling would not keep frame boundaries on input sample boundaries */
+	same_rate = (lame_get_in_samplerate(param->gf) == lame_get_out_samplerate(param->gf));
+	deinit_job(param, 1);
+
+	if (num_samples == MAX_U_32_NUM || !same_rate) {
+		return 0;
+	}
+	num_frames = num_samples / framesize + 1;
+	num_segs = queue->num_workers;
+	if ((unsigned long)num_segs > num_frames / SEG_MIN_FRAMES) {
+		num_segs = (int)(num_frames / SEG_MIN_FRAMES);
+	}
+	if (num_segs < 2) {
+		return 0;
+	}
+	per_seg = (num_frames + num_segs - 1) / num_segs;
+	/* rounding per_seg up can leave the last segments starting past the end */
+	num_segs = (int)((num_frames + per_seg - 1) / per_seg);
+
+	group = (seg_group_t *)calloc(1, sizeof(seg_group_t));
+	if (group) {
+		group->segs = (seg_job_t *)calloc(num_segs, sizeof(seg_job_t));
+		/* the job may be freed once it is split, before its segments are done */
+		group->in_path = strdup(job->in_path);
+		group->out_path = strdup(param->out_path);
+		group->stamp = param->stamp ? strdup(param->stamp) : NULL;
+	}
+	if (group == NULL || group->segs == NULL || group->in_path == NULL || group->out_path == NULL
+		|| (param->stamp && group->stamp == NULL)) {
+		fprintf(stderr, "ERROR: Cannot allocate memory.\n");
+		if (group) {
+			free(group->segs);
+			free(group->stamp);
+			free(group->in_path);
+			free(group->out_path);
+			free(group);
+		}
+		return -1;
+	}
+	group->num_segs = num_segs;
+	group->framesize = framesize;
+	group->num_samples = num_samples;
+	pthread_mutex_init(&group->lock, NULL);
+
+	for (k = 0; k < num_segs; k++) {
+		seg_job_t *seg = &group->segs[k];
+		unsigned long first = k * per_seg;
+		unsigned long start, end;
+
+		seg->job.in_path = group->in_path;
+		seg->job.out_path = group->out_path;
+		seg->job.idx_file = job->idx_file;
+		seg->job.group = group;
+		if (k == 0) {
+			start = 0;
+			seg->mp3.skip_frames = 0;
+		}
+		else {
+			start = (first - priming) * framesize;
+			seg->mp3.skip_frames = priming;
+		}
+		if (k == num_segs - 1) {
+			end = num_samples;
+			seg->mp3.keep_frames = 0;
+		}
+		else {
+			end = (first + per_seg + priming) * framesize;
+			if (end > num_samples) {
+				end = num_samples;
+			}
+			seg->mp3.keep_frames = per_seg;
+		}
+		seg->start_sample = start;
+		seg->num_samples = end - start;
+	}
+
+	if (job_queue_push(queue, worker, group) < 0) {
+		free_seg_group(group);
+		return -1;
+	}
+
+	return 1;
+}
+
+/**
+ * @brief	Record a finished segment. The worker finishing the last segment
+ *		of a file stitches all of them into the output.
+ * @return	0 on success or if other segments are still running, -1 on failure
+ */
+static int finish_segment(seg_job_t *seg, th_param_t *param, int failed)
+{
+	seg_group_t *group = seg->job.group;
+	mp3_segment *mp3;
+	out_file_t *outf;
+	int last;
+	int ret = 0;
+	int i;
+
+	pthread_mutex_lock(&group->lock);
+	if (failed) {
+		group->failed = 1;
+	}
+	else {
+		/* keep the frames, they are released by free_seg_group() */
+		seg->mp3.data = param->outf;
+		param->outf = NULL;
+	}
+	group->num_done++;
+	last = (group->num_done == group->num_segs);
+	pthread_mutex_unlock(&group->lock);
+
+	if (!last) {
+		return 0;
+	}
+
+	if (!group->failed) {
+		mp3 = (mp3_segment *)malloc(sizeof(mp3_segment) * group->num_segs);
+		outf = mp3 ? out_open(group->out_path, param->sync) : NULL;
+		if (outf == NULL) {
+			fprintf(stderr, "ERROR: Initializing output file failed.\n");
+			ret = -1;
+		}
+		else {
+			for (i = 0; i < group->num_segs; i++) {
+				mp3[i] = group->segs[i].mp3;
+			}
+			ret = stitch_segments(outf, mp3, group->num_segs, group->framesize, group->num_samples);
+			if (ret < 0) {
+				out_discard(outf);
+			}
+			else {
+				if (group->stamp) {
+					out_set_attr(outf, OUT_STAMP_ATTR, group->stamp);
+				}
+				if (out_close(outf) != 0) {
+					ret = -1;
+				}
+			}
+		}
+		free(mp3);
+		if (ret == 0) {
+			printf(" %2d: Done\n", param->idx_file + 1);
+		}
+	}
+	else {
+		ret = -1;
+	}
+	if (ret < 0) {
+		fprintf(stderr, "ERROR: Encoding #%d is failed\n", param->idx_file + 1);
+	}
+	free_seg_group(group);
+
+	return ret;
+}
+
+/**
+ * @brief	Worker thread body. Keep encoding jobs until the queue is drained.
+ *		Files and lame contexts are opened per job, so the resources held at
+ *		once depend on the number of workers rather than the number of files.
+ */
+static void *worker_main(void *data)
+{
+	worker_t *worker = (worker_t *)data;
+	job_queue_t *queue = worker->queue;
+	char out_path[PATH_MAX + 1];
+	char stamp[STAMP_MAX];
+	cache_entry_t entry;
+	th_param_t param;
+	enc_ctx_t *ctx;
+	seg_job_t *seg;
+	job_t *job;
+	double start;
+	int cached;
+	int ret;
+
+	/* one context per worker, recycled for every job it takes */
+	ctx = enc_ctx_new();
+	if (ctx == NULL) {
+		fprintf(stderr, "ERROR: Cannot allocate encoder context for worker #%d\n", worker->id + 1);
+		return NULL;
+	}
+	if (queue->opt->readahead) {
+		enc_ctx_set_readahead(ctx, (size_t)queue->opt->readahead << 20);
+	}
+	/* a watched file may be rewritten while it is encoded, a mapping of it would fault */
+	if (queue->opt->watch) {
+		enc_ctx_set_map(ctx, 0);
+	}
+
+	for (;;) {
+		start = get_time();
+		job = job_queue_pop(queue, worker);
+		worker->dispatch_time += get_time() - start;
+		if (job == NULL) {
+			break;
+		}
+		worker->num_jobs++;
+		seg = job->group ? (seg_job_t *)job : NULL;
+
+		param.gf = NULL;
+		param.outf = NULL;
+		param.in_path = job->in_path;
+		param.out_path = job->out_path;
+		param.idx_file = job->idx_file;
+		param.seg_index = seg ? (int)(seg - job->group->segs) : 0;
+		param.num_segs = seg ? job->group->num_segs : 1;
+		param.ctx = ctx;
+		param.sync = queue->opt->sync;
+		param.stamp = NULL;
+		param.pipeline = queue->opt->pipeline;
+		param.verbose = queue->opt->verbose;
+		if (param.out_path == NULL) {
+			out_path[0] = '\0';
+			set_outlist(out_path, job->in_path, queue->opt);
+			param.out_path = out_path;
+		}
+		if (queue->opt->outdir && seg == NULL
+			&& (param.out_path[0] == '\0' || out_make_dirs(param.out_path) < 0)) {
+			job_queue_done(queue, job, 1);
+			continue;
+		}
+
+		if (seg == NULL && queue->opt->incremental
+			&& !IS_STDIO(param.in_path) && !IS_STDIO(param.out_path)) {
+			if (is_up_to_date(param.in_path, param.out_path, queue->fingerprint, stamp)) {
+				if (param.verbose) {
+					printf(" %2d: %s is up to date\n", job->idx_file + 1, param.out_path);
+				}
+				ATOMIC_ADD(&queue->skipped, 1);
+				job_queue_done(queue, job, 0);
+				continue;
+			}
+			param.stamp = stamp[0] ? stamp : NULL;
+		}
+
+		if (seg == NULL && queue->opt->split) {
+			ret = split_job(queue, worker, job, &param);
+			if (ret != 0) {
+				if (ret < 0) {
+					fprintf(stderr, "ERROR: Splitting #%d is failed\n", job->idx_file + 1);
+				}
+				job_queue_done(queue, job, ret < 0);
+				continue;
+			}
+		}
+
+		start = get_time();
+		cached = -1;
+		ret = init_job(&param, seg, queue->opt);
+		if (ret < 0) {
+			fprintf(stderr, "ERROR: init_job() failed, (%s)\n", job->in_path);
+		}
+		else if (seg == NULL && queue->opt->cache_dir
+				 && (cached = lookup_cache(queue, &param, &entry)) > 0) {
+			printf(" %2d: %-25s -> %-25s (cached)\n", job->idx_file + 1, param.in_path, param.out_path);
+		}
+		else if (lame_encoder_loop(&param) != NULL) {
+			fprintf(stderr, "ERROR: Encoding #%d is failed\n", job->idx_file + 1);
+			ret = -1;
+		}
+		if (seg) {
+			ret = finish_segment(seg, &param, ret < 0);
+		}
+		if (deinit_job(&param, ret < 0) < 0 && ret >= 0) {
+			fprintf(stderr, "ERROR: Writing #%d is failed\n", job->idx_file + 1);
+			ret = -1;
+		}
+		if (ret >= 0 && cached == 0
+			&& cache_store(queue->opt->cache_dir, &entry, param.out_path, get_time() - start) < 0) {
+			/* the output is fine, only the next run misses it */
+			fprintf(stderr, "WARNING: Cannot store #%d in the cache\n", job->idx_file + 1);
+		}
+
+		/* a segment went with its group if it was the last one */
+		job_queue_done(queue, seg ? NULL : job, ret < 0);
+	}
+	enc_ctx_free(ctx);
+
+	return NULL;
+}
+
+/**
+ * @brief	Hand a job found by a feeder to the pool.
+ *		Each feeder owns one deque behind those of the workers, which steal
+ *		from it oldest first, so jobs are encoded in the order they are found.
+ *		Only the feeder of the deque may call it.
+ * @param [in]	feed		Index of the feeder, from 0 to num_feeds - 1
+ * @return	0 on success, -1 if out of memory
+ */
+int job_queue_feed(job_queue_t *queue, int feed, job_t *job)
+{
+	ws_deque_t *deque = &queue->deques[queue->num_workers + feed];
+
+	/* numbered before any worker can see it */
+	job->idx_file = (int)ATOMIC_ADD(&queue->fed, 1);
+	ATOMIC_ADD(&queue->pending, 1);
+	if (ws_deque_push(deque, job) < 0) {
+		ATOMIC_ADD(&queue->pending, -1);
+		return -1;
+	}
+	job_queue_wake(queue);
+
+	return 0;
+}
+
+/**
+ * @brief	Run the pool until every job is done.
+ *		The jobs given up front are dealt to the deques of the workers in turn,
+ *		so that the first jobs of the list are taken first. A worker which runs
+ *		out of jobs steals from the others, so the number of threads does not
+ *		depend on the number of files and no single lock is taken for every job.
+ *		With a feed, the calling thread runs it while the workers encode, and
+ *		the queue stays open until it returns.
+ * @return	The number of failed jobs, or -1 if the pool cannot be created
+ */
+static int run_pool(job_t **jobs, size_t num_jobs, int num_workers,
+					job_feed_fn feed, void *arg, int num_feeds, const opt_set_t *opt)
+{
+	job_queue_t queue;
+	worker_t *workers;
+	pthread_t *tid;
+	int num_deques = num_workers + num_feeds;
+	int created = 0;
+	size_t j;
+	int i;
+
+	queue.opt = opt;
+	queue.num_workers = num_workers;
+	queue.num_deques = num_deques;
+	/* an open feed counts as a pending job until it returns */
+	queue.pending = (long)num_jobs + (feed ? 1 : 0);
+	queue.fed = (long)num_jobs;
+	queue.fingerprint = (opt->incremental || opt->cache_dir) ? settings_fingerprint(opt) : 0;
+	queue.skipped = 0;
+	queue.cache_lookups = 0;
+	queue.cache_hits = 0;
+	queue.cache_saved_ms = 0;
+	queue.idle = 0;
+	queue.failed = 0;
+	pthread_mutex_init(&queue.lock, NULL);
+	pthread_cond_init(&queue.cond, NULL);
+
+	tid = (pthread_t *)malloc(sizeof(pthread_t) * num_workers);
+	workers = (worker_t *)malloc(sizeof(worker_t) * num_workers);
+	queue.deques = (ws_deque_t *)calloc(num_deques, sizeof(ws_deque_t));
+	for (i = 0; queue.deques && i < num_deques; i++) {
+		if (ws_deque_init(&queue.deques[i], (long)(num_jobs / num_workers + 1)) < 0) {
+			break;
+		}
+	}
+	if (tid == NULL || workers == NULL || queue.deques == NULL || i < num_deques) {
+		fprintf(stderr, "ERROR: Cannot allocate memory.\n");
+		while (queue.deques && --i >= 0) {
+			ws_deque_destroy(&queue.deques[i]);
+		}
+		free(queue.deques);
+		free(tid);
+		free(workers);
+		pthread_cond_destroy(&queue.cond);
+		pthread_mutex_destroy(&queue.lock);
+		return -1;
+	}
+
+	/* job j goes to worker j % num_workers. pushed in reverse since the owner takes the newest first */
+	for (j = num_jobs; j-- > 0;) {
+		ws_deque_push(&queue.deques[j % num_workers], jobs[j]);
+	}
+
+	for (i = 0; i < num_workers; i++) {
+		workers[i].queue = &queue;
+		workers[i].id = i;
+		workers[i].num_jobs = 0;
+		workers[i].num_stolen = 0;
+		workers[i].dispatch_time = 0;
+	}
+	for (i = 0; i < num_workers; i++) {
+		if (pthread_create(&tid[i], NULL, worker_main, (void *)&workers[i]) != 0) {
+			fprintf(stderr, "ERROR: Cannot create worker thread #%d\n", i + 1);
+			break;
+		}
+		created++;
+	}
+	if (created > 1) {
+		printf("%d workers created\n", created);
+	}
+
+	if (feed) {
+		feed(&queue, arg);
+		/* close the queue, the workers leave once the fed jobs are done */
+		job_queue_done(&queue, NULL, 0);
+	}
+
+	if (created == 0) {
+		/* no thread available, encode on the calling thread instead */
+		worker_main((void *)&workers[0]);
+		created = 1;
+	}
+	else {
+		for (i = 0; i < created; i++) {
+			pthread_join(tid[i], NULL);
+		}
+	}
+
+	if (opt->verbose) {
+		for (i = 0; i < created; i++) {
+			printf("Worker #%d: %lu jobs (%lu stolen), %.1f usec per dispatch\n",
+					i + 1, workers[i].num_jobs, workers[i].num_stolen,
+					workers[i].num_jobs ? 1e6 * workers[i].dispatch_time / workers[i].num_jobs : 0.0);
+		}
+	}
+
+	if (opt->incremental) {
+		printf("%ld files up to date, skipped\n", queue.skipped);
+	}
+	if (opt->cache_dir) {
+		printf("Cache: %ld hits of %ld files (%.1f%%), %.3f sec of encoding saved\n",
+				queue.cache_hits, queue.cache_lookups,
+				queue.cache_lookups ? 100.0 * queue.cache_hits / queue.cache_lookups : 0.0,
+				queue.cache_saved_ms / 1000.0);
+	}
+
+	/* one flush per output file system instead of an fsync per file */
+	if (opt->sync == SYNC_BATCH && out_sync_batch() < 0) {
+		fprintf(stderr, "ERROR: Cannot sync the output files\n");
+		queue.failed++;
+	}
+
+	for (i = 0; i < num_deques; i++) {
+		ws_deque_destroy(&queue.deques[i]);
+	}
+	free(queue.deques);
+	free(workers);
+	free(tid);
+	pthread_cond_destroy(&queue.cond);
+	pthread_mutex_destroy(&queue.lock);
+
+	return queue.failed;
+}
+
+/**
+ * @brief	Encode all the jobs with a fixed number of worker threads.
+ * @param [in]	jobs		Array of pointers of the jobs to be encoded
+ * @param [in]	num_jobs	The number of jobs
+ * @param [in]	opt			Option set. num_workers 0 means the number of cores.
+ * @return	The number of failed jobs, or -1 if the pool cannot be created
+ */
+int run_worker_pool(job_t **jobs, size_t num_jobs, const opt_set_t *opt)
+{
+	int num_workers = opt->num_workers;
+
+	if (num_workers < 1) {
+		num_workers = get_num_cores();
+	}
+	/* without splitting, a worker has nothing to do once every file is taken */
+	if (!opt->split && (size_t)num_workers > num_jobs) {
+		num_workers = (int)num_jobs;
+	}
+
+	return run_pool(jobs, num_jobs, num_workers, NULL, NULL, 0, opt);
+}
+
+/**
+ * @brief	Encode jobs while they are still being found.
+ *		feed runs on the calling thread and gives each job to the pool with
+ *		job_queue_feed() as soon as it is found, so the first files are encoded
+ *		while the rest of the tree is searched. The pool finishes once feed
+ *		has returned and every job it gave is done.
+ * @param [in]	feed		Function finding the jobs
+ * @param [in]	arg			Argument of feed
+ * @param [in]	num_feeds	The number of threads of feed calling job_queue_feed()
+ * @param [in]	opt			Option set. num_workers 0 means the number of cores.
+ * @return	The number of failed jobs, or -1 if the pool cannot be created
+ */
+int run_worker_pool_fed(job_feed_fn feed, void *arg, int num_feeds, const opt_set_t *opt)
+{
+	int num_workers = opt->num_workers;
+
+	if (num_workers < 1) {
+		num_workers = get_num_cores();
+	}
+
+	return run_pool(NULL, 0, num_workers, feed, arg, num_feeds, opt);
+}
@@ -0,0 +1,137 @@
+/**
+ * @file		worker.h
+ * @version		0.6
+ * @brief		header for worker.c
+ * @date		Feb 25, 2020
+ * @author		Siwon Kang (kkangshawn@gmail.com)
+ */
+
+#ifndef WORKER_H_
+#define WORKER_H_
+
+#include "main.h"
+#include "deque.h"
+
+/* steal rounds an idle worker spins before it parks */
+#define QUEUE_SPIN_COUNT		64
+
+/* minimum number of frames per segment when a file is split */
+#define SEG_MIN_FRAMES			512
+
+/* longest stamp of an output, see make_stamp() */
+#define STAMP_MAX				96
+
+/**
+ * @typedef	seg_job_t
+ * @brief	job encoding one segment of a file split by split_job()
+ * @param	job					Job queued for the segment. job.group points to the group.
+ * @param	mp3					Encoded frames of the segment and the range to keep
+ * @param	start_sample		First input sample of the segment, including priming
+ * @param	num_samples			The number of input samples of the segment
+ */
+typedef struct seg_job {
+	job_t job;
+	mp3_segment mp3;
+	unsigned long start_sample;
+	unsigned long num_samples;
+} seg_job_t;
+
+/**
+ * @typedef	seg_group_t
+ * @brief	segments of one file. Freed by the worker stitching the last segment.
+ * @param	segs				Array of the segment jobs
+ * @param	num_segs			The number of segments
+ * @param	num_done			The number of segments finished
+ * @param	failed				Set if any segment failed
+ * @param	framesize			Samples per frame
+ * @param	num_samples			Samples of the whole input
+ * @param	in_path				Input file path
+ * @param	out_path			Output file path
+ * @param	stamp				Stamp attached to the output, NULL if none
+ * @param	lock				Mutex protecting num_done, failed and the segments
+ * @see		finish_segment()
+ */
+typedef struct seg_group {
+	seg_job_t *segs;
+	int num_segs;
+	int num_done;
+	int failed;
+	int framesize;
+	unsigned long num_samples;
+	char *in_path;
+	char *out_path;
+	char *stamp;
+	pthread_mutex_t lock;
+} seg_group_t;
+
+/**
+ * @typedef	job_queue_t
+ * @brief	job queue shared by every worker of the pool.
+ *		Each worker owns a work-stealing deque and steals from the others when its own is empty.
+ *		Jobs found while the pool runs come through the deques of the feeders.
+ * @param	deques				Array of the deques, one per worker followed by one per feeder
+ * @param	opt					Option set applied to every job
+ * @param	num_workers			The number of workers in the pool
+ * @param	num_deques			The number of deques, workers and feeders
+ * @param	pending				The number of jobs queued or running, plus one while the feed is open
+ * @param	fed					The number of jobs given so far, numbering the next one
+ * @param	fingerprint			Fingerprint of the encoder settings, for -u and --cache
+ * @param	skipped				The number of jobs skipped as up to date
+ * @param	cache_lookups		The number of jobs looked up in the encode cache
+ * @param	cache_hits			The number of jobs copied from the encode cache
+ * @param	cache_saved_ms		Milliseconds the cached jobs took to encode originally
+ * @param	idle				The number of workers parked on cond
+ * @param	failed				The number of jobs failed so far
+ * @param	lock				Mutex for parking
+ * @param	cond				Signaled when a job is pushed or the last pending job is done
+ * @see		run_worker_pool()
+ */
+typedef struct job_queue {
+	ws_deque_t *deques;
+	const opt_set_t *opt;
+	int num_workers;
+	int num_deques;
+	volatile long pending;
+	volatile long fed;
+	unsigned long long fingerprint;
+	volatile long skipped;
+	volatile long cache_lookups;
+	volatile long cache_hits;
+	volatile long cache_saved_ms;
+	volatile int idle;
+	volatile int failed;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} job_queue_t;
+
+/**
+ * @typedef	worker_t
+ * @brief	worker thread parameter
+ * @param	queue				Job queue shared by the pool
+ * @param	id					Worker index number, also the index of its deque
+ * @param	num_jobs			The number of jobs taken
+ * @param	num_stolen			The number of jobs stolen from the other workers
+ * @param	dispatch_time		Seconds spent waiting for a job, including steals and parking
+ */
+typedef struct worker {
+	job_queue_t *queue;
+	int id;
+	unsigned long num_jobs;
+	unsigned long num_stolen;
+	double dispatch_time;
+} worker_t;
+
+/**
+ * @typedef	job_feed_fn
+ * @brief	function finding jobs while the pool runs, see run_worker_pool_fed()
+ */
+typedef void (*job_feed_fn)(job_queue_t *queue, void *arg);
+
+double get_time(void);
+int get_num_cores(void);
+unsigned long long settings_fingerprint(const opt_set_t *param);
+int job_queue_feed(job_queue_t *queue, int feed, job_t *job);
+int run_worker_pool(job_t **jobs, size_t num_jobs, const opt_set_t *opt);
+int run_worker_pool_fed(job_feed_fn feed, void *arg, int num_feeds, const opt_set_t *opt);
+
+#endif /* WORKER_H_ */